@@ -4,8 +4,25 @@
 #include <linux/fs.h>           /* libfs stuff           */
 #include <linux/buffer_head.h>  /* buffer_head           */
 #include <linux/slab.h>         /* kmem_cache            */
+#include <linux/statfs.h>       /* kstatfs               */
+#include <linux/percpu_counter.h>
+#include <linux/rbtree.h>
+#include <linux/lz4.h>
+#include <linux/mm.h>           /* kvmalloc              */
+#include <linux/parser.h>       /* opciones de montaje   */
+#include <linux/seq_file.h>
+#include <linux/xattr.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/security.h>     /* etiquetas de los ficheros nuevos */
+#include <linux/workqueue.h>
+#include <linux/blkdev.h>       /* blk_plug              */
+#include <linux/kobject.h>      /* /sys/fs/assoofs       */
 #include "assoofs.h"
 
+#define CREATE_TRACE_POINTS
+#include "assoofs_trace.h"
+
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("ifranl00");
@@ -15,32 +32,197 @@ extern int register_filesystem(struct file_system_type*);
 extern int unregister_filesystem(struct file_system_type*);
 
 
+static struct kset *assoofs_kset; // /sys/fs/assoofs, un directorio por montaje
+
+/*
+* Estadisticas del montaje: cada cpu suma en su copia sin cerrojos ni atomicos, sysfs las junta al leer
+*/
+
+static inline void assoofs_stat_add(struct super_block *sb, enum assoofs_stat_item item, uint64_t n) {
+
+	this_cpu_add(ASSOOFS_SB(sb)->stats->count[item], n);
+}
+
+static inline void assoofs_stat_inc(struct super_block *sb, enum assoofs_stat_item item) {
+
+	this_cpu_inc(ASSOOFS_SB(sb)->stats->count[item]);
+}
+
+static inline void assoofs_stat_latency(struct super_block *sb, enum assoofs_lat_item op, u64 ns) {
+
+	int b = ns ? min_t(int, ilog2(ns), ASSOOFS_LAT_BUCKETS - 1) : 0;
+
+	this_cpu_inc(ASSOOFS_SB(sb)->stats->lat[op][b]);
+}
+
+/*
+* sb_bread contando si el bloque ya estaba en la cache de buffers o hubo que leerlo del dispositivo.
+* En *hit se indica cual de las dos.
+*/
+
+static struct buffer_head *assoofs_bread_hit(struct super_block *sb, sector_t block, bool *hit) {
+
+	struct buffer_head *bh = sb_getblk(sb, block);
+
+	if (!bh)
+		return NULL;
+	*hit = buffer_uptodate(bh);
+	if (*hit) {
+		assoofs_stat_inc(sb, ASSOOFS_STAT_BUFFER_HITS);
+		return bh;
+	}
+	assoofs_stat_inc(sb, ASSOOFS_STAT_BUFFER_READS);
+	if (bh_submit_read(bh)) {
+		brelse(bh);
+		return NULL;
+	}
+	return bh;
+}
+
+static struct buffer_head *assoofs_bread(struct super_block *sb, sector_t block) {
+
+	bool hit;
+
+	return assoofs_bread_hit(sb, block, &hit);
+}
+
+/*
+* sync_dirty_buffer y write_dirty_buffer contando las escrituras que llegan al dispositivo
+*/
+
+static int assoofs_sync_buffer(struct super_block *sb, struct buffer_head *bh) {
+
+	if (buffer_dirty(bh))
+		assoofs_stat_inc(sb, ASSOOFS_STAT_BUFFER_WRITES);
+	return sync_dirty_buffer(bh);
+}
+
+static void assoofs_write_buffer(struct super_block *sb, struct buffer_head *bh) {
+
+	if (buffer_dirty(bh))
+		assoofs_stat_inc(sb, ASSOOFS_STAT_BUFFER_WRITES);
+	write_dirty_buffer(bh, 0);
+}
+
+
 /****** declarcion de funciones ******/
 int assoofs_fill_super(struct super_block *sb, void *data, int silent);
 struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no);
+static struct assoofs_inode_info *assoofs_new_inode_info(void);
+static struct assoofs_inode_info *assoofs_inode_slot(struct super_block *sb, uint64_t inode_no, struct buffer_head **bh);
+static uint64_t assoofs_inode_block(struct super_block *sb, uint64_t inode_no);
+static int assoofs_preload_itable(struct super_block *sb);
+static void assoofs_release_itable(struct assoofs_sb_info *sbi);
 static struct inode *assoofs_get_inode(struct super_block *sb, int ino);
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block);
+int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t goal, uint64_t *block);
+int assoofs_new_blocks(struct super_block *sb, uint64_t goal, uint64_t count, uint64_t *block, uint64_t *got);
+void assoofs_free_blocks(struct super_block *sb, uint64_t block, uint64_t count);
+static int assoofs_load_groups(struct super_block *sb);
+static void assoofs_release_groups(struct assoofs_sb_info *sbi);
+static long assoofs_nr_cached_objects(struct super_block *sb, struct shrink_control *sc);
+static long assoofs_free_cached_objects(struct super_block *sb, struct shrink_control *sc);
+static int assoofs_sysfs_register(struct super_block *sb);
+static void assoofs_sysfs_unregister(struct assoofs_sb_info *sbi);
+static uint64_t assoofs_spread_goal(struct super_block *sb, uint64_t g);
+static int assoofs_new_inode_number(struct super_block *sb, struct inode *dir, bool is_dir, uint64_t *ino);
+static void assoofs_free_inode_number(struct super_block *sb, uint64_t ino, bool is_dir);
+static uint64_t assoofs_inode_group_goal(struct super_block *sb, uint64_t ino);
+static int assoofs_flush_delalloc(struct inode *inode);
+static void assoofs_drop_delalloc(struct inode *inode);
+static uint32_t assoofs_extent_meta(struct assoofs_inode_info *inode_info, uint64_t extra);
+static void assoofs_delalloc_meta_trim(struct inode *inode);
+typedef int (*assoofs_dir_actor)(void *priv, const char *name, int len, uint64_t inode_no);
+static int assoofs_dir_walk(struct super_block *sb, struct assoofs_inode_info *dir_info, assoofs_dir_actor actor, void *priv);
+static int assoofs_dir_add_entry(struct super_block *sb, struct inode *dir, const struct qstr *name, uint64_t inode_no, uint64_t *dirent_block);
+static int assoofs_dir_remove_entry(struct super_block *sb, struct inode *dir, const struct qstr *name);
+static int assoofs_uninline_file(struct inode *inode);
+static int assoofs_pack_tail(struct inode *inode);
+static int assoofs_unpack_tail(struct inode *inode);
+static int assoofs_sync_group(struct super_block *sb, uint64_t g);
+static int assoofs_sync_inode_info(struct super_block *sb, uint64_t inode_no);
+static void assoofs_merge_extents(struct assoofs_inode_info *inode_info);
+static int assoofs_cut_extents(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t first, uint64_t end,
+		struct list_head *ranges);
+static int assoofs_store_extents(struct super_block *sb, struct assoofs_inode_mem *mem);
+static int assoofs_sync_extents(struct super_block *sb, struct assoofs_inode_info *inode_info);
+static int assoofs_load_extents(struct super_block *sb, struct assoofs_inode_info *inode_info);
+static void assoofs_release_extents(struct assoofs_inode_mem *mem);
+static void assoofs_defer_free_extents(struct assoofs_inode_info *inode_info, struct list_head *ranges);
+static void assoofs_release_tail(struct super_block *sb, struct assoofs_inode_info *inode_info);
+static int assoofs_refcount_adjust(struct super_block *sb, uint64_t start, uint64_t len, int delta);
+static int assoofs_load_cluster(struct inode *inode, uint64_t cluster, bool keep);
+static int assoofs_flush_cluster(struct inode *inode);
+static int assoofs_cut_clusters(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t old_size, uint64_t size, struct list_head *ranges);
+static void assoofs_release_decompress(struct assoofs_sb_info *sbi);
 void assoofs_save_sb_info(struct super_block *vsb);
 int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
-struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search);
+static void assoofs_times_to_info(struct inode *inode, struct assoofs_inode_info *inode_info);
+static void assoofs_times_from_info(struct inode *inode, struct assoofs_inode_info *inode_info);
+static int assoofs_save_inode_times(struct inode *inode);
 void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode);
 static struct dentry *assoofs_mount(struct file_system_type *fs_type, int flags, const char *dev_name, void *data);
+/*
+ *  Operaciones sobre el superbloque
+ */
+static int assoofs_statfs(struct dentry *dentry, struct kstatfs *buf);
+static int assoofs_sync_fs(struct super_block *sb, int wait);
+static void assoofs_put_super(struct super_block *sb);
+static int assoofs_show_options(struct seq_file *seq, struct dentry *root);
+static int assoofs_remount(struct super_block *sb, int *flags, char *data);
+static int assoofs_write_inode(struct inode *inode, struct writeback_control *wbc);
+static void assoofs_evict_inode(struct inode *inode);
+static void assoofs_kill_sb(struct super_block *sb);
+static void assoofs_usage_charge(struct dentry *dentry, int64_t bytes, int64_t inodes);
+static void assoofs_usage_flush(struct assoofs_sb_info *sbi);
+static void assoofs_usage_work(struct work_struct *work);
+static int assoofs_orphan_add(struct inode *inode);
+static void assoofs_discard_new_inode(struct inode *inode);
+static void assoofs_orphan_del(struct super_block *sb, struct assoofs_orphan *orphan);
+static void assoofs_orphan_release(struct super_block *sb, struct assoofs_orphan *orphan);
+static int assoofs_load_orphans(struct super_block *sb);
+static void assoofs_reclaim_orphans(struct super_block *sb);
+static void assoofs_defer_free(struct list_head *ranges, uint64_t start, uint64_t len, bool shared);
+static void assoofs_reclaim_later(struct super_block *sb, struct list_head *ranges);
+static int assoofs_reclaim_inode(struct super_block *sb, struct assoofs_orphan *orphan);
+static void assoofs_reclaim_work(struct work_struct *work);
+static void assoofs_release_reclaim(struct assoofs_sb_info *sbi);
 /*
  *  Operaciones sobre inodos
  */
 static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
 static int assoofs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
+static int assoofs_symlink(struct inode *dir, struct dentry *dentry, const char *symname);
+static int assoofs_unlink(struct inode *dir, struct dentry *dentry);
+static int assoofs_rmdir(struct inode *dir, struct dentry *dentry);
+static int assoofs_setattr(struct dentry *dentry, struct iattr *attr);
 struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
+static const char *assoofs_get_link(struct dentry *dentry, struct inode *inode, struct delayed_call *done);
+static ssize_t assoofs_listxattr(struct dentry *dentry, char *buffer, size_t size);
+static int assoofs_xattr_get(const struct xattr_handler *handler, struct dentry *unused, struct inode *inode,
+		const char *name, void *buffer, size_t size);
+static int assoofs_xattr_set(const struct xattr_handler *handler, struct dentry *unused, struct inode *inode,
+		const char *name, const void *value, size_t size, int flags);
+static bool assoofs_xattr_trusted_list(struct dentry *dentry);
+static int assoofs_init_security(struct inode *inode, struct inode *dir, const struct qstr *qstr);
+static void assoofs_xattr_cache_destroy(struct assoofs_sb_info *sbi);
 
 /*
  *  Operaciones sobre ficheros
  */
 ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos);
 ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos);
+static long assoofs_fallocate(struct file *file, int mode, loff_t offset, loff_t len);
+static loff_t assoofs_llseek(struct file *file, loff_t offset, int whence);
+static int assoofs_clone_refs(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t first, uint64_t end, int delta, uint64_t *done);
+static int assoofs_clone_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, u64 len);
+static long assoofs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+static int assoofs_truncate(struct inode *inode, loff_t size);
 /*
  *  Operaciones sobre directorios
  */
 static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
+static long assoofs_dir_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
 /**** fin declaracion de funciones ****/
 /*************************structs*********************************/
@@ -51,7 +233,7 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
     .owner   = THIS_MODULE,
     .name    = "assoofs",
     .mount   = assoofs_mount,
-    .kill_sb = kill_litter_super,
+    .kill_sb = assoofs_kill_sb,
 };
 
 /*
@@ -59,28 +241,107 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
  */
 static const struct super_operations assoofs_sops = {
     .drop_inode = generic_delete_inode,
+    .write_inode = assoofs_write_inode,
+    .evict_inode = assoofs_evict_inode,
+    .statfs = assoofs_statfs,
+    .sync_fs = assoofs_sync_fs,
+    .put_super = assoofs_put_super,
+    .show_options = assoofs_show_options,
+    .remount_fs = assoofs_remount,
+    .nr_cached_objects = assoofs_nr_cached_objects,
+    .free_cached_objects = assoofs_free_cached_objects,
 };
 
 static struct inode_operations assoofs_inode_ops = { //para manejar los inodos
     .create = assoofs_create, //crea nuevos inodos para archivos
     .lookup = assoofs_lookup, 
     .mkdir = assoofs_mkdir,
+    .symlink = assoofs_symlink,
+    .unlink = assoofs_unlink,
+    .rmdir = assoofs_rmdir,
+    .setattr = assoofs_setattr,
+    .listxattr = assoofs_listxattr,
+};
+
+/*
+ * Enlaces simbolicos: si el destino cabe en el registro i_link apunta a inline_data y se resuelve
+ * con simple_get_link; si no, se lee de su bloque en cada resolucion.
+ */
+static const struct inode_operations assoofs_fast_symlink_inode_ops = {
+    .get_link = simple_get_link,
+    .listxattr = assoofs_listxattr,
+};
+
+static const struct inode_operations assoofs_symlink_inode_ops = {
+    .get_link = assoofs_get_link,
+    .listxattr = assoofs_listxattr,
+};
+
+/*
+ * Atributos extendidos: flags guarda el name_index de las entradas de cada prefijo
+ */
+static const struct xattr_handler assoofs_xattr_user_handler = {
+    .prefix = XATTR_USER_PREFIX,
+    .flags = ASSOOFS_XATTR_USER,
+    .get = assoofs_xattr_get,
+    .set = assoofs_xattr_set,
+};
+
+static const struct xattr_handler assoofs_xattr_trusted_handler = {
+    .prefix = XATTR_TRUSTED_PREFIX,
+    .flags = ASSOOFS_XATTR_TRUSTED,
+    .list = assoofs_xattr_trusted_list,
+    .get = assoofs_xattr_get,
+    .set = assoofs_xattr_set,
+};
+
+static const struct xattr_handler assoofs_xattr_security_handler = {
+    .prefix = XATTR_SECURITY_PREFIX,
+    .flags = ASSOOFS_XATTR_SECURITY,
+    .get = assoofs_xattr_get,
+    .set = assoofs_xattr_set,
+};
+
+static const struct xattr_handler *assoofs_xattr_handlers[] = {
+    &assoofs_xattr_user_handler,
+    &assoofs_xattr_trusted_handler,
+    &assoofs_xattr_security_handler,
+    NULL
+};
+
+static const struct xattr_handler *assoofs_xattr_handler_map[] = {
+    [ASSOOFS_XATTR_USER] = &assoofs_xattr_user_handler,
+    [ASSOOFS_XATTR_TRUSTED] = &assoofs_xattr_trusted_handler,
+    [ASSOOFS_XATTR_SECURITY] = &assoofs_xattr_security_handler,
 };
 
 const struct file_operations assoofs_file_operations = {
     .read = assoofs_read,
     .write = assoofs_write,
+    .fallocate = assoofs_fallocate,
+    .llseek = assoofs_llseek,
+    .clone_file_range = assoofs_clone_file_range,
+    .unlocked_ioctl = assoofs_ioctl,
+    .fsync = assoofs_fsync,
 };
 
 const struct file_operations assoofs_dir_operations = { /*doubt*/
     .owner = THIS_MODULE,
     .iterate = assoofs_iterate,
+    .fsync = assoofs_fsync,
+    .unlocked_ioctl = assoofs_dir_ioctl,
 };
 
 
 /***********************fin structs*************************/
 static int __init assoofs_init(void) {
-    int ret = register_filesystem(&assoofs_type);
+    int ret;
+
+    BUILD_BUG_ON(sizeof(struct assoofs_inode_info) != ASSOOFS_INODE_SIZE); // la tabla de inodos depende de este tamanyo
+    assoofs_kset = kset_create_and_add("assoofs", NULL, fs_kobj);
+    if (!assoofs_kset)
+        return -ENOMEM;
+    ret = register_filesystem(&assoofs_type);
     // Control de errores a partir del valor de ret
 	if(ret == 0) {
 
@@ -89,10 +350,12 @@ static int __init assoofs_init(void) {
 	}else{
 
 		printk(KERN_ERR "AN error has occurred in the initiation\n");
+		kset_unregister(assoofs_kset);
+		assoofs_kset = NULL;
 
 	}
 
-    return 0;
+    return ret;
 }
 
 /*
@@ -109,14 +372,70 @@ static struct dentry *assoofs_mount(struct file_system_type *fs_type, int flags,
 /*
  *  Inicialización del superbloque
  */
+/*
+* Opciones de montaje:
+*  - compress: los ficheros nuevos se crean comprimidos (como chattr +c)
+*  - nocompress: el valor por defecto
+*  - preload: lee la tabla de inodos entera al montar y la deja en memoria
+*  - nopreload: el valor por defecto, cada registro se lee al buscar su inodo
+*/
+
+enum { Opt_compress, Opt_nocompress, Opt_preload, Opt_nopreload, Opt_err };
+
+static const match_table_t assoofs_tokens = {
+	{ Opt_compress, "compress" },
+	{ Opt_nocompress, "nocompress" },
+	{ Opt_preload, "preload" },
+	{ Opt_nopreload, "nopreload" },
+	{ Opt_err, NULL },
+};
+
+static int assoofs_parse_options(struct assoofs_sb_info *sbi, char *options) {
+
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, assoofs_tokens, args)) {
+		case Opt_compress:
+			sbi->compress = true;
+			break;
+		case Opt_nocompress:
+			sbi->compress = false;
+			break;
+		case Opt_preload:
+			sbi->preload = true;
+			break;
+		case Opt_nopreload:
+			sbi->preload = false;
+			break;
+		default:
+			printk(KERN_ERR "Unknown mount option \"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
 int assoofs_fill_super(struct super_block *sb, void *data, int silent) {   
     
     // 1.- Leer la información persistente del superbloque del dispositivo de bloques 
 	struct inode *root_inode;
 	struct buffer_head *bh;
 	struct assoofs_super_block_info *assoofs_sb;
+	struct assoofs_sb_info *sbi;
+	int ret;
 	
 	bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER); // sb lo recibe assoofs_fill_super como argumento
+	if (!bh) {
+		printk(KERN_ERR "The superblock cannot be read\n");
+		return -EIO;
+	}
 	assoofs_sb = (struct assoofs_super_block_info *)bh->b_data;
 	
 	printk(KERN_INFO "assoofs_fill_super request\n");
@@ -126,30 +445,120 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
 		
 		printk(KERN_ERR "The magic number is incorrect\n");
 		brelse(bh);
-		return -1;
+		return -EINVAL;
 
 	}
 	if(assoofs_sb->block_size != ASSOOFS_DEFAULT_BLOCK_SIZE){
 
 		printk(KERN_ERR "The block size is incorrect\n");
 		brelse(bh);
-		return -1;
+		return -EINVAL;
+	}
+	if(assoofs_sb->version != ASSOOFS_VERSION){
+
+		printk(KERN_ERR "Unsupported image version %llu, rebuild it with mkassoofs\n", assoofs_sb->version);
+		brelse(bh);
+		return -EINVAL;
+	}
+	// el resto del modulo divide por estos valores y el mapa de bits de cada grupo ocupa un solo bloque;
+	// los grupos tienen que cubrir justo blocks_count (el ultimo puede ser mas corto) y caber en el dispositivo
+	if (!assoofs_sb->groups_count || !assoofs_sb->blocks_per_group || !assoofs_sb->inodes_per_group ||
+			assoofs_sb->blocks_per_group > ASSOOFS_DEFAULT_BLOCK_SIZE * 8 ||
+			assoofs_sb->inodes_per_group > ASSOOFS_DEFAULT_BLOCK_SIZE * 8 ||
+			assoofs_sb->groups_count != DIV_ROUND_UP(assoofs_sb->blocks_count, assoofs_sb->blocks_per_group) ||
+			assoofs_sb->blocks_count > i_size_read(sb->s_bdev->bd_inode) / ASSOOFS_DEFAULT_BLOCK_SIZE) {
+
+		printk(KERN_ERR "The group geometry is incorrect\n");
+		brelse(bh);
+		return -EINVAL;
 	}
 
 
     // 3.- Escribir la información persistente leída del dispositivo de bloques en el superbloque sb, incluído el campo s_op con las operaciones que soporta.
 	
 	sb->s_magic = ASSOOFS_MAGIC; //Asignaremos el número mágico ASSOOFS MAGIC definido en 						assoofs.h al campo s magic del superbloque sb.
-	sb->s_maxbytes = ASSOOFS_DEFAULT_BLOCK_SIZE; //Asignaremos el tamaño de bloque ASSOOFS 					DEFAULT BLOCK SIZE definido en assoofs.h al campo s maxbytes del 					superbloque sb.
+	// los tramos guardan el bloque logico en 32 bits; con el indice de tramos no hay otro limite que el espacio libre
+	// (un fichero disperso puede pasar del tamanyo del dispositivo)
+	sb->s_maxbytes = min_t(loff_t, (loff_t)U32_MAX * ASSOOFS_DEFAULT_BLOCK_SIZE, MAX_LFS_FILESIZE);
+	// fechas con nanosegundos. Con -o lazytime el VFS deja los cambios solo de fechas en I_DIRTY_TIME y los
+	// manda a write_inode al hacer sync, junto con otro cambio del inodo o cuando caducan (dirtytime_expire_seconds)
+	sb->s_time_gran = 1;
+	sb->s_max_links = U16_MAX; // el nlink de un directorio sale de subdirs, que es de 16 bits
 
 	sb->s_op = &assoofs_sops; //signaremos operaciones (campo s op al superbloque sb. Las 		operaciones del superbloque se definen como una variable de tipo struct super operations
+	sb->s_xattr = assoofs_xattr_handlers;
+
+	// El bloque del superbloque se queda retenido mientras dure el montaje, asi los contadores se actualizan en memoria y solo se escriben en sync_fs/put_super
+	sbi = kzalloc(sizeof(struct assoofs_sb_info), GFP_KERNEL);
+	if (!sbi) {
+		brelse(bh);
+		return -ENOMEM;
+	}
+	sbi->sbh = bh;
+	sbi->asb = assoofs_sb;
+	mutex_init(&sbi->lock);
+	sbi->groups_count = assoofs_sb->groups_count;
+	sbi->blocks_per_group = assoofs_sb->blocks_per_group;
+	sbi->inodes_per_group = assoofs_sb->inodes_per_group;
+	mutex_init(&sbi->compress_lock);
+	mutex_init(&sbi->xattr_lock);
+	hash_init(sbi->xattr_cache);
+	spin_lock_init(&sbi->usage_lock);
+	INIT_LIST_HEAD(&sbi->usage_dirty);
+	mutex_init(&sbi->usage_mutex);
+	INIT_DELAYED_WORK(&sbi->usage_work, assoofs_usage_work);
+	sbi->sb = sb;
+	mutex_init(&sbi->orphan_lock);
+	INIT_LIST_HEAD(&sbi->orphans);
+	spin_lock_init(&sbi->reclaim_lock);
+	INIT_LIST_HEAD(&sbi->reclaim_inodes);
+	INIT_LIST_HEAD(&sbi->reclaim_ranges);
+	INIT_WORK(&sbi->reclaim_work, assoofs_reclaim_work);
+	if (assoofs_parse_options(sbi, data)) {
+		kfree(sbi);
+		brelse(bh);
+		return -EINVAL;
+	}
 
-	sb->s_fs_info = assoofs_sb;
+	// una imagen empaquetada no tiene sitio libre ni se puede reorganizar: siempre de solo lectura
+	if (assoofs_sb->flags & ASSOOFS_SB_READONLY) {
+		sbi->image_ro = true;
+		sb->s_flags |= SB_RDONLY;
+		printk(KERN_INFO "Read-only image, mounted read-only\n");
+	}
+
+	ret = percpu_counter_init(&sbi->free_blocks_counter, assoofs_sb->free_blocks_count, GFP_KERNEL);
+	if (ret)
+		goto out_free_sbi;
+	ret = percpu_counter_init(&sbi->free_inodes_counter, assoofs_sb->free_inodes_count, GFP_KERNEL);
+	if (ret)
+		goto out_destroy_blocks;
+	ret = percpu_counter_init(&sbi->delalloc_blocks_counter, 0, GFP_KERNEL);
+	if (ret)
+		goto out_destroy_inodes;
+	ret = -ENOMEM;
+	sbi->stats = alloc_percpu(struct assoofs_stats);
+	if (!sbi->stats)
+		goto out_destroy_delalloc;
+
+	sb->s_fs_info = sbi;
+
+	// Estado en memoria de los grupos; sus descriptores y mapas de bits se leen al usar cada grupo
+	ret = assoofs_load_groups(sb);
+	if (ret)
+		goto out_release_groups;
+
+	// con preload la tabla de inodos se lee ahora de una vez; si no cabe en memoria se sigue sin ella
+	if (sbi->preload && assoofs_preload_itable(sb))
+		printk(KERN_ERR "No se pudo precargar la tabla de inodos, se leera al buscar cada inodo\n");
 	
     // 4.- Crear el inodo raíz y asignarle operaciones sobre inodos (i_op) y sobre directorios (i_fop)
 	
 
+	ret = -ENOMEM;
 	root_inode = new_inode(sb);
+	if (!root_inode)
+		goto out_release_groups;
 
 	inode_init_owner(root_inode, NULL, S_IFDIR); // S_IFDIR para directorios, S_IFREG para 		ficheros.
 
@@ -157,109 +566,410 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
 	root_inode->i_sb = sb; // puntero al superbloque
 	root_inode->i_op = &assoofs_inode_ops; // dirección de una variable de tipo struct (operaciones sobre inodo inode_operations previamente declarada
 	root_inode->i_fop = &assoofs_dir_operations; // dirección de una variable de tipo struct 
-	root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode); // fechas.
 	root_inode->i_private = assoofs_get_inode_info(sb, ASSOOFS_ROOTDIR_INODE_NUMBER); //Información persistente del inodo leyendo el bloque de disco y como cargar el inodo se hace varias veces creamos una funcion
+	if (!root_inode->i_private) {
+		iput(root_inode);
+		ret = -EIO;
+		goto out_release_groups;
+	}
+	assoofs_times_from_info(root_inode, root_inode->i_private); // fechas.
+	set_nlink(root_inode, 2 + ((struct assoofs_inode_info *)root_inode->i_private)->subdirs); // "." y el ".." de cada subdirectorio
+	ASSOOFS_I(root_inode)->vfs_inode = root_inode;
 
 	//decirle al struct de entry que le corresponde al dir raiz para cuando monte algo sepa cual es el raiz
 	sb->s_root = d_make_root(root_inode);
 	if(!sb->s_root) {
-		brelse(bh);
-		return -1;
+		ret = -ENOMEM;
+		goto out_release_groups;
 	}
 
-	brelse(bh);
+	// lo que quedo a medio borrar antes de un corte se termina de liberar en segundo plano
+	if (assoofs_load_orphans(sb))
+		printk(KERN_ERR "No se pudo leer la lista de huerfanos, sus bloques quedan ocupados\n");
+	if (!sb_rdonly(sb))
+		assoofs_reclaim_orphans(sb);
+
+	// sin /sys/fs/assoofs/<dispositivo> el montaje funciona igual
+	if (assoofs_sysfs_register(sb))
+		printk(KERN_ERR "No se pudo crear /sys/fs/assoofs/%s\n", sb->s_id);
+
     return 0;
+
+out_release_groups:
+	assoofs_release_itable(sbi);
+	assoofs_release_groups(sbi);
+	sb->s_fs_info = NULL;
+	free_percpu(sbi->stats);
+out_destroy_delalloc:
+	percpu_counter_destroy(&sbi->delalloc_blocks_counter);
+out_destroy_inodes:
+	percpu_counter_destroy(&sbi->free_inodes_counter);
+out_destroy_blocks:
+	percpu_counter_destroy(&sbi->free_blocks_counter);
+out_free_sbi:
+	kfree(sbi);
+	brelse(bh);
+	return ret;
+}
+
+
+/*
+* Directorios: recorre las entradas de un directorio, en linea o en su bloque, llamando a actor
+* con el nombre y el numero de inodo de cada una hasta que actor devuelva algo distinto de 0.
+* Devuelve 1 si se ha parado antes del final, 0 si no y -EIO si no se puede leer el bloque.
+*/
+
+static int assoofs_dir_walk(struct super_block *sb, struct assoofs_inode_info *dir_info, assoofs_dir_actor actor, void *priv) {
+
+	struct assoofs_inline_dirent *dirent;
+	struct assoofs_dir_record_entry *record;
+	struct buffer_head *bh;
+	size_t pos = 0;
+	int i;
+
+	if (dir_info->flags & ASSOOFS_INODE_INLINE) {
+		for (i = 0; i < dir_info->dir_children_count; i++) {
+			dirent = (struct assoofs_inline_dirent *)(dir_info->inline_data + pos);
+			if (actor(priv, dirent->name, dirent->name_len, dirent->inode_no))
+				return 1;
+			pos += sizeof(struct assoofs_inline_dirent) + dirent->name_len;
+		}
+		return 0;
+	}
+
+	bh = assoofs_bread(sb, dir_info->data_block_number);
+	if (!bh)
+		return -EIO;
+	record = (struct assoofs_dir_record_entry *)bh->b_data;
+	for (i = 0; i < dir_info->dir_children_count; i++, record++) {
+		if (actor(priv, record->filename, strnlen(record->filename, ASSOOFS_FILENAME_MAXLEN), record->inode_no)) {
+			brelse(bh);
+			return 1;
+		}
+	}
+	brelse(bh);
+	return 0;
+}
+
+/*
+* Bytes ocupados por las entradas de un directorio en linea
+*/
+
+static size_t assoofs_inline_dir_size(struct assoofs_inode_info *dir_info) {
+
+	struct assoofs_inline_dirent *dirent;
+	size_t pos = 0;
+	int i;
+
+	for (i = 0; i < dir_info->dir_children_count; i++) {
+		dirent = (struct assoofs_inline_dirent *)(dir_info->inline_data + pos);
+		pos += sizeof(struct assoofs_inline_dirent) + dirent->name_len;
+	}
+	return pos;
+}
+
+/*
+* Pasa un directorio en linea a un bloque propio cuando sus entradas ya no caben en el registro.
+* El bloque se escribe antes de guardar el registro que apunta a el.
+*/
+
+static int assoofs_uninline_dir(struct super_block *sb, struct inode *dir) {
+
+	struct assoofs_inode_info *dir_info = dir->i_private;
+	struct assoofs_inline_dirent *dirent;
+	struct assoofs_dir_record_entry *record;
+	struct buffer_head *bh;
+	uint64_t block;
+	size_t pos = 0;
+	int i, ret;
+
+	// mientras estaba en linea data_block_number guardaba el objetivo
+	ret = assoofs_sb_get_a_freeblock(sb, dir_info->data_block_number, &block);
+	if (ret)
+		return ret;
+
+	bh = sb_getblk(sb, block);
+	if (!bh) {
+		assoofs_free_blocks(sb, block, 1);
+		return -ENOMEM;
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+	record = (struct assoofs_dir_record_entry *)bh->b_data;
+	for (i = 0; i < dir_info->dir_children_count; i++, record++) {
+		dirent = (struct assoofs_inline_dirent *)(dir_info->inline_data + pos);
+		memcpy(record->filename, dirent->name, dirent->name_len);
+		record->inode_no = dirent->inode_no;
+		pos += sizeof(struct assoofs_inline_dirent) + dirent->name_len;
+	}
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	ret = assoofs_sync_buffer(sb, bh);
+	brelse(bh);
+	if (ret) {
+		assoofs_free_blocks(sb, block, 1);
+		return ret;
+	}
+
+	dir_info->flags &= ~ASSOOFS_INODE_INLINE;
+	memset(dir_info->inline_data, 0, ASSOOFS_INLINE_DATA_SIZE);
+	dir_info->data_block_number = block;
+	dir_info->extents[0].start = block;
+	dir_info->extents[0].len = 1;
+	assoofs_save_inode_info(sb, dir_info);
+	assoofs_sync_group(sb, block / ASSOOFS_SB(sb)->blocks_per_group); // el bloque tiene que constar como usado antes de que se escriba el registro
+	trace_assoofs_uninline_dir(sb, dir_info->inode_no, block);
+	return 0;
+}
+
+/*
+* Anyade la entrada name -> inode_no a un directorio y actualiza su numero de hijos. Si la entrada
+* queda en un bloque del directorio se devuelve en *dirent_block, si queda en linea 0.
+*/
+
+static int assoofs_dir_add_entry(struct super_block *sb, struct inode *dir, const struct qstr *name, uint64_t inode_no, uint64_t *dirent_block) {
+
+	struct assoofs_inode_info *dir_info = dir->i_private;
+	struct assoofs_inline_dirent *dirent;
+	struct assoofs_dir_record_entry *record;
+	struct buffer_head *bh;
+	size_t used;
+	int ret;
+
+	if (name->len >= ASSOOFS_FILENAME_MAXLEN)
+		return -ENAMETOOLONG;
+
+	// el directorio cambia de contenido: sus fechas van en el mismo registro que el numero de hijos
+	dir->i_mtime = dir->i_ctime = current_time(dir);
+
+	if (dir_info->flags & ASSOOFS_INODE_INLINE) {
+		used = assoofs_inline_dir_size(dir_info);
+		if (used + sizeof(struct assoofs_inline_dirent) + name->len <= ASSOOFS_INLINE_DATA_SIZE) {
+			dirent = (struct assoofs_inline_dirent *)(dir_info->inline_data + used);
+			dirent->inode_no = inode_no;
+			dirent->name_len = name->len;
+			memcpy(dirent->name, name->name, name->len);
+			dir_info->dir_children_count++;
+			assoofs_save_inode_info(sb, dir_info);
+			*dirent_block = 0;
+			return 0;
+		}
+		ret = assoofs_uninline_dir(sb, dir);
+		if (ret)
+			return ret;
+	}
+
+	if (dir_info->dir_children_count >= ASSOOFS_DIR_ENTRIES_PER_BLOCK)
+		return -ENOSPC;
+
+	bh = assoofs_bread(sb, dir_info->data_block_number);
+	if (!bh)
+		return -EIO;
+	record = (struct assoofs_dir_record_entry *)bh->b_data;
+	record += dir_info->dir_children_count; //avanza el puntero tantos elementos tenga entonces apunta al final
+	memset(record, 0, sizeof(*record));
+	memcpy(record->filename, name->name, name->len);
+	record->inode_no = inode_no;
+	mark_buffer_dirty_inode(bh, dir); //lo escribe un fsync del directorio o del hijo nuevo
+	brelse(bh);
+
+	dir_info->dir_children_count++;
+	assoofs_save_inode_info(sb, dir_info);
+	*dirent_block = dir_info->data_block_number;
+	return 0;
 }
 
+/*
+* Quita la entrada name de un directorio y actualiza su numero de hijos. En un bloque la ultima
+* entrada pasa al hueco que deja la borrada, asi siguen todas seguidas. -ENOENT si no esta.
+*/
+
+static int assoofs_dir_remove_entry(struct super_block *sb, struct inode *dir, const struct qstr *name) {
+
+	struct assoofs_inode_info *dir_info = dir->i_private;
+	struct assoofs_inline_dirent *dirent;
+	struct assoofs_dir_record_entry *record, *last;
+	struct buffer_head *bh;
+	size_t pos = 0, len, used;
+	int i;
+
+	if (dir_info->flags & ASSOOFS_INODE_INLINE) {
+		used = assoofs_inline_dir_size(dir_info);
+		for (i = 0; i < dir_info->dir_children_count; i++) {
+			dirent = (struct assoofs_inline_dirent *)(dir_info->inline_data + pos);
+			len = sizeof(struct assoofs_inline_dirent) + dirent->name_len;
+			if (dirent->name_len == name->len && !memcmp(dirent->name, name->name, name->len)) {
+				memmove(dir_info->inline_data + pos, dir_info->inline_data + pos + len, used - pos - len);
+				memset(dir_info->inline_data + used - len, 0, len);
+				goto found;
+			}
+			pos += len;
+		}
+		return -ENOENT;
+	}
+
+	bh = assoofs_bread(sb, dir_info->data_block_number);
+	if (!bh)
+		return -EIO;
+	record = (struct assoofs_dir_record_entry *)bh->b_data;
+	last = record + dir_info->dir_children_count - 1;
+	for (i = 0; i < dir_info->dir_children_count; i++, record++) {
+		if (strnlen(record->filename, ASSOOFS_FILENAME_MAXLEN) == name->len && !memcmp(record->filename, name->name, name->len)) {
+			*record = *last;
+			memset(last, 0, sizeof(*last));
+			mark_buffer_dirty_inode(bh, dir); //como al anyadir, lo escribe un fsync del directorio
+			brelse(bh);
+			goto found;
+		}
+	}
+	brelse(bh);
+	return -ENOENT;
+
+found:
+	dir_info->dir_children_count--;
+	dir->i_mtime = dir->i_ctime = current_time(dir);
+	assoofs_save_inode_info(sb, dir_info);
+	return 0;
+}
 
 /*
 * Busca cualquier inodo de un directorio
 * recibe un struct inode el inodo padre, porque para buscar el inodo saber quien es el inodo padre, otro struct dentry que representa la dupla nombre de fichero y numero de inodo y flags que no vamos a usar
 */
-struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags) {
+struct assoofs_lookup_ctx {
+	const struct qstr *name;
+	uint64_t inode_no;
+};
+
+static int assoofs_lookup_actor(void *priv, const char *name, int len, uint64_t inode_no) {
+
+	struct assoofs_lookup_ctx *ctx = priv;
+
+	if (len != ctx->name->len || memcmp(name, ctx->name->name, len))
+		return 0;
+	ctx->inode_no = inode_no;
+	return 1;
+}
+
+static struct dentry *assoofs_do_lookup(struct inode *parent_inode, struct dentry *child_dentry) {
 	
 	struct assoofs_inode_info *parent_info;
 	struct super_block *sb = parent_inode->i_sb; //i_sb, hemos guardado el superbloque parar leer el bloque qu econtine  la info del directorio padre
-	struct buffer_head *bh;
-	struct assoofs_dir_record_entry *record; //puntero aux para recorrer el content del directorio (*record)
+	struct assoofs_lookup_ctx ctx = { .name = &child_dentry->d_name };
 	struct inode *inode;
-	int i;
-	// Accedemos al bloque del disco con el contenido del directorio apuntado por paren_inode
-	printk(KERN_INFO "Lookup request\n");
+	int ret;
+	// Accedemos al contenido del directorio apuntado por parent_inode, en linea o en su bloque
 	 parent_info = parent_inode->i_private; //me creo una inode info, el campo i private metes la info del inodo que se quiera (i private es de tipo puntero a caracter entonces metes lo que sea) asi ya guardamos ahi la info del inodo padre
-	bh = sb_bread(sb, parent_info->data_block_number);//con sb_bread le paso ese superbloque y el bloque que tengo que leer saco de parent info que tine el data block number con el numero de bloque que contiene.
-
 
 	//Recorrer el contenido del directorio buscando la entrada cuyo nombre se corresponda con el que buscamos. Si se localiza la entrada, entonces tenemos construir el inodo correspondiente.
-	
-	record = (struct assoofs_dir_record_entry *)bh->b_data; //accedo al contenido del bloque y hacemos el cast apropiado 
-	for (i=0; i < parent_info->dir_children_count; i++) { //for hasta el numero de archivos que continene el directorio padre
-		if (!strcmp(record->filename, child_dentry->d_name.name)) { //en cada vuelta compruebo el nombre dell fichero, strcmp devuleve 0 si son iguales
-			inode = assoofs_get_inode(sb, record->inode_no); // ya tenemos el dir record entry, llamamos a get inode : Función auxiliar que obtine la información de un inodo a partir de su número de inodo.
-			inode_init_owner(inode, parent_inode, ((struct assoofs_inode_info *)inode->i_private)->mode); //inode_init_owner(inodo, directorio padre, el modo(un campo de los inodos es el modo (permisoso))
-			d_add(child_dentry, inode); //llamo a l add para guardarlo en la herrquia de inodos (excepto el raiz que se crea con otro especial no el d_add)
-			return NULL;
-		}
-		record++;
+	ret = assoofs_dir_walk(sb, parent_info, assoofs_lookup_actor, &ctx);
+	if (ret < 0)
+		return ERR_PTR(ret);
+	if (ret) {
+		inode = assoofs_get_inode(sb, ctx.inode_no); // ya tenemos el numero de inodo, llamamos a get inode : Función auxiliar que obtine la información de un inodo a partir de su número de inodo.
+		if (IS_ERR(inode))
+			return ERR_CAST(inode);
+		inode_init_owner(inode, parent_inode, ((struct assoofs_inode_info *)inode->i_private)->mode); //inode_init_owner(inodo, directorio padre, el modo(un campo de los inodos es el modo (permisoso))
+		d_add(child_dentry, inode); //llamo a l add para guardarlo en la herrquia de inodos (excepto el raiz que se crea con otro especial no el d_add)
+		return NULL;
 	}
 	
-    printk(KERN_INFO "Lookup request fnished\n");
     return NULL;
 }
 
+struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags) {
+
+	u64 start = ktime_get_ns(), latency;
+	struct dentry *ret = assoofs_do_lookup(parent_inode, child_dentry);
+
+	latency = ktime_get_ns() - start;
+	assoofs_stat_inc(parent_inode->i_sb, ASSOOFS_STAT_LOOKUP);
+	assoofs_stat_latency(parent_inode->i_sb, ASSOOFS_LAT_LOOKUP, latency);
+	trace_assoofs_lookup(parent_inode, child_dentry, d_really_is_positive(child_dentry) ? d_inode(child_dentry)->i_ino : 0,
+			PTR_ERR_OR_ZERO(ret), latency);
+	return ret;
+}
+
 
 /*
 * obtener un puntero al inodo número ino del superbloque sb.
 * recibe el sb y el numero de nodo (funcion auxiliar)
+* Devuelve ERR_PTR(-EIO) si no se pudo leer su registro o ERR_PTR(-ENOMEM) si no hay memoria para el inodo
 */
 static struct inode *assoofs_get_inode(struct super_block *sb, int ino){
 	
 	struct inode *inode;
 	struct assoofs_inode_info *inode_info = assoofs_get_inode_info(sb, ino);
 	//Obtener la información persistente del inodo ino
+	if (!inode_info)
+		return ERR_PTR(-EIO);
 
-	printk(KERN_INFO "GET INODE REQUESTED\n");
 	inode = new_inode(sb);
-	printk(KERN_INFO "GET INODE REUQUEST: SE INICIALIZO EL INODO\n");
+	if (!inode) {
+		assoofs_release_extents(container_of(inode_info, struct assoofs_inode_mem, info));
+		kfree(container_of(inode_info, struct assoofs_inode_mem, info));
+		return ERR_PTR(-ENOMEM);
+	}
 	
 	inode->i_ino = ino; 
-	printk(KERN_INFO "GET INODE REUQUEST: GUARDAMOS EL NUMERO DEL INODO\n");
 	
 	inode->i_sb = sb;
-	printk(KERN_INFO "GET INODE REUQUEST: LE ASIGNAMOS EL SUPERBLOQUE\n");
 	
 	inode->i_op = &assoofs_inode_ops; 
-	printk(KERN_INFO "GET INODE REUQUEST: LE ASIGANOS OPERACIONES\n");
 	
 	//antes de asignar f_ops dependiendo de si es directorio o archivo
 	if (S_ISDIR(inode_info->mode)){ 
 	
-		printk(KERN_INFO "GET INODE REUQUEST: SI ES DIRECTORIO PASA PO AQUI\n");
 		inode->i_fop = &assoofs_dir_operations;
-		printk(KERN_INFO "GET INODE directorio\n");
+		set_nlink(inode, 2 + inode_info->subdirs);
 		
 	}else if (S_ISREG(inode_info->mode)) { 
 		
-		printk(KERN_INFO "GET INODE REUQUEST: SI ES FICHERO PASA PO AQUI\n");
 		inode->i_fop = &assoofs_file_operations; 
-		printk(KERN_INFO "GET INODE fichero\n");
 	
+	}else if (S_ISLNK(inode_info->mode)) {
+
+		// un destino corto se resuelve desde el propio registro, sin leer ningun bloque
+		if (inode_info->flags & ASSOOFS_INODE_INLINE) {
+			inode->i_op = &assoofs_fast_symlink_inode_ops;
+			inode->i_link = (char *)inode_info->inline_data;
+		} else {
+			inode->i_op = &assoofs_symlink_inode_ops;
+		}
+		inode->i_size = inode_info->file_size;
+
 	}else{
 
-		printk(KERN_ERR "Unknown inode type. Neither a directory nor a file.");
+		printk(KERN_ERR "Unknown inode type. Neither a directory, a file nor a symlink.");
 	}
 	
-	inode->i_atime = current_time(inode);
-	inode->i_mtime = current_time(inode);
-	inode->i_ctime = current_time(inode);
+	assoofs_times_from_info(inode, inode_info); // las fechas guardadas en el registro
+	inode->i_generation = inode_info->generation;
 	
 	inode->i_private = inode_info;//info persistente al inodo que guardamos previamennte
+	ASSOOFS_I(inode)->vfs_inode = inode;
 	
-	printk(KERN_INFO "GET INODE REQUESTED FINISHED!!\n");
+	trace_assoofs_get_inode(sb, ino, inode_info->mode);
 	return inode;
 }
 
 
+/*
+* Deshace un inodo recien creado que no ha llegado a tener entrada en su directorio. Su registro ya
+* esta escrito y puede apuntar a bloques o atributos: pasa a la lista de huerfanos y reclaim_work lo
+* libera todo, numero incluido, cuando sale de memoria, igual que un fichero borrado.
+*/
+
+static void assoofs_discard_new_inode(struct inode *inode) {
+
+	assoofs_save_inode_info(inode->i_sb, inode->i_private); // con el bloque de atributos que se haya llegado a crear
+	if (assoofs_orphan_add(inode))
+		printk(KERN_ERR "%s: el inodo %lu no entra en la lista de huerfanos, su numero y sus bloques no se liberan\n", __func__, inode->i_ino);
+	clear_nlink(inode);
+	iput(inode);
+}
+
 /*
 * Funcion para crear carpetas
 * Recibe 
@@ -271,66 +981,90 @@ static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode
 	/*----------------crear nuevo inodo----------------------------*/
 	
 	struct super_block *sb;
-	struct buffer_head *bh;
 	struct assoofs_inode_info *inode_info;
 	struct inode *root_inode;
 	struct assoofs_inode_info *parent_inode_info;
-	struct assoofs_dir_record_entry *dir_contents;
-	uint64_t count;
-	
-	printk(KERN_INFO "New directory request\n");
+	uint64_t ino, goal;
+	int ret;
 	
 
 	sb = dir->i_sb; // obtengo un puntero al superbloque desde dir
-	count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count; // obtengo el número de inodos de la información persistente del superbloque
+	assoofs_stat_inc(sb, ASSOOFS_STAT_MKDIR);
 	
-	if(count < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED) {
+	// el numero de inodo decide el grupo del directorio nuevo
+	ret = assoofs_new_inode_number(sb, dir, true, &ino);
+	if (ret == 0) {
 		
 		root_inode = new_inode(sb);
-		root_inode->i_ino = (count + ASSOOFS_START_INO - ASSOOFS_RESERVED_INODES + 1); // Asigno número al nuevo inodo a partir de count
+		if (!root_inode) {
+			assoofs_free_inode_number(sb, ino, true);
+			return -ENOMEM;
+		}
+		root_inode->i_ino = ino;
+		root_inode->i_op = &assoofs_inode_ops;
+		root_inode->i_fop = &assoofs_dir_operations;
+		root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode);
 
 		
-		inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
+		inode_info = assoofs_new_inode_info();
+		if (!inode_info) {
+			assoofs_free_inode_number(sb, ino, true);
+			iput(root_inode);
+			return -ENOMEM;
+		}
+		inode_info->inode_no = root_inode->i_ino;
 		inode_info->mode = S_IFDIR | mode; // El segundo mode me llega como argumento
 		//inode_info->file_size = 0;
 		inode_info->dir_children_count = 0;
 		root_inode->i_private = inode_info;
-		
-		
-		if(S_ISDIR(mode)){
-			
-			inode_info->dir_children_count = 0;
-			root_inode->i_fop = &assoofs_dir_operations;
-		}
+		ASSOOFS_I(root_inode)->vfs_inode = root_inode;
 
-		assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number); //para asignarle un bloque libre
+		// Los directorios de primer nivel se reparten por los grupos, el resto van junto a su padre si comparten grupo
+		parent_inode_info = dir->i_private;
+		if (dir->i_ino == ASSOOFS_ROOTDIR_INODE_NUMBER)
+			goal = assoofs_spread_goal(sb, (ino - 1) / ASSOOFS_SB(sb)->inodes_per_group);
+		else if ((dir->i_ino - 1) / ASSOOFS_SB(sb)->inodes_per_group == (ino - 1) / ASSOOFS_SB(sb)->inodes_per_group)
+			goal = parent_inode_info->data_block_number;
+		else
+			goal = assoofs_inode_group_goal(sb, ino);
+
+		// el directorio nuevo empieza en linea y no usa bloques hasta que sus entradas no quepan en el registro;
+		// mientras tanto data_block_number solo guarda el objetivo
+		inode_info->data_block_number = goal;
+		inode_info->flags = ASSOOFS_INODE_INLINE;
 
 		assoofs_add_inode_info(sb, inode_info); //guardar la funcion persistente del nuevo inodo en disco
 
 	/*-------------------modificar el contenido del directorio padre para añadir una nueva entrada-------------------------------------------------------------------------------------------*/
 		
-		parent_inode_info = dir->i_private;
-		bh = sb_bread(sb, parent_inode_info->data_block_number);
-		dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
-		dir_contents += parent_inode_info->dir_children_count; //avanza el puntero el puntero tantos elementos tenga entonces apunta al final
-		dir_contents->inode_no = inode_info->inode_no; // inode_info es la información persistente del inodo creado en el paso 2.
-
-		strcpy(dir_contents->filename, dentry->d_name.name); //para asignar cadenas 
+		// la etiqueta de seguridad necesita el modo y el dueno; despues la entrada va en linea en el padre o en su bloque,
+		// y dir_add_entry tambien incrementa su numero de hijos
+		inode_init_owner(root_inode, dir, inode_info->mode);
+		ret = assoofs_init_security(root_inode, dir, &dentry->d_name);
+		if (!ret)
+			ret = assoofs_dir_add_entry(sb, dir, &dentry->d_name, inode_info->inode_no, &ASSOOFS_I(root_inode)->dirent_block);
+		if (ret) {
+			printk(KERN_ERR "%s: no se pudo etiquetar el inodo o anyadir la entrada al directorio padre\n", __func__);
+			assoofs_discard_new_inode(root_inode);
+			return ret;
+		}
+		ASSOOFS_I(root_inode)->parent_ino = dir->i_ino;
 
-		mark_buffer_dirty(bh); //marca como sucio
-		sync_dirty_buffer(bh); //sincronizamos
-		brelse(bh);
+		// "." del nuevo y su ".." en el padre
+		set_nlink(root_inode, 2);
+		parent_inode_info->subdirs++;
+		assoofs_save_inode_info(sb, parent_inode_info);
+		inc_nlink(dir);
 
-	/*------------------------modificar en el inodo padre para incrementar su numero de hijos----------------------*/
-		parent_inode_info->dir_children_count++;
-		assoofs_save_inode_info(sb, parent_inode_info); //actualizar esto en disco
-		
+		d_add(dentry, root_inode);
+		assoofs_usage_charge(dentry, 0, 1);
+		trace_assoofs_mkdir(dir, dentry, ino);
 		
 	}else{
-		printk(KERN_ERR "New directory requested cannot be created\n");
-		return -1;
+		if (ret == -ENOSPC)
+			printk(KERN_ERR "New directory requested cannot be created\n");
+		return ret;
 	}
-	printk(KERN_INFO "New directory requeted finisheddddddddd!!\n");
     return 0;
 }
 
@@ -338,38 +1072,46 @@ static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode
 /*
 * para crear un archivo es decir crea un inodod que apunte a ese archivo
 */
-static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
+static int assoofs_do_create(struct inode *dir, struct dentry *dentry, umode_t mode) {
 	
 	/*----------------crear nuevo inodo----------------------------*/
 	
 	struct super_block *sb;
-	struct buffer_head *bh;
 	struct inode *root_inode;
 	struct assoofs_inode_info *inode_info;
 	struct assoofs_inode_info *parent_inode_info;
-	struct assoofs_dir_record_entry *dir_contents;
-	uint64_t count;
+	uint64_t ino, goal;
+	int ret;
 	
-	printk(KERN_INFO "Create request\n");
-
 	sb = dir->i_sb; // obtengo un puntero al superbloque desde dir
-	count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count; // obtengo el número de inodos de la información persistente del superbloque
 	
-	if(count < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED) {
+	// el fichero se queda en el grupo de su directorio mientras tenga inodos libres
+	ret = assoofs_new_inode_number(sb, dir, false, &ino);
+	if (ret == 0) {
 		
 		root_inode = new_inode(sb);
+		if (!root_inode) {
+			assoofs_free_inode_number(sb, ino, false);
+			return -ENOMEM;
+		}
 		
 		root_inode->i_sb = sb;
 		root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode);
-		root_inode->i_ino = (count + ASSOOFS_START_INO - ASSOOFS_RESERVED_INODES + 1); // Asigno número al nuevo inodo a partir de count
+		root_inode->i_ino = ino;
 		root_inode->i_op = &assoofs_inode_ops;
 		
-		inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
+		inode_info = assoofs_new_inode_info();
+		if (!inode_info) {
+			assoofs_free_inode_number(sb, ino, false);
+			iput(root_inode);
+			return -ENOMEM;
+		}
 		inode_info->inode_no = root_inode->i_ino;
 		inode_info->file_size = 0;
 		inode_info->mode = mode; // El segundo mode me llega como argumento
 		
 		root_inode->i_private = inode_info;
+		ASSOOFS_I(root_inode)->vfs_inode = root_inode;
 		
 		if(S_ISREG(mode)){
 			
@@ -378,389 +1120,5888 @@ static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode
 		}
 		
 
-		assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number); //para asignarle un bloque libre
+		// un fichero nuevo no tiene bloques: se asignan cuando se vuelcan sus datos (asignacion diferida). Hasta entonces
+		// data_block_number solo guarda el objetivo: detras del bloque de su directorio, o el principio de su grupo si es otro
+		parent_inode_info = dir->i_private;
+		if ((dir->i_ino - 1) / ASSOOFS_SB(sb)->inodes_per_group == (ino - 1) / ASSOOFS_SB(sb)->inodes_per_group)
+			goal = parent_inode_info->data_block_number;
+		else
+			goal = assoofs_inode_group_goal(sb, ino);
+		inode_info->data_block_number = goal;
+		inode_info->flags = ASSOOFS_INODE_INLINE; // los primeros ASSOOFS_INLINE_DATA_SIZE bytes van en el propio registro
+		if (S_ISREG(mode) && ASSOOFS_SB(sb)->compress)
+			inode_info->flags |= ASSOOFS_INODE_COMPRESSED;
 
 		assoofs_add_inode_info(sb, inode_info); //guardar la funcion persistente del nuevo inodo en disco
 
 	/*-------------------modificar el contenido del directorio padre para añadir una nueva entrada-------------------------------------------------------------------------------------------*/
 		
-		parent_inode_info = dir->i_private;
-		bh = sb_bread(sb, parent_inode_info->data_block_number);
-		dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
-		dir_contents += parent_inode_info->dir_children_count; //avanza el puntero el puntero tantos elementos tenga entonces apunta al final
-		dir_contents->inode_no = inode_info->inode_no; // inode_info es la información persistente del inodo creado en el paso 2.
-
-		strcpy(dir_contents->filename, dentry->d_name.name); //para asignar cadenas 
-
-		mark_buffer_dirty(bh); //marca como sucio
-		sync_dirty_buffer(bh); //sincronizamos
-		brelse(bh);
+		// la etiqueta de seguridad necesita el modo y el dueno; despues la entrada va en linea en el padre o en su bloque,
+		// y dir_add_entry tambien incrementa su numero de hijos
+		inode_init_owner(root_inode, dir, inode_info->mode);
+		ret = assoofs_init_security(root_inode, dir, &dentry->d_name);
+		if (!ret)
+			ret = assoofs_dir_add_entry(sb, dir, &dentry->d_name, inode_info->inode_no, &ASSOOFS_I(root_inode)->dirent_block);
+		if (ret) {
+			printk(KERN_ERR "%s: no se pudo etiquetar el inodo o anyadir la entrada al directorio padre\n", __func__);
+			assoofs_discard_new_inode(root_inode);
+			return ret;
+		}
+		ASSOOFS_I(root_inode)->parent_ino = dir->i_ino;
 
-	/*------------------------modificar en el inodo padre para incrementar su numero de hijos----------------------*/
-		parent_inode_info->dir_children_count++;
-		assoofs_save_inode_info(sb, parent_inode_info); //actualizar esto en disco
-		
-		inode_init_owner(root_inode,dir,mode);
 		d_add(dentry,root_inode);
+		assoofs_usage_charge(dentry, 0, 1);
 		
 		
 	}else{
-		printk(KERN_ERR "New file requested cannot be created\n");
-		return -1;
+		if (ret == -ENOSPC)
+			printk(KERN_ERR "New file requested cannot be created\n");
+		return ret;
 	}
 
 
-    printk(KERN_INFO " Create: New file request finished\n");
     return 0;
 }
 
+static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
+
+	u64 start = ktime_get_ns(), latency;
+	int ret = assoofs_do_create(dir, dentry, mode);
+
+	latency = ktime_get_ns() - start;
+	assoofs_stat_inc(dir->i_sb, ASSOOFS_STAT_CREATE);
+	assoofs_stat_latency(dir->i_sb, ASSOOFS_LAT_CREATE, latency);
+	trace_assoofs_create(dir, dentry, ret ? 0 : d_inode(dentry)->i_ino, ret, latency);
+	return ret;
+}
+
 /*
-*  Obtiene donde hay un bloque libre
+* Crea un enlace simbolico. Un destino de menos de ASSOOFS_INLINE_DATA_SIZE bytes se guarda en el registro
+* del inodo (terminado en '\0', para poder usar i_link); uno mas largo, en un bloque propio.
 */
+static int assoofs_symlink(struct inode *dir, struct dentry *dentry, const char *symname) {
 
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block){
+	struct super_block *sb = dir->i_sb;
+	struct assoofs_inode_info *inode_info, *parent_inode_info = dir->i_private;
+	struct buffer_head *bh;
+	struct inode *inode;
+	size_t len = strlen(symname);
+	uint64_t ino, goal, block;
+	int ret;
 
-	struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
-	
-	int i;
-	printk(KERN_INFO "GET A FREEBLOCK REQUESTED\n");
-	for (i = 3; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++){
-		if (assoofs_sb->free_blocks & (1 << i)){
-			break; // cuando aparece el primer bit 1 en free_block dejamos de recorrer el mapa de bits, i tiene la posicióndel primer bloque libre
-		}
+	if (len >= ASSOOFS_DEFAULT_BLOCK_SIZE)
+		return -ENAMETOOLONG;
+	ret = assoofs_new_inode_number(sb, dir, false, &ino);
+	if (ret) {
+		if (ret == -ENOSPC)
+			printk(KERN_ERR "New symlink requested cannot be created\n");
+		return ret;
 	}
-	
-	if(i <= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
-		
-		*block = i; // Escribimos el valor de i en la dirección de memoria indicada como segundo argumento en la función
 
-	}else{
-	
-		printk(KERN_ERR "GETAFREEBLOCK: nos hemos pasado del num de bloques max\n");
-		return -1;
+	inode = new_inode(sb);
+	if (!inode) {
+		assoofs_free_inode_number(sb, ino, false);
+		return -ENOMEM;
 	}
-		//para actualizar el free block es el complemento a 1 de la segunda fila y cambia el resultado de la and y ahora guardar ese cambio en el disco con save sb info
-	assoofs_sb->free_blocks &= ~(1 << i);
-	assoofs_save_sb_info(sb);
-	printk(KERN_INFO "GET A FREEBLOCK FINISHED\n");
-	return 0; //devuelve 0 si todo va bien
-	
-
+	inode_info = assoofs_new_inode_info();
+	if (!inode_info) {
+		assoofs_free_inode_number(sb, ino, false);
+		iput(inode);
+		return -ENOMEM;
 	}
+	inode->i_ino = ino;
+	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+	inode->i_private = inode_info;
+	ASSOOFS_I(inode)->vfs_inode = inode;
+	inode_info->inode_no = ino;
+	inode_info->mode = S_IFLNK | S_IRWXUGO;
+	inode_info->file_size = len;
+
+	// mismo objetivo que un fichero nuevo: junto a su directorio si estan en el mismo grupo
+	if ((dir->i_ino - 1) / ASSOOFS_SB(sb)->inodes_per_group == (ino - 1) / ASSOOFS_SB(sb)->inodes_per_group)
+		goal = parent_inode_info->data_block_number;
+	else
+		goal = assoofs_inode_group_goal(sb, ino);
+	inode_info->data_block_number = goal;
+
+	if (len < ASSOOFS_INLINE_DATA_SIZE) {
+		inode_info->flags = ASSOOFS_INODE_INLINE;
+		memcpy(inode_info->inline_data, symname, len);
+		inode->i_op = &assoofs_fast_symlink_inode_ops;
+		inode->i_link = (char *)inode_info->inline_data;
+	} else {
+		ret = assoofs_sb_get_a_freeblock(sb, goal, &block);
+		if (ret)
+			goto out_iput;
+		bh = sb_getblk(sb, block);
+		if (!bh) {
+			assoofs_free_blocks(sb, block, 1);
+			ret = -ENOMEM;
+			goto out_iput;
+		}
+		lock_buffer(bh);
+		memset(bh->b_data, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+		memcpy(bh->b_data, symname, len);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		ret = assoofs_sync_buffer(sb, bh);
+		brelse(bh);
+		if (ret) {
+			assoofs_free_blocks(sb, block, 1);
+			goto out_iput;
+		}
+		inode_info->data_block_number = block;
+		inode_info->extents[0].start = block;
+		inode_info->extents[0].len = 1;
+		inode->i_op = &assoofs_symlink_inode_ops;
+		assoofs_sync_group(sb, block / ASSOOFS_SB(sb)->blocks_per_group); // el bloque tiene que constar como usado antes que el registro
+	}
+	inode->i_size = len;
+
+	assoofs_add_inode_info(sb, inode_info);
+	inode_init_owner(inode, dir, S_IFLNK | S_IRWXUGO);
+	ret = assoofs_init_security(inode, dir, &dentry->d_name);
+	if (!ret)
+		ret = assoofs_dir_add_entry(sb, dir, &dentry->d_name, ino, &ASSOOFS_I(inode)->dirent_block);
+	if (ret) {
+		printk(KERN_ERR "%s: no se pudo etiquetar el inodo o anyadir la entrada al directorio padre\n", __func__);
+		assoofs_discard_new_inode(inode);
+		return ret;
+	}
+	ASSOOFS_I(inode)->parent_ino = dir->i_ino;
+
+	d_add(dentry, inode);
+	assoofs_usage_charge(dentry, len, 1);
+	trace_assoofs_symlink(dir, dentry, ino);
+	return 0;
+
+out_iput:
+	// aun no hay registro: basta con devolver el numero
+	assoofs_free_inode_number(sb, ino, false);
+	clear_nlink(inode);
+	iput(inode);
+	return ret;
+}
+
+/*
+* Borra la entrada de un fichero o enlace (y la de un directorio vacio, desde rmdir). El directorio
+* cambia en el momento; el inodo pasa a la lista de huerfanos y sus bloques los libera reclaim_work
+* cuando sale de memoria, asi un fichero que sigue abierto se puede usar hasta que se cierre.
+*/
+
+static int assoofs_unlink(struct inode *dir, struct dentry *dentry) {
+
+	struct super_block *sb = dir->i_sb;
+	struct inode *inode = d_inode(dentry);
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	int ret;
+
+	assoofs_stat_inc(sb, ASSOOFS_STAT_UNLINK);
+	ret = assoofs_dir_remove_entry(sb, dir, &dentry->d_name);
+	if (ret)
+		return ret;
 
+	// sin la lista de huerfanos el inodo ya no se puede liberar, pero el nombre ya no esta: sus bloques quedan ocupados
+	if (assoofs_orphan_add(inode))
+		printk(KERN_ERR "%s: el inodo %lu no entra en la lista de huerfanos, sus bloques no se liberan\n", __func__, inode->i_ino);
+
+	// el padre lo descuenta entero ahora; lo que escriba despues si sigue abierto ya no cuenta
+	assoofs_usage_charge(dentry, S_ISDIR(inode_info->mode) ? 0 : -(int64_t)inode_info->file_size, -1);
+
+	inode->i_ctime = dir->i_ctime;
+	drop_nlink(inode);
+	trace_assoofs_unlink(dir, dentry, inode->i_ino);
+	return 0;
+}
 
 /*
-* Actualiza la info persistente ene el superbloque
+* Borra un directorio, que tiene que estar vacio
 */
 
-void assoofs_save_sb_info(struct super_block *vsb) {
+static int assoofs_rmdir(struct inode *dir, struct dentry *dentry) {
+
+	struct assoofs_inode_info *inode_info = d_inode(dentry)->i_private, *parent_info = dir->i_private;
+	int ret;
 
+	if (inode_info->dir_children_count)
+		return -ENOTEMPTY;
+	ret = assoofs_unlink(dir, dentry);
+	if (ret)
+		return ret;
+
+	// se va tambien su "." y el ".." que contaba en el padre
+	clear_nlink(d_inode(dentry));
+	if (parent_info->subdirs)
+		parent_info->subdirs--;
+	assoofs_save_inode_info(dir->i_sb, parent_info);
+	drop_nlink(dir);
+	return 0;
+}
+
+/*
+* Resolucion de un enlace con el destino en un bloque. Se lee con sb_bread, que puede dormir, asi que
+* en el recorrido RCU (dentry == NULL) se pide volver a intentarlo con cerrojos.
+*/
+static const char *assoofs_get_link(struct dentry *dentry, struct inode *inode, struct delayed_call *done) {
+
+	struct assoofs_inode_info *inode_info = inode->i_private;
 	struct buffer_head *bh;
-	struct assoofs_super_block *sb = vsb->s_fs_info; // Informacion persistente del superbloque en memoria
-	bh = sb_bread(vsb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
-	bh->b_data = (char *)sb; // Sobreescribo los datos de disco con la informacion en memoria
-	printk(KERN_INFO "SAVE SB INFO REQUESTED/n");
-	//marcamos el bloque como sucio y sincronizamos
-	
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+	char *link;
+
+	if (!dentry)
+		return ERR_PTR(-ECHILD);
+
+	bh = assoofs_bread(inode->i_sb, inode_info->data_block_number);
+	if (!bh)
+		return ERR_PTR(-EIO);
+	link = kmemdup_nul(bh->b_data, min_t(uint64_t, inode_info->file_size, ASSOOFS_DEFAULT_BLOCK_SIZE - 1), GFP_KERNEL);
 	brelse(bh);
-	printk(KERN_INFO "SAVE SB INFO FINISHED\n");
+	if (!link)
+		return ERR_PTR(-ENOMEM);
+	set_delayed_call(done, kfree_link, link);
+	return link;
 }
 
+/*
+* Atributos extendidos. Los de cada inodo van primero en xattr_data, dentro del propio registro, y los que
+* no caben en un bloque de atributos, compartido entre los ficheros que tengan exactamente los mismos.
+* Devuelve la siguiente entrada de una zona de atributos, o NULL al llegar al final.
+*/
 
-	/* 
-	* Funcion que obtiene la informacion persistente del inodo del superbloque sb
-	*/
-	
-struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no){
+static struct assoofs_xattr_entry *assoofs_xattr_next(void *area, size_t len, size_t *pos) {
 
-		//Acceder a disco para leer el bloque que contiene el almacen de inodos
-		struct assoofs_inode_info *inode_info = NULL;
-		struct buffer_head *bh;
-		struct assoofs_super_block_info *afs_sb = sb->s_fs_info; //lo guardamos en memoria para no acceder a disco tantas veces (en s_fs_info hemos guardado lo qu eleimos antes
-		struct assoofs_inode_info *buffer = NULL;
-		int i;
-		
-		printk(KERN_INFO "GET INODEINFO REQUESTED\n");
+	struct assoofs_xattr_entry *e;
+
+	if (*pos + sizeof(*e) > len)
+		return NULL;
+	e = (struct assoofs_xattr_entry *)((char *)area + *pos);
+	if (!e->name_len || *pos + ASSOOFS_XATTR_ENTRY_SIZE(e) > len)
+		return NULL;
+	*pos += ASSOOFS_XATTR_ENTRY_SIZE(e);
+	return e;
+}
 
-		bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER); //usamos sb_bread para leer el superbloque
-		inode_info = (struct assoofs_inode_info *)bh->b_data; //estoy leyendo al almacen de inodos asi que tenemos que castear a tipo assoofs_inode_info
+static struct assoofs_xattr_entry *assoofs_xattr_find(void *area, size_t len, int index, const char *name, size_t name_len) {
 
+	struct assoofs_xattr_entry *e;
+	size_t pos = 0;
 
-		//Recorrer el almacen de inodos en busca del inodo inode no, recibimos como argumento el numero de inodo asi que es lo que vamos a buscar
+	while ((e = assoofs_xattr_next(area, len, &pos)))
+		if (e->name_index == index && e->name_len == name_len && !memcmp(e->name, name, name_len))
+			return e;
+	return NULL;
+}
 
-		for(i = 0; i < afs_sb->inodes_count; i++) { //recorremos el alamacen de inodos 
+/*
+* Lee el bloque de atributos y devuelve sus entradas en *area y *len, dentro de *bh
+*/
 
-			if(inode_info->inode_no == inode_no) {//comparamos el que nos prefuntan que es inode_no con el valor del inodo donde estoy ahora mismo  inode_info->inode_no
-				
-				buffer = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL); //reservamos memoria diciendole cuanta y donde que siempre usamos esa constante GFP
-				memcpy(buffer, inode_info, sizeof(*buffer)); //copia lo de indode info en buffer (es una asignacion para punteros) esta es la copia que se devuelve si se encuentra
-				break;
-			}
-			inode_info++; //sumamos 1 al puntero asi que desplaza el puntero a la siguinete direccion de memmoria
-		}
+static int assoofs_xattr_block(struct super_block *sb, uint64_t block, struct buffer_head **bh, char **area, size_t *len) {
 
-		//Liberal recursos y devolver a informacion del inodo inode no si estaba en el almacen
-		brelse(bh);
-		printk(KERN_INFO "GET INODEINFO: The inode has been searched\n");
+	struct assoofs_xattr_header *hdr;
 
-		return buffer;
+	*bh = assoofs_bread(sb, block);
+	if (!*bh)
+		return -EIO;
+	hdr = (struct assoofs_xattr_header *)(*bh)->b_data;
+	if (hdr->magic != ASSOOFS_XATTR_MAGIC || hdr->used > ASSOOFS_XATTR_BLOCK_SPACE) {
+		printk(KERN_ERR "XATTR: bloque de atributos %llu corrupto\n", block);
+		brelse(*bh);
+		*bh = NULL;
+		return -EIO;
 	}
+	*area = (*bh)->b_data + sizeof(*hdr);
+	*len = hdr->used;
+	return 0;
+}
 
 /*
-* Devuelve un puntero a la info persistente de un inodo concreto
-* recibe dodne empieza el alamcen de inodos y nos dice en que pos esta el indode info
+* xattr_cache: bloques de atributos por el hash de sus entradas. Con xattr_lock cogido.
 */
 
-struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search) {
+static void assoofs_xattr_cache_add(struct assoofs_sb_info *sbi, uint32_t hash, uint64_t block) {
+
+	struct assoofs_xattr_cache_entry *ce;
+
+	hash_for_each_possible(sbi->xattr_cache, ce, node, hash)
+		if (ce->block == block)
+			return;
+	// sin memoria el bloque sigue valiendo, solo que no se compartira
+	ce = kmalloc(sizeof(*ce), GFP_NOFS);
+	if (!ce)
+		return;
+	ce->hash = hash;
+	ce->block = block;
+	hash_add(sbi->xattr_cache, &ce->node, hash);
+	sbi->xattr_cache_count++;
+}
 
-	uint64_t count = 0;
-	printk(KERN_INFO "SEARCH INODE INFO REQUESTED\n");
-	
-	while (start->inode_no != search->inode_no && count < ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count) { //avanza mientras no sean iguales 
-		count++; //utilizamos count parar saber cuando hemos llegado al final
-		start++;
-	}
+static void assoofs_xattr_cache_del(struct assoofs_sb_info *sbi, uint32_t hash, uint64_t block) {
 
-	if (start->inode_no == search->inode_no) { 
-	printk(KERN_INFO "SEARCH INODE INFO RETURNED OK\n");//si start llega a un sitio donde la info se corresponde devolvemos
-		return start;
-		
-	}else {
-	printk(KERN_ERR "SEARCH INODE INFO RETURNED NULL\n");
-		return NULL;
-		
+	struct assoofs_xattr_cache_entry *ce;
+	struct hlist_node *tmp;
+
+	hash_for_each_possible_safe(sbi->xattr_cache, ce, tmp, node, hash) {
+		if (ce->block == block) {
+			hash_del(&ce->node);
+			kfree(ce);
+			sbi->xattr_cache_count--;
+		}
 	}
+}
+
+static void assoofs_xattr_cache_destroy(struct assoofs_sb_info *sbi) {
 
+	struct assoofs_xattr_cache_entry *ce;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(sbi->xattr_cache, bkt, tmp, ce, node) {
+		hash_del(&ce->node);
+		kfree(ce);
+	}
+	sbi->xattr_cache_count = 0;
 }
 
 /*
-* ACtualiza en disco la info persistente de un inodo
+* Devuelve en *block un bloque de atributos con las entradas [blk, blk + len), con una referencia mas:
+* uno que ya exista con las mismas entradas o uno nuevo junto a goal. 0 si no hay entradas.
 */
 
-int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info) {
-
+static int assoofs_xattr_store_block(struct super_block *sb, uint64_t goal, const char *blk, size_t len, uint64_t *block) {
 
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_xattr_cache_entry *ce;
+	struct assoofs_xattr_header *hdr;
 	struct buffer_head *bh;
-	struct assoofs_inode_info *inode_pos;
-	//Obtiene de disco el almacen de inodos
-	printk(KERN_INFO "SAVE INODE INFO RQUESTED\n");
-	bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+	uint32_t hash;
+	int ret;
 
-	//Busca los datos de inode info en el alamacen
-	
-	inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data,inode_info);
+	*block = 0;
+	if (!len)
+		return 0;
+	hash = jhash(blk, len, 0);
+
+	mutex_lock(&sbi->xattr_lock);
+	hash_for_each_possible(sbi->xattr_cache, ce, node, hash) {
+		if (ce->hash != hash)
+			continue;
+		bh = assoofs_bread(sb, ce->block);
+		if (!bh)
+			continue;
+		hdr = (struct assoofs_xattr_header *)bh->b_data;
+		if (hdr->magic == ASSOOFS_XATTR_MAGIC && hdr->used == len && hdr->refs < ASSOOFS_XATTR_MAX_REFS &&
+				!memcmp(bh->b_data + sizeof(*hdr), blk, len)) {
+			hdr->refs++;
+			mark_buffer_dirty(bh);
+			ret = assoofs_sync_buffer(sb, bh);
+			if (ret) {
+				hdr->refs--;
+				mark_buffer_dirty(bh);
+			} else {
+				*block = ce->block;
+			}
+			brelse(bh);
+			mutex_unlock(&sbi->xattr_lock);
+			return ret;
+		}
+		brelse(bh);
+	}
 
-	//Actualizamos, marcamos el bloque como sucio y sincronizamos
-	
-	memcpy(inode_pos, inode_info, sizeof(*inode_pos));
+	ret = assoofs_sb_get_a_freeblock(sb, goal, block);
+	if (ret)
+		goto out;
+	bh = sb_getblk(sb, *block);
+	if (!bh) {
+		assoofs_free_blocks(sb, *block, 1);
+		ret = -ENOMEM;
+		goto out;
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+	hdr = (struct assoofs_xattr_header *)bh->b_data;
+	hdr->magic = ASSOOFS_XATTR_MAGIC;
+	hdr->refs = 1;
+	hdr->hash = hash;
+	hdr->used = len;
+	memcpy(bh->b_data + sizeof(*hdr), blk, len);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
 	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-
-	printk(KERN_INFO "SAVE SB INFO FINISHED\n");
-	return 0; //devuelve 0 si todo va bien
+	ret = assoofs_sync_buffer(sb, bh);
+	brelse(bh);
+	if (ret) {
+		assoofs_free_blocks(sb, *block, 1);
+		goto out;
+	}
+	assoofs_sync_group(sb, *block / sbi->blocks_per_group); // el bloque tiene que constar como usado antes que el registro
+	assoofs_xattr_cache_add(sbi, hash, *block);
+out:
+	if (ret)
+		*block = 0;
+	mutex_unlock(&sbi->xattr_lock);
+	return ret;
 }
 
 /*
-* Anyade info al inodo
+* Quita una referencia a un bloque de atributos; el ultimo fichero que lo usa lo libera
 */
-void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode) {
 
-	//accedemos a la info persistente del superbloque para obtner el contador de inodos
-	uint64_t count;
-	struct buffer_head *bh;
-	struct assoofs_inode_info *inode_info;
-	
-	printk(KERN_INFO "ADD INODE INFO REUQESTED\n");
-	count = ((struct assoofs_super_block_info*)sb->s_fs_info)->inodes_count; // obtengo el numero de inodos de la informacion persistente del superbloque
+static void assoofs_xattr_release_block(struct super_block *sb, uint64_t block) {
 
-	//Leemos de disco el bloque que contiene el alamacen de inodos
-	
-	bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_xattr_header *hdr;
+	struct buffer_head *bh;
 
-	//obtenermos un puntero al final del almacen y escribimos el valor nuevo al final
-	
-	inode_info = (struct assoofs_inode_info *)bh->b_data;
-	inode_info += count;
-	memcpy(inode_info, inode, sizeof(struct assoofs_inode_info));
+	mutex_lock(&sbi->xattr_lock);
+	bh = assoofs_bread(sb, block);
+	if (!bh) {
+		mutex_unlock(&sbi->xattr_lock);
+		return;
+	}
+	hdr = (struct assoofs_xattr_header *)bh->b_data;
+	if (hdr->refs > 1) {
+		hdr->refs--;
+		mark_buffer_dirty(bh);
+		brelse(bh);
+	} else {
+		assoofs_xattr_cache_del(sbi, hdr->hash, block);
+		bforget(bh);
+		assoofs_free_blocks(sb, block, 1);
+	}
+	mutex_unlock(&sbi->xattr_lock);
+}
 
-	//marcar el bloque como sucio y sincronizar
-	
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+/*
+* Copia la entrada e en dst salvo que sea la que se busca
+*/
 
-	//actualizamos el contador de inodos la info persistente al superbloque y guardamos cambios
+static size_t assoofs_xattr_keep(char *dst, struct assoofs_xattr_entry *e, int index, const char *name, size_t name_len, bool *found) {
 
-	((struct assoofs_super_block_info*)sb->s_fs_info)->inodes_count++;
-	assoofs_save_sb_info(sb);
-	printk(KERN_INFO "ADD INODE INFO FINISHED\n");
+	if (e->name_index == index && e->name_len == name_len && !memcmp(e->name, name, name_len)) {
+		*found = true;
+		return 0;
+	}
+	memcpy(dst, e, ASSOOFS_XATTR_ENTRY_SIZE(e));
+	return ASSOOFS_XATTR_ENTRY_SIZE(e);
 }
 
 /*
-* Para mostrar lo que tiene un dir
+* Crea, cambia o (con value == NULL) borra un atributo. Se juntan todas las entradas del inodo con la
+* nueva y se reparten otra vez: el registro se llena primero y lo que no cabe va al bloque. Si las
+* entradas del bloque no cambian se sigue usando el mismo.
 */
-static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
-    
-	
-	//accedemos al inodo, a la info persistente al inodo y al superbloque de acuerdo al campo filp
-	struct inode *inode;
-	struct super_block *sb;
-	struct assoofs_inode_info *inode_info;
-	struct assoofs_dir_record_entry *record;
-	struct buffer_head *bh;
-	int i;
-	
-	printk(KERN_INFO "Iterate request\n");
-	
-	inode = filp->f_path.dentry->d_inode; //EL FILP TINE F_PATH CON D_INODE QUE ES PARA IDENTIFICAR AL INODO
-	sb = inode->i_sb;
-	inode_info = inode->i_private; //info persistente al inodo
-	
-    
-	if (ctx->pos) return 0; //si pos es distinto de 0 ya estaba creado
-	if ((!S_ISDIR(inode_info->mode))) return -1; //si el inodo obtenido se coresponde con un directorio
 
-	//si todo va bien construimos el contexto : leer el bloque con el contenido del directorio y como sabemos que las variables de dentro son de tal tipo se hace cast a ese tipo
-	
-	bh = sb_bread(sb, inode_info->data_block_number);
-	record = (struct assoofs_dir_record_entry *)bh->b_data;
+static int assoofs_xattr_set_entry(struct inode *inode, int index, const char *name, const void *value, size_t size, int flags) {
+
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	struct assoofs_inode_info *inode_info = &mem->info;
+	struct assoofs_xattr_entry *e;
+	struct buffer_head *bh = NULL;
+	uint8_t new_inline[ASSOOFS_XATTR_INLINE_SIZE];
+	size_t name_len = strlen(name), pos, all_len = 0, inline_len = 0, block_len = 0, old_len = 0, len;
+	uint64_t old_block, new_block;
+	char *all, *blk, *area = NULL;
+	bool found = false;
+	int ret = 0;
+
+	if (!name_len || name_len > ASSOOFS_FILENAME_MAXLEN)
+		return -ERANGE;
+	if (value && sizeof(*e) + name_len + size > ASSOOFS_XATTR_BLOCK_SPACE)
+		return -ENOSPC;
+
+	// lo que hay (registro y bloque) mas la entrada nueva, y aparte lo que ira al bloque
+	all = kmalloc(3 * ASSOOFS_DEFAULT_BLOCK_SIZE + ASSOOFS_XATTR_INLINE_SIZE, GFP_NOFS);
+	if (!all)
+		return -ENOMEM;
+	blk = all + 2 * ASSOOFS_DEFAULT_BLOCK_SIZE + ASSOOFS_XATTR_INLINE_SIZE;
+
+	down_write(&mem->xattr_sem);
+	pos = 0;
+	while ((e = assoofs_xattr_next(inode_info->xattr_data, ASSOOFS_XATTR_INLINE_SIZE, &pos)))
+		all_len += assoofs_xattr_keep(all + all_len, e, index, name, name_len, &found);
+	old_block = inode_info->xattr_block;
+	if (old_block) {
+		ret = assoofs_xattr_block(sb, old_block, &bh, &area, &old_len);
+		if (ret)
+			goto out;
+		pos = 0;
+		while ((e = assoofs_xattr_next(area, old_len, &pos)))
+			all_len += assoofs_xattr_keep(all + all_len, e, index, name, name_len, &found);
+		// un bloque de un montaje anterior tambien se puede compartir
+		mutex_lock(&ASSOOFS_SB(sb)->xattr_lock);
+		assoofs_xattr_cache_add(ASSOOFS_SB(sb), ((struct assoofs_xattr_header *)bh->b_data)->hash, old_block);
+		mutex_unlock(&ASSOOFS_SB(sb)->xattr_lock);
+	}
 
-	
-	//recorremos y por cada archivo llamamos a dir_emit que añade entradas al contexto y le pasamos el contexto el nombre longitud de fichero max y el inodo al que pertenece y una cte que no interesa
-	for (i = 0; i < inode_info->dir_children_count; i++) {
-	dir_emit(ctx, record->filename, ASSOOFS_FILENAME_MAXLEN, record->inode_no, DT_UNKNOWN);
-	ctx->pos += sizeof(struct assoofs_dir_record_entry); //cade vez que anyadimos una entrada al contexto ctx incremenetamos el valor de pos con el tamanyo de esa nueva entrada
-	record++;
+	if (found && (flags & XATTR_CREATE))
+		ret = -EEXIST;
+	else if (!found && ((flags & XATTR_REPLACE) || !value))
+		ret = -ENODATA;
+	if (ret)
+		goto out;
+
+	if (value) {
+		e = (struct assoofs_xattr_entry *)(all + all_len);
+		e->name_index = index;
+		e->name_len = name_len;
+		e->value_len = size;
+		memcpy(e->name, name, name_len);
+		memcpy(ASSOOFS_XATTR_VALUE(e), value, size);
+		all_len += ASSOOFS_XATTR_ENTRY_SIZE(e);
+	}
+
+	memset(new_inline, 0, sizeof(new_inline));
+	pos = 0;
+	while ((e = assoofs_xattr_next(all, all_len, &pos))) {
+		len = ASSOOFS_XATTR_ENTRY_SIZE(e);
+		if (inline_len + len <= ASSOOFS_XATTR_INLINE_SIZE) {
+			memcpy(new_inline + inline_len, e, len);
+			inline_len += len;
+		} else if (block_len + len <= ASSOOFS_XATTR_BLOCK_SPACE) {
+			memcpy(blk + block_len, e, len);
+			block_len += len;
+		} else {
+			ret = -ENOSPC;
+			goto out;
+		}
+	}
+
+	if (old_block && block_len == old_len && !memcmp(blk, area, block_len)) {
+		new_block = old_block;
+	} else {
+		ret = assoofs_xattr_store_block(sb, inode_info->data_block_number, blk, block_len, &new_block);
+		if (ret)
+			goto out;
 	}
 
+	memcpy(inode_info->xattr_data, new_inline, ASSOOFS_XATTR_INLINE_SIZE);
+	inode_info->xattr_block = new_block;
+	inode->i_ctime = current_time(inode);
+	assoofs_save_inode_info(sb, inode_info);
+	if (old_block && old_block != new_block)
+		assoofs_xattr_release_block(sb, old_block);
+
+out:
 	brelse(bh);
-	printk(KERN_INFO "Iterate request finished!!!\n");
-	return 0;
-	
+	up_write(&mem->xattr_sem);
+	kfree(all);
+	return ret;
 }
 
+static int assoofs_xattr_set(const struct xattr_handler *handler, struct dentry *unused, struct inode *inode,
+		const char *name, const void *value, size_t size, int flags) {
+
+	return assoofs_xattr_set_entry(inode, handler->flags, name, value, size, flags);
+}
 
 /*
-* FUncion que permite leer de un archivo
-*lee el contenido de un fichero recibiendo el descriprtor de fichero, el buffer donde se guarda lo *que leo, el size, y desde donde empieza a leer.
+* getxattr: un atributo del registro se copia de la info en memoria sin tocar el disco
 */
-ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos) {
-   
-	struct buffer_head *bh;
-	char *buffer;
-	int nbytes = 0;
-	//obtenemis la info persistente al inodo a partir de filp
-	struct assoofs_inode_info *inode_info = filp->f_path.dentry->d_inode->i_private;
-	 printk(KERN_INFO "Read request\n");
-	
-	//para saber si hemos llegado al final del fichero
-	if (*ppos >= inode_info->file_size) return 0;
-	
-	//para acceder al contenido del fichero
 
-	bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-	buffer = (char *)bh->b_data; //ahora es un puntero al contenido del fichero
-	printk(KERN_INFO "Read : se accedio al contenido\n");
-	//copiamos en el buffer buf el contenido del fichero leido
-	
-	nbytes = min((size_t) inode_info->file_size, len); // Hay que comparar len con el tama~no del fichero por si llegamos al final del fichero
-	if(copy_to_user(buf, buffer, nbytes)){//copiamos algo del kernel a algo del usuario por eso no vale usar mcpy
-		brelse(bh);
-		printk(KERN_ERR "READ: error en copy to user\n");
-		return -1;
+static int assoofs_xattr_get(const struct xattr_handler *handler, struct dentry *unused, struct inode *inode,
+		const char *name, void *buffer, size_t size) {
+
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	struct assoofs_xattr_entry *e;
+	struct buffer_head *bh = NULL;
+	size_t name_len = strlen(name), len;
+	char *area;
+	int ret = 0;
+
+	down_read(&mem->xattr_sem);
+	e = assoofs_xattr_find(mem->info.xattr_data, ASSOOFS_XATTR_INLINE_SIZE, handler->flags, name, name_len);
+	if (!e && mem->info.xattr_block) {
+		ret = assoofs_xattr_block(inode->i_sb, mem->info.xattr_block, &bh, &area, &len);
+		if (!ret)
+			e = assoofs_xattr_find(area, len, handler->flags, name, name_len);
+	}
+	if (!ret) {
+		ret = -ENODATA;
+		if (e) {
+			ret = e->value_len;
+			if (buffer && size < e->value_len)
+				ret = -ERANGE;
+			else if (buffer)
+				memcpy(buffer, ASSOOFS_XATTR_VALUE(e), e->value_len);
+		}
 	}
-	printk(KERN_INFO "Read : se copio en el buffer lo leido\n");
+	brelse(bh);
+	up_read(&mem->xattr_sem);
+	return ret;
+}
 
-	*ppos += nbytes; //se aumenta cada vez que se haga una operacion de lectura
-	printk(KERN_INFO "Read : se termino de leer!!!\n");
-	return nbytes; //numero de bytes leidos puede ser lenght o menos 
-	
+static bool assoofs_xattr_trusted_list(struct dentry *dentry) {
 
+	return capable(CAP_SYS_ADMIN);
 }
 
 /*
-* Funcion que escribe en un fichero y devuelve la longitud de lo que ha escrito
-*recibe el fichero en el que se va a escribir, la direccion del buffer, longitud desde donde se *va a escribir en el fichero filp y el despalazamiento respecto al rprincipio del fichero donde *se va a empezar a escribir
+* Anyade a buffer los nombres completos (prefijo incluido) de las entradas de una zona de atributos.
+* Devuelve los bytes que ocupa la lista hasta ahora.
 */
 
-ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos) {
-    
-   struct inode *inode;
-	struct assoofs_inode_info *inode_info;
+static ssize_t assoofs_xattr_list_area(struct dentry *dentry, void *area, size_t len, char *buffer, size_t size, size_t used) {
+
+	const struct xattr_handler *handler;
+	struct assoofs_xattr_entry *e;
+	size_t pos = 0, prefix_len, n;
+
+	while ((e = assoofs_xattr_next(area, len, &pos))) {
+		if (e->name_index >= ARRAY_SIZE(assoofs_xattr_handler_map))
+			continue;
+		handler = assoofs_xattr_handler_map[e->name_index];
+		if (!handler || (handler->list && !handler->list(dentry)))
+			continue;
+		prefix_len = strlen(handler->prefix);
+		n = prefix_len + e->name_len + 1;
+		if (buffer) {
+			if (used + n > size)
+				return -ERANGE;
+			memcpy(buffer + used, handler->prefix, prefix_len);
+			memcpy(buffer + used + prefix_len, e->name, e->name_len);
+			buffer[used + n - 1] = '\0';
+		}
+		used += n;
+	}
+	return used;
+}
+
+static ssize_t assoofs_listxattr(struct dentry *dentry, char *buffer, size_t size) {
+
+	struct inode *inode = d_inode(dentry);
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
 	struct buffer_head *bh;
-	struct super_block *sb;
-	struct assoofs_super_block_info *assoofs_sb;
-	char *buffer;
-	int ret;
+	ssize_t ret;
+	size_t len;
+	char *area;
+	int err;
+
+	down_read(&mem->xattr_sem);
+	ret = assoofs_xattr_list_area(dentry, mem->info.xattr_data, ASSOOFS_XATTR_INLINE_SIZE, buffer, size, 0);
+	if (ret >= 0 && mem->info.xattr_block) {
+		err = assoofs_xattr_block(inode->i_sb, mem->info.xattr_block, &bh, &area, &len);
+		if (err) {
+			ret = err;
+		} else {
+			ret = assoofs_xattr_list_area(dentry, area, len, buffer, size, ret);
+			brelse(bh);
+		}
+	}
+	up_read(&mem->xattr_sem);
+	return ret;
+}
 
-	printk(KERN_INFO "Write request\n");
-	
-	sb = filp->f_path.dentry->d_inode->i_sb;
-	printk(KERN_INFO "Write: asignacion del sb compeltada\n");
-	//obtenemis la info persistente al inodo a partir de filp
-	
-	assoofs_sb = sb->s_fs_info;
-	printk(KERN_INFO "Write: asignacion del sb info compeltada\n");
-	
-	inode = filp->f_path.dentry->d_inode;
-	printk(KERN_INFO "Write: asignacion del inodo al campo filp compeltada\n");
-	
-	inode_info = inode->i_private;
-	printk(KERN_INFO "Write: asignacion de inode info a al info peristente al inodo\n");
-	
-	//para acceder al contenido del fichero
-	printk(KERN_INFO "Write: accedemos al contenido del fichero\n");
-	bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-	printk(KERN_INFO "PASO POR AQUI\n");
-	
-	if(!bh){
-	
-		printk(KERN_ERR "Write: error al leer el numero de bloque\n");
-		return 0;
+/*
+* Etiqueta de seguridad de un inodo nuevo (SELinux, Smack...): se guarda como un atributo security.*
+*/
+
+static int assoofs_initxattrs(struct inode *inode, const struct xattr *xattr_array, void *fs_info) {
+
+	const struct xattr *xattr;
+	int ret = 0;
+
+	for (xattr = xattr_array; xattr->name && !ret; xattr++)
+		ret = assoofs_xattr_set_entry(inode, ASSOOFS_XATTR_SECURITY, xattr->name, xattr->value, xattr->value_len, 0);
+	return ret;
+}
+
+static int assoofs_init_security(struct inode *inode, struct inode *dir, const struct qstr *qstr) {
+
+	return security_inode_init_security(inode, dir, qstr, assoofs_initxattrs, NULL);
+}
+
+/*
+* Grupos de asignacion: primer bloque y bloque siguiente al ultimo del grupo g
+*/
+
+static inline uint64_t assoofs_group_first_block(struct assoofs_sb_info *sbi, uint64_t g) {
+	return g * sbi->blocks_per_group;
+}
+
+static inline uint64_t assoofs_group_end_block(struct assoofs_sb_info *sbi, uint64_t g) {
+	return min((g + 1) * sbi->blocks_per_group, sbi->asb->blocks_count);
+}
+
+/*
+* Devuelve el descriptor del grupo g y, si se pide, el buffer de la tabla de descriptores que lo contiene.
+* Los bloques de la tabla se leen la primera vez que se necesitan y se quedan retenidos hasta desmontar.
+* Devuelve NULL si no se pudo leer el bloque.
+*/
+
+static struct assoofs_group_desc *assoofs_get_group_desc(struct super_block *sb, uint64_t g, struct buffer_head **bh) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	uint64_t n = g / ASSOOFS_DESCS_PER_BLOCK;
+	struct buffer_head *desc_bh = READ_ONCE(sbi->group_desc_bh[n]);
+
+	if (!desc_bh) {
+		mutex_lock(&sbi->desc_lock);
+		desc_bh = sbi->group_desc_bh[n];
+		if (!desc_bh) {
+			desc_bh = assoofs_bread(sb, ASSOOFS_GROUP_DESC_BLOCK_NUMBER + n);
+			if (!desc_bh) {
+				mutex_unlock(&sbi->desc_lock);
+				printk(KERN_ERR "GROUP DESC: no se pudo leer el bloque de descriptores %llu\n", n);
+				return NULL;
+			}
+			WRITE_ONCE(sbi->group_desc_bh[n], desc_bh);
+		}
+		mutex_unlock(&sbi->desc_lock);
 	}
-	
-	
-	buffer = (char *)bh->b_data;//ahora es un puntero al contenido del fichero
-	buffer += *ppos;//porque apunta al principio del bloque y nosotros vamos a escribir al final
 
-	//copiamos en el buffer buf el contenido del fichero leido
-	if(copy_from_user(buffer, buf, len)){ //copiamos algo del kernel a algo del usuario por eso no vale usar mcpy
-		
-		brelse(bh);
-		printk(KERN_ERR "Write: el copy_from_user no fue bien/n");
-		return -1;	
+	if (bh)
+		*bh = desc_bh;
+	return (struct assoofs_group_desc *)desc_bh->b_data + g % ASSOOFS_DESCS_PER_BLOCK;
+}
+
+/*
+* Arboles de tramos libres: inserta ext en el arbol ordenado por posicion
+*/
+
+static void assoofs_extent_insert_offset(struct assoofs_group_info *grp, struct assoofs_free_extent *ext) {
+
+	struct rb_node **p = &grp->free_by_offset.rb_node, *parent = NULL;
+	struct assoofs_free_extent *cur;
+
+	while (*p) {
+		parent = *p;
+		cur = rb_entry(parent, struct assoofs_free_extent, by_offset);
+		if (ext->start < cur->start)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
 	}
-	printk(KERN_ERR "Write: el copy_from_user va ok/n");
-	
-	*ppos+=len;
-	printk(KERN_INFO "Write: se increementa ppos\n");
-	
-	brelse(bh);
+	rb_link_node(&ext->by_offset, parent, p);
+	rb_insert_color(&ext->by_offset, &grp->free_by_offset);
+	grp->nr_extents++;
+}
 
-	//cada vez que se escribe hay que aumentar la longitud (file_size)
-	inode_info->file_size = *ppos;
-	printk(KERN_INFO "Write: se aumenta la longitud del archivo\n");
+/*
+* Inserta ext en el arbol ordenado por (longitud, posicion)
+*/
 
-	ret = assoofs_save_inode_info(sb, inode_info);//actualizamos el descriptor
+static void assoofs_extent_insert_len(struct assoofs_group_info *grp, struct assoofs_free_extent *ext) {
 
-	if(*ppos >= inode_info->file_size ){
+	struct rb_node **p = &grp->free_by_len.rb_node, *parent = NULL;
+	struct assoofs_free_extent *cur;
 
-		printk(KERN_INFO "Write: ppos es mayor que la size del fichero\n");
+	while (*p) {
+		parent = *p;
+		cur = rb_entry(parent, struct assoofs_free_extent, by_len);
+		if (ext->len < cur->len || (ext->len == cur->len && ext->start < cur->start))
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
 	}
+	rb_link_node(&ext->by_len, parent, p);
+	rb_insert_color(&ext->by_len, &grp->free_by_len);
+}
 
-	if(ret){
-		
-        len = ret;
-    }
-    printk(KERN_INFO "Write: se termino de esrcibir!!!\n");
+/*
+* Devuelve el tramo mas pequenyo con al menos count bloques (best-fit) o NULL si no hay ninguno
+*/
 
-	//numero de bytes escritos
-	return len;
+static struct assoofs_free_extent *assoofs_extent_best_fit(struct assoofs_group_info *grp, uint64_t count) {
+
+	struct rb_node *n = grp->free_by_len.rb_node;
+	struct assoofs_free_extent *cur, *best = NULL;
+
+	while (n) {
+		cur = rb_entry(n, struct assoofs_free_extent, by_len);
+		if (cur->len >= count) {
+			best = cur;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	return best;
 }
 
+/*
+* Devuelve un tramo libre [start, start + len) a los arboles fusionandolo con sus vecinos.
+* new es un nodo reservado por el llamante; se libera aqui si no hace falta. Con grp->lock cogido.
+*/
+
+static void assoofs_extent_release(struct assoofs_group_info *grp, uint64_t start, uint64_t len, struct assoofs_free_extent *new) {
+
+	struct rb_node *n = grp->free_by_offset.rb_node;
+	struct assoofs_free_extent *cur, *prev = NULL, *next = NULL;
 
+	// buscamos el ultimo tramo que empieza antes de start y el primero que empieza despues
+	while (n) {
+		cur = rb_entry(n, struct assoofs_free_extent, by_offset);
+		if (cur->start < start) {
+			prev = cur;
+			n = n->rb_right;
+		} else {
+			next = cur;
+			n = n->rb_left;
+		}
+	}
+
+	if (prev && prev->start + prev->len == start) {
+		rb_erase(&prev->by_len, &grp->free_by_len);
+		prev->len += len;
+		if (next && prev->start + prev->len == next->start) {
+			prev->len += next->len;
+			rb_erase(&next->by_offset, &grp->free_by_offset);
+			rb_erase(&next->by_len, &grp->free_by_len);
+			kfree(next);
+			grp->nr_extents--;
+		}
+		assoofs_extent_insert_len(grp, prev);
+		kfree(new);
+		return;
+	}
+
+	if (next && start + len == next->start) {
+		// el nodo no cambia de orden en by_offset porque no se solapa con prev
+		rb_erase(&next->by_len, &grp->free_by_len);
+		next->start = start;
+		next->len += len;
+		assoofs_extent_insert_len(grp, next);
+		kfree(new);
+		return;
+	}
 
+	new->start = start;
+	new->len = len;
+	assoofs_extent_insert_offset(grp, new);
+	assoofs_extent_insert_len(grp, new);
+}
+
+/*
+* Construye los arboles de tramos libres del grupo g recorriendo su mapa de bits
+*/
+
+static int assoofs_build_free_extents(struct super_block *sb, uint64_t g, void *bitmap) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_group_info *grp = &sbi->groups[g];
+	struct assoofs_free_extent *ext;
+	uint64_t first = assoofs_group_first_block(sbi, g);
+	unsigned long nbits = assoofs_group_end_block(sbi, g) - first;
+	unsigned long i, start;
+
+	grp->free_by_offset = RB_ROOT;
+	grp->free_by_len = RB_ROOT;
+
+	i = find_next_bit_le(bitmap, nbits, 0);
+	while (i < nbits) {
+		start = i;
+		i = find_next_zero_bit_le(bitmap, nbits, start);
+
+		ext = kmalloc(sizeof(struct assoofs_free_extent), GFP_NOFS); // se puede rehacer en plena escritura, tras pasar el shrinker
+		if (!ext)
+			return -ENOMEM;
+		ext->start = first + start;
+		ext->len = i - start;
+		assoofs_extent_insert_offset(grp, ext);
+		assoofs_extent_insert_len(grp, ext);
+
+		i = find_next_bit_le(bitmap, nbits, i);
+	}
+	return 0;
+}
+
+/*
+* Libera los arboles de tramos libres de un grupo
+*/
+
+static void assoofs_destroy_free_extents(struct assoofs_group_info *grp) {
+
+	struct assoofs_free_extent *ext, *tmp;
+
+	rbtree_postorder_for_each_entry_safe(ext, tmp, &grp->free_by_offset, by_offset)
+		kfree(ext);
+	grp->free_by_offset = RB_ROOT;
+	grp->free_by_len = RB_ROOT;
+	grp->nr_extents = 0;
+}
+
+/*
+* Al montar solo se reserva el estado en memoria de los grupos, sin leer nada del disco: los descriptores
+* y los mapas de bits se cargan la primera vez que se usa cada grupo, asi montar no depende del tamanyo
+* del dispositivo. Los contadores del superbloque bastan para statfs y los de cada descriptor para
+* descartar grupos sin leer su mapa de bits.
+*/
+
+static int assoofs_load_groups(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	uint64_t i;
+
+	mutex_init(&sbi->desc_lock);
+	mutex_init(&sbi->tail_lock);
+	mutex_init(&sbi->refcount_lock);
+	sbi->group_desc_blocks = DIV_ROUND_UP(sbi->groups_count, ASSOOFS_DESCS_PER_BLOCK);
+	sbi->group_desc_bh = kvcalloc(sbi->group_desc_blocks, sizeof(struct buffer_head *), GFP_KERNEL);
+	sbi->groups = kvcalloc(sbi->groups_count, sizeof(struct assoofs_group_info), GFP_KERNEL);
+	if (!sbi->group_desc_bh || !sbi->groups)
+		return -ENOMEM;
+
+	spin_lock_init(&sbi->lru_lock);
+	INIT_LIST_HEAD(&sbi->group_lru);
+	for (i = 0; i < sbi->groups_count; i++) {
+		mutex_init(&sbi->groups[i].lock);
+		sbi->groups[i].free_by_offset = RB_ROOT;
+		sbi->groups[i].free_by_len = RB_ROOT;
+		INIT_LIST_HEAD(&sbi->groups[i].lru);
+	}
+	return 0;
+}
+
+/*
+* Carga el mapa de bits del grupo g y construye sus arboles de tramos libres si aun no se habia hecho,
+* o si el shrinker los ha tirado. El grupo pasa al final de group_lru. Se llama con grp->lock cogido.
+*/
+
+static int assoofs_load_group(struct super_block *sb, uint64_t g) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_group_info *grp = &sbi->groups[g];
+	struct assoofs_group_desc *desc;
+	struct buffer_head *bh;
+
+	if (!grp->bitmap_bh) {
+		desc = assoofs_get_group_desc(sb, g, NULL);
+		if (!desc)
+			return -EIO;
+		bh = assoofs_bread(sb, desc->block_bitmap);
+		if (!bh) {
+			printk(KERN_ERR "LOAD GROUP: no se pudo leer el mapa de bits del grupo %llu\n", g);
+			return -EIO;
+		}
+		// bitmap_bh distinto de NULL indica que el grupo ya esta cargado; el mapa de bits no se suelta hasta desmontar
+		WRITE_ONCE(grp->bitmap_bh, bh);
+	}
+	assoofs_stat_inc(sb, grp->extents_loaded ? ASSOOFS_STAT_EXTENT_HITS : ASSOOFS_STAT_EXTENT_MISSES);
+	if (!grp->extents_loaded) {
+		if (assoofs_build_free_extents(sb, g, grp->bitmap_bh->b_data)) {
+			assoofs_destroy_free_extents(grp);
+			return -ENOMEM;
+		}
+		grp->extents_loaded = true;
+		atomic_long_add(grp->nr_extents, &sbi->extent_nodes);
+	}
+
+	spin_lock(&sbi->lru_lock);
+	list_move_tail(&grp->lru, &sbi->group_lru);
+	spin_unlock(&sbi->lru_lock);
+	return 0;
+}
+
+/*
+* Shrinker: los arboles de tramos libres de los grupos que llevan mas tiempo sin usarse. Se rehacen
+* del mapa de bits, que sigue en memoria, la proxima vez que se reserve o se libere en el grupo.
+* Los grupos ocupados se saltan; vuelven al principio de la lista para el siguiente intento.
+*/
+
+static unsigned long assoofs_shrink_extents(struct assoofs_sb_info *sbi, unsigned long nr) {
+
+	struct assoofs_group_info *grp;
+	unsigned long freed = 0, nodes;
+	uint64_t scanned;
+	LIST_HEAD(busy);
+
+	spin_lock(&sbi->lru_lock);
+	for (scanned = 0; freed < nr && scanned < sbi->groups_count && !list_empty(&sbi->group_lru); scanned++) {
+		grp = list_first_entry(&sbi->group_lru, struct assoofs_group_info, lru);
+		list_move_tail(&grp->lru, &busy);
+		spin_unlock(&sbi->lru_lock);
+
+		if (mutex_trylock(&grp->lock)) {
+			nodes = grp->nr_extents;
+			assoofs_destroy_free_extents(grp);
+			grp->extents_loaded = false;
+			atomic_long_sub(nodes, &sbi->extent_nodes);
+			freed += nodes;
+			spin_lock(&sbi->lru_lock);
+			list_del_init(&grp->lru);
+			spin_unlock(&sbi->lru_lock);
+			mutex_unlock(&grp->lock);
+		}
+		cond_resched();
+		spin_lock(&sbi->lru_lock);
+	}
+	list_splice(&busy, &sbi->group_lru);
+	spin_unlock(&sbi->lru_lock);
+	return freed;
+}
+
+/*
+* Shrinker: entradas de xattr_cache. Solo sirven para compartir bloques de atributos iguales,
+* sin ellas los bloques nuevos simplemente no se comparten con los que ya habia.
+*/
+
+static unsigned long assoofs_shrink_xattr_cache(struct assoofs_sb_info *sbi, unsigned long nr) {
+
+	struct assoofs_xattr_cache_entry *ce;
+	struct hlist_node *tmp;
+	unsigned long freed = 0;
+	int bkt;
+
+	if (!mutex_trylock(&sbi->xattr_lock))
+		return 0;
+	hash_for_each_safe(sbi->xattr_cache, bkt, tmp, ce, node) {
+		if (freed >= nr)
+			break;
+		hash_del(&ce->node);
+		kfree(ce);
+		freed++;
+	}
+	sbi->xattr_cache_count -= freed;
+	mutex_unlock(&sbi->xattr_lock);
+	return freed;
+}
+
+/*
+* Shrinker: la memoria del compresor, si nadie esta comprimiendo. Se vuelve a reservar con el siguiente cluster.
+*/
+
+static unsigned long assoofs_shrink_compress(struct assoofs_sb_info *sbi) {
+
+	if (!READ_ONCE(sbi->compress_buf) || !mutex_trylock(&sbi->compress_lock))
+		return 0;
+	kvfree(sbi->compress_wrkmem);
+	kvfree(sbi->compress_buf);
+	sbi->compress_wrkmem = NULL;
+	sbi->compress_buf = NULL;
+	mutex_unlock(&sbi->compress_lock);
+	return 1;
+}
+
+/*
+* Shrinker del superbloque (super_cache_count/super_cache_scan): ademas de dentries e inodos,
+* cuenta y libera las caches propias del montaje. Primero los arboles de tramos libres por
+* antiguedad, luego xattr_cache y por ultimo la memoria del compresor.
+*/
+
+static long assoofs_nr_cached_objects(struct super_block *sb, struct shrink_control *sc) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+	return atomic_long_read(&sbi->extent_nodes) + READ_ONCE(sbi->xattr_cache_count) + (READ_ONCE(sbi->compress_buf) ? 1 : 0);
+}
+
+static long assoofs_free_cached_objects(struct super_block *sb, struct shrink_control *sc) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	unsigned long nr = sc->nr_to_scan, freed;
+
+	freed = assoofs_shrink_extents(sbi, nr);
+	if (freed < nr)
+		freed += assoofs_shrink_xattr_cache(sbi, nr - freed);
+	if (freed < nr)
+		freed += assoofs_shrink_compress(sbi);
+	return freed;
+}
+
+/*
+* Carga el mapa de bits de inodos del grupo g si aun no se habia hecho. Se llama con grp->lock cogido.
+*/
+
+static int assoofs_load_inode_bitmap(struct super_block *sb, uint64_t g) {
+
+	struct assoofs_group_info *grp = &ASSOOFS_SB(sb)->groups[g];
+	struct assoofs_group_desc *desc;
+	struct buffer_head *bh;
+
+	if (grp->inode_bitmap_bh)
+		return 0;
+
+	desc = assoofs_get_group_desc(sb, g, NULL);
+	if (!desc)
+		return -EIO;
+	bh = assoofs_bread(sb, desc->inode_bitmap);
+	if (!bh) {
+		printk(KERN_ERR "LOAD GROUP: no se pudo leer el mapa de bits de inodos del grupo %llu\n", g);
+		return -EIO;
+	}
+	WRITE_ONCE(grp->inode_bitmap_bh, bh);
+	return 0;
+}
+
+/*
+* Libera los grupos y los bloques de descriptores y mapas de bits que se hayan llegado a cargar
+*/
+
+static void assoofs_release_groups(struct assoofs_sb_info *sbi) {
+
+	uint64_t i;
+
+	if (sbi->groups) {
+		for (i = 0; i < sbi->groups_count; i++) {
+			assoofs_destroy_free_extents(&sbi->groups[i]);
+			brelse(sbi->groups[i].bitmap_bh);
+			brelse(sbi->groups[i].inode_bitmap_bh);
+		}
+		kvfree(sbi->groups);
+		sbi->groups = NULL;
+	}
+	if (sbi->group_desc_bh) {
+		for (i = 0; i < sbi->group_desc_blocks; i++)
+			brelse(sbi->group_desc_bh[i]);
+		kvfree(sbi->group_desc_bh);
+		sbi->group_desc_bh = NULL;
+	}
+}
+
+/*
+* Devuelve el tramo libre que contiene goal o, si goal esta ocupado, NULL y en *next el primer tramo libre posterior
+*/
+
+static struct assoofs_free_extent *assoofs_extent_lookup(struct assoofs_group_info *grp, uint64_t goal, struct assoofs_free_extent **next) {
+
+	struct rb_node *n = grp->free_by_offset.rb_node;
+	struct assoofs_free_extent *cur, *prev = NULL;
+
+	*next = NULL;
+	while (n) {
+		cur = rb_entry(n, struct assoofs_free_extent, by_offset);
+		if (cur->start <= goal) {
+			prev = cur;
+			n = n->rb_right;
+		} else {
+			*next = cur;
+			n = n->rb_left;
+		}
+	}
+	if (prev && goal < prev->start + prev->len)
+		return prev;
+	return NULL;
+}
+
+/*
+* Quita los bloques [block, block + count) del tramo ext. Si quedan bloques libres a ambos lados
+* se usa *spare (reservado por el llamante) para el trozo de la derecha.
+*/
+
+static void assoofs_extent_carve(struct assoofs_group_info *grp, struct assoofs_free_extent *ext, uint64_t block, uint64_t count, struct assoofs_free_extent **spare) {
+
+	uint64_t end = ext->start + ext->len;
+	struct assoofs_free_extent *tail;
+
+	rb_erase(&ext->by_len, &grp->free_by_len);
+
+	if (block == ext->start) {
+		// cogemos los bloques del principio del tramo, su posicion relativa en by_offset no cambia
+		ext->start += count;
+		ext->len -= count;
+		if (!ext->len) {
+			rb_erase(&ext->by_offset, &grp->free_by_offset);
+			kfree(ext);
+			grp->nr_extents--;
+		} else {
+			assoofs_extent_insert_len(grp, ext);
+		}
+		return;
+	}
+
+	ext->len = block - ext->start;
+	assoofs_extent_insert_len(grp, ext);
+	if (block + count < end) {
+		tail = *spare;
+		*spare = NULL;
+		tail->start = block + count;
+		tail->len = end - tail->start;
+		assoofs_extent_insert_offset(grp, tail);
+		assoofs_extent_insert_len(grp, tail);
+	}
+}
+
+/*
+* Reserva bloques dentro del grupo g, con su cerrojo:
+*  1.- si goal esta libre se empieza justo ahi (p.ej. a continuacion del ultimo tramo de un fichero)
+*  2.- si no, el primero de los ASSOOFS_GOAL_SCAN tramos siguientes a goal donde quepan los count bloques
+*  3.- si no, best-fit: el tramo mas pequenyo que quepa, para no romper los tramos grandes
+*  4.- si ninguno es suficiente y partial lo permite, el tramo libre mas largo del grupo
+*/
+
+static int assoofs_group_new_blocks(struct super_block *sb, uint64_t g, uint64_t goal, uint64_t count, bool partial, uint64_t *block, uint64_t *got) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_group_info *grp = &sbi->groups[g];
+	struct assoofs_free_extent *ext, *next, *spare;
+	struct assoofs_group_desc *desc;
+	struct buffer_head *desc_bh;
+	uint64_t first = assoofs_group_first_block(sbi, g);
+	struct rb_node *n;
+	unsigned long nodes;
+	int scanned, ret;
+
+	spare = kmalloc(sizeof(struct assoofs_free_extent), GFP_NOFS);
+	if (!spare)
+		return -ENOMEM;
+
+	mutex_lock(&grp->lock);
+	ret = assoofs_load_group(sb, g);
+	if (ret) {
+		mutex_unlock(&grp->lock);
+		kfree(spare);
+		return ret;
+	}
+	ext = NULL;
+	if (goal) {
+		ext = assoofs_extent_lookup(grp, goal, &next);
+		if (ext) {
+			*block = goal;
+			count = min(count, ext->start + ext->len - goal);
+			goto found;
+		}
+		for (scanned = 0; next && scanned < ASSOOFS_GOAL_SCAN; scanned++) {
+			if (next->len >= count) {
+				ext = next;
+				break;
+			}
+			n = rb_next(&next->by_offset);
+			next = rb_entry_safe(n, struct assoofs_free_extent, by_offset);
+		}
+	}
+	if (!ext)
+		ext = assoofs_extent_best_fit(grp, count);
+	if (!ext && partial) {
+		n = rb_last(&grp->free_by_len);
+		if (n) {
+			ext = rb_entry(n, struct assoofs_free_extent, by_len);
+			count = ext->len;
+		}
+	}
+	if (!ext) {
+		mutex_unlock(&grp->lock);
+		kfree(spare);
+		return -ENOSPC;
+	}
+	*block = ext->start;
+
+found:
+	*got = count;
+	nodes = grp->nr_extents;
+	assoofs_extent_carve(grp, ext, *block, count, &spare);
+	atomic_long_add((long)grp->nr_extents - (long)nodes, &sbi->extent_nodes);
+	for (scanned = 0; scanned < count; scanned++)
+		__clear_bit_le(*block - first + scanned, grp->bitmap_bh->b_data);
+	mark_buffer_dirty(grp->bitmap_bh);
+	desc = assoofs_get_group_desc(sb, g, &desc_bh);
+	desc->free_blocks_count -= count;
+	mark_buffer_dirty(desc_bh);
+	mutex_unlock(&grp->lock);
+	kfree(spare);
+
+	percpu_counter_sub(&sbi->free_blocks_counter, count);
+	return 0;
+}
+
+/*
+* Reserva hasta count bloques contiguos lo mas cerca posible de goal (0 si no hay preferencia).
+* Se empieza por el grupo de goal y se sigue por los demas mirando solo los contadores de los
+* descriptores, sin tocar los mapas de bits de los grupos que no pueden servir la peticion. En una
+* primera vuelta solo se aceptan tramos completos; si no hay ninguno se entrega el mas largo que haya.
+* En *got se indica cuantos bloques se han obtenido realmente.
+*/
+
+int assoofs_new_blocks(struct super_block *sb, uint64_t goal, uint64_t count, uint64_t *block, uint64_t *got) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_group_desc *desc;
+	uint64_t g, start_group, i;
+	int pass, ret;
+
+	if (goal >= sbi->asb->blocks_count)
+		goal = 0;
+	start_group = goal / sbi->blocks_per_group;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < sbi->groups_count; i++) {
+			g = (start_group + i) % sbi->groups_count;
+			desc = assoofs_get_group_desc(sb, g, NULL);
+			if (!desc || !desc->free_blocks_count)
+				continue;
+			if (!pass && i && desc->free_blocks_count < count)
+				continue;
+
+			ret = assoofs_group_new_blocks(sb, g, i ? 0 : goal, count, pass, block, got);
+			if (ret != -ENOSPC) {
+				trace_assoofs_new_blocks(sb, goal, count, ret ? 0 : *block, ret ? 0 : *got, ret);
+				return ret;
+			}
+		}
+	}
+	trace_assoofs_new_blocks(sb, goal, count, 0, 0, -ENOSPC);
+	printk(KERN_ERR "NEW BLOCKS: no quedan bloques libres\n");
+	return -ENOSPC;
+}
+
+/*
+* Objetivo para los directorios que cuelgan de la raiz: el centro del tramo libre mas largo del grupo g,
+* asi cada directorio de primer nivel tiene sitio detras para sus hijos
+*/
+
+static uint64_t assoofs_spread_goal(struct super_block *sb, uint64_t g) {
+
+	struct assoofs_group_info *grp = &ASSOOFS_SB(sb)->groups[g];
+	struct assoofs_free_extent *ext;
+	struct rb_node *n;
+	uint64_t goal = 0;
+
+	mutex_lock(&grp->lock);
+	n = assoofs_load_group(sb, g) ? NULL : rb_last(&grp->free_by_len);
+	if (n) {
+		ext = rb_entry(n, struct assoofs_free_extent, by_len);
+		goal = ext->start + ext->len / 2;
+	}
+	mutex_unlock(&grp->lock);
+	return goal;
+}
+
+/*
+* Devuelve count bloques a partir de block a los mapas de bits y a los arboles de tramos libres
+*/
+
+void assoofs_free_blocks(struct super_block *sb, uint64_t block, uint64_t count) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_group_info *grp;
+	struct assoofs_free_extent *new;
+	struct assoofs_group_desc *desc;
+	struct buffer_head *desc_bh;
+	unsigned long nodes;
+	uint64_t g, n, i;
+
+	while (count) {
+		// un tramo nunca cruza de grupo, pero por si acaso se reparte por grupos
+		g = block / sbi->blocks_per_group;
+		n = min(count, assoofs_group_end_block(sbi, g) - block);
+		grp = &sbi->groups[g];
+
+		new = kmalloc(sizeof(struct assoofs_free_extent), GFP_NOFS | __GFP_NOFAIL);
+
+		mutex_lock(&grp->lock);
+		if (assoofs_load_group(sb, g)) {
+			// sin mapa de bits no se pueden devolver; se pierden hasta que se repare la imagen
+			mutex_unlock(&grp->lock);
+			kfree(new);
+			printk(KERN_ERR "FREE BLOCKS: se pierden %llu bloques del grupo %llu\n", n, g);
+			block += n;
+			count -= n;
+			continue;
+		}
+		for (i = 0; i < n; i++)
+			__set_bit_le(block - assoofs_group_first_block(sbi, g) + i, grp->bitmap_bh->b_data);
+		mark_buffer_dirty(grp->bitmap_bh);
+		nodes = grp->nr_extents;
+		assoofs_extent_release(grp, block, n, new);
+		atomic_long_add((long)grp->nr_extents - (long)nodes, &sbi->extent_nodes);
+		desc = assoofs_get_group_desc(sb, g, &desc_bh);
+		desc->free_blocks_count += n;
+		mark_buffer_dirty(desc_bh);
+		mutex_unlock(&grp->lock);
+
+		percpu_counter_add(&sbi->free_blocks_counter, n);
+		block += n;
+		count -= n;
+	}
+}
+
+/*
+*  Obtiene donde hay un bloque libre, lo mas cerca posible de goal
+*/
+
+int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t goal, uint64_t *block){
+
+	uint64_t got;
+	int ret;
+
+	ret = assoofs_new_blocks(sb, goal, 1, block, &got); // un solo bloque: cerca de goal o, si no, el best-fit rellena primero los huecos sueltos
+	return ret; //devuelve 0 si todo va bien
+}
+
+/*
+* Tablas de referencias (reflink): anyade un tramo al final de la tabla nueva uniendolo con el
+* anterior si continua y tiene las mismas referencias. Devuelve false si ya no cabe.
+*/
+
+static bool assoofs_refcount_emit(struct assoofs_refcount_block *tbl, uint64_t start, uint64_t len, uint32_t refs) {
+
+	struct assoofs_refcount_rec *last = tbl->count ? &tbl->recs[tbl->count - 1] : NULL;
+
+	if (!len)
+		return true;
+	if (last && last->start + last->len == start && last->refs == refs) {
+		last->len += len;
+		return true;
+	}
+	if (tbl->count == ASSOOFS_REFCOUNT_RECS)
+		return false;
+	tbl->recs[tbl->count].start = start;
+	tbl->recs[tbl->count].len = len;
+	tbl->recs[tbl->count++].refs = refs;
+	return true;
+}
+
+/*
+* Suma delta (+1 o -1) a las referencias de los bloques [start, start + len), que estan en un mismo grupo.
+* La tabla nueva se construye aparte y solo se copia al bloque si cabe entera, asi un -ENOSPC no deja
+* nada a medias. Los bloques que se quedan sin ningun fichero vuelven al asignador. La tabla de un
+* grupo se crea la primera vez que se comparte uno de sus bloques y se libera cuando se vacia.
+*/
+
+static int assoofs_refcount_adjust(struct super_block *sb, uint64_t start, uint64_t len, int delta) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_group_desc *desc;
+	struct assoofs_refcount_block *old, *new = NULL;
+	struct assoofs_refcount_rec *rec, *freed = NULL;
+	struct buffer_head *desc_bh, *bh;
+	uint64_t g = start / sbi->blocks_per_group, end = start + len, pos, seg, block;
+	uint32_t i, nfreed = 0;
+	int64_t refs;
+	bool created = false;
+	int ret = 0;
+
+	mutex_lock(&sbi->refcount_lock);
+	desc = assoofs_get_group_desc(sb, g, &desc_bh);
+	if (!desc) {
+		mutex_unlock(&sbi->refcount_lock);
+		return -EIO;
+	}
+	if (!desc->refcount_block) {
+		// nada compartido en el grupo: quitar la unica referencia es liberar
+		if (delta < 0) {
+			mutex_unlock(&sbi->refcount_lock);
+			assoofs_free_blocks(sb, start, len);
+			return 0;
+		}
+		ret = assoofs_sb_get_a_freeblock(sb, assoofs_group_first_block(sbi, g), &block);
+		if (ret) {
+			mutex_unlock(&sbi->refcount_lock);
+			return ret;
+		}
+		bh = sb_getblk(sb, block);
+		if (!bh) {
+			assoofs_free_blocks(sb, block, 1);
+			mutex_unlock(&sbi->refcount_lock);
+			return -ENOMEM;
+		}
+		lock_buffer(bh);
+		memset(bh->b_data, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		desc->refcount_block = block;
+		mark_buffer_dirty(desc_bh);
+		created = true;
+	} else {
+		bh = assoofs_bread(sb, desc->refcount_block);
+		if (!bh) {
+			mutex_unlock(&sbi->refcount_lock);
+			return -EIO;
+		}
+	}
+	old = (struct assoofs_refcount_block *)bh->b_data;
+
+	new = kzalloc(ASSOOFS_DEFAULT_BLOCK_SIZE, GFP_NOFS);
+	freed = kmalloc_array(old->count + 2, sizeof(struct assoofs_refcount_rec), GFP_NOFS);
+	if (!new || !freed) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	// los tramos de antes del rango se copian tal cual, y tambien la parte de delante del que lo pisa
+	for (i = 0; i < old->count && old->recs[i].start + old->recs[i].len <= start; i++)
+		assoofs_refcount_emit(new, old->recs[i].start, old->recs[i].len, old->recs[i].refs);
+	if (i < old->count && old->recs[i].start < start)
+		assoofs_refcount_emit(new, old->recs[i].start, start - old->recs[i].start, old->recs[i].refs);
+
+	for (pos = start; pos < end; pos += seg) {
+		rec = i < old->count ? &old->recs[i] : NULL;
+		if (rec && rec->start <= pos) {
+			seg = min(end, (uint64_t)rec->start + rec->len) - pos;
+			refs = rec->refs + delta;
+			if (rec->start + rec->len <= pos + seg)
+				i++;
+		} else {
+			// bloques que no estan en la tabla: los usa un solo fichero
+			seg = (rec ? min(end, (uint64_t)rec->start) : end) - pos;
+			refs = 1 + delta;
+		}
+
+		if (refs >= 2) {
+			if (!assoofs_refcount_emit(new, pos, seg, refs))
+				ret = -ENOSPC;
+		} else if (refs == 0) {
+			freed[nfreed].start = pos;
+			freed[nfreed++].len = seg;
+		}
+	}
+
+	// la parte de detras del ultimo que pisa el rango y los tramos siguientes
+	if (i < old->count && old->recs[i].start < end) {
+		if (!assoofs_refcount_emit(new, end, old->recs[i].start + old->recs[i].len - end, old->recs[i].refs))
+			ret = -ENOSPC;
+		i++;
+	}
+	for (; i < old->count; i++)
+		if (!assoofs_refcount_emit(new, old->recs[i].start, old->recs[i].len, old->recs[i].refs))
+			ret = -ENOSPC;
+
+	if (ret) {
+		printk(KERN_ERR "REFCOUNT: la tabla de referencias del grupo %llu esta llena\n", g);
+		nfreed = 0;
+		goto out;
+	}
+
+	if (!new->count && delta < 0) {
+		// ya no queda nada compartido en el grupo: fuera la tabla
+		freed[nfreed].start = desc->refcount_block;
+		freed[nfreed++].len = 1;
+		desc->refcount_block = 0;
+		mark_buffer_dirty(desc_bh);
+	} else {
+		memcpy(bh->b_data, new, ASSOOFS_DEFAULT_BLOCK_SIZE);
+		mark_buffer_dirty(bh);
+	}
+
+out:
+	// una tabla recien creada que no se ha llegado a usar se quita otra vez
+	block = 0;
+	if (ret && created) {
+		block = desc->refcount_block;
+		desc->refcount_block = 0;
+		mark_buffer_dirty(desc_bh);
+		bforget(bh);
+	} else {
+		brelse(bh);
+	}
+	mutex_unlock(&sbi->refcount_lock);
+	if (block)
+		assoofs_free_blocks(sb, block, 1);
+	for (i = 0; i < nfreed; i++)
+		assoofs_free_blocks(sb, freed[i].start, freed[i].len);
+	kfree(new);
+	kfree(freed);
+	return ret;
+}
+
+/*
+* Busca dentro de [start, start + len) el primer trozo de bloques que usa mas de un fichero.
+* Devuelve su primer bloque y su longitud en *shared_len, o U64_MAX si no hay ninguno.
+*/
+
+static uint64_t assoofs_refcount_next_shared(struct super_block *sb, uint64_t start, uint64_t len, uint64_t *shared_len) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_group_desc *desc;
+	struct assoofs_refcount_block *tbl;
+	struct buffer_head *bh;
+	uint64_t found = U64_MAX, s, e;
+	uint32_t i;
+
+	mutex_lock(&sbi->refcount_lock);
+	desc = assoofs_get_group_desc(sb, start / sbi->blocks_per_group, NULL);
+	if (desc && desc->refcount_block && (bh = assoofs_bread(sb, desc->refcount_block))) {
+		tbl = (struct assoofs_refcount_block *)bh->b_data;
+		for (i = 0; i < tbl->count; i++) {
+			s = max(start, (uint64_t)tbl->recs[i].start);
+			e = min(start + len, (uint64_t)tbl->recs[i].start + tbl->recs[i].len);
+			if (s < e) {
+				found = s;
+				*shared_len = e - s;
+				break;
+			}
+		}
+		brelse(bh);
+	}
+	mutex_unlock(&sbi->refcount_lock);
+	return found;
+}
+
+/*
+* Elige el grupo de un inodo nuevo usando solo los contadores de los descriptores:
+*  - los directorios que cuelgan de la raiz van al grupo con mas bloques libres, para repartirlos
+*  - el resto se queda en el grupo de su padre si hay sitio, o en el siguiente que tenga inodos libres
+* Los grupos marcados en tried (si no es NULL) ya se han probado sin exito y se saltan.
+*/
+
+static int64_t assoofs_find_group(struct super_block *sb, struct inode *dir, bool is_dir, unsigned long *tried) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_group_desc *desc;
+	uint64_t parent_group = (dir->i_ino - 1) / sbi->inodes_per_group;
+	uint64_t g, i, best_free = 0;
+	int64_t best = -1;
+
+	if (is_dir && dir->i_ino == ASSOOFS_ROOTDIR_INODE_NUMBER) {
+		for (g = 0; g < sbi->groups_count; g++) {
+			if (tried && test_bit(g, tried))
+				continue;
+			desc = assoofs_get_group_desc(sb, g, NULL);
+			if (desc && desc->free_inodes_count && desc->free_blocks_count > best_free) {
+				best = g;
+				best_free = desc->free_blocks_count;
+			}
+		}
+		if (best >= 0)
+			return best;
+	}
+
+	for (i = 0; i < sbi->groups_count; i++) {
+		g = (parent_group + i) % sbi->groups_count;
+		if (tried && test_bit(g, tried))
+			continue;
+		desc = assoofs_get_group_desc(sb, g, NULL);
+		if (desc && desc->free_inodes_count)
+			return g;
+	}
+	return -ENOSPC;
+}
+
+/*
+* Reserva un numero de inodo en el grupo que corresponda y devuelve en *ino su numero. Se usa la primera
+* posicion libre del mapa de bits de inodos del grupo, que se busca a partir de inode_hint: en un
+* volumen donde se borra y se crea mucho los huecos se reutilizan sin recorrer la tabla de inodos.
+*/
+
+static int assoofs_new_inode_number(struct super_block *sb, struct inode *dir, bool is_dir, uint64_t *ino) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_group_info *grp;
+	struct assoofs_group_desc *desc;
+	struct buffer_head *desc_bh;
+	unsigned long *tried = NULL;
+	int64_t g;
+	uint64_t index;
+
+	for (;;) {
+		g = assoofs_find_group(sb, dir, is_dir, tried);
+		if (g < 0)
+			break;
+
+		grp = &sbi->groups[g];
+		mutex_lock(&grp->lock);
+		desc = assoofs_get_group_desc(sb, g, &desc_bh);
+		if (!desc || assoofs_load_inode_bitmap(sb, g)) {
+			mutex_unlock(&grp->lock);
+			g = -EIO;
+			break;
+		}
+		index = sbi->inodes_per_group;
+		if (desc->free_inodes_count) {
+			index = find_next_bit_le(grp->inode_bitmap_bh->b_data, sbi->inodes_per_group, grp->inode_hint);
+			if (index >= sbi->inodes_per_group) // por si inode_hint se ha quedado por delante de alguno libre
+				index = find_next_bit_le(grp->inode_bitmap_bh->b_data, sbi->inodes_per_group, 0);
+		}
+		if (index >= sbi->inodes_per_group) {
+			// otro proceso se ha llevado el ultimo inodo del grupo entre medias, o el contador estaba mal:
+			// se deja en cero para que nadie mas lo intente y no se vuelve a probar este grupo
+			if (desc->free_inodes_count) {
+				printk(KERN_ERR "NEW INODE: el grupo %lld dice tener inodos libres pero su mapa de bits esta lleno\n", g);
+				percpu_counter_sub(&sbi->free_inodes_counter, desc->free_inodes_count);
+				desc->free_inodes_count = 0;
+				mark_buffer_dirty(desc_bh);
+			}
+			mutex_unlock(&grp->lock);
+			if (!tried) {
+				tried = kcalloc(BITS_TO_LONGS(sbi->groups_count), sizeof(unsigned long), GFP_KERNEL);
+				if (!tried) {
+					g = -ENOMEM;
+					break;
+				}
+			}
+			__set_bit(g, tried);
+			continue;
+		}
+		__clear_bit_le(index, grp->inode_bitmap_bh->b_data);
+		mark_buffer_dirty(grp->inode_bitmap_bh);
+		grp->inode_hint = index + 1;
+		*ino = g * sbi->inodes_per_group + index + 1;
+		if (index >= desc->used_inodes)
+			desc->used_inodes = index + 1;
+		desc->free_inodes_count--;
+		if (is_dir)
+			desc->dirs_count++;
+		mark_buffer_dirty(desc_bh);
+		mutex_unlock(&grp->lock);
+
+		mutex_lock(&sbi->lock);
+		sbi->asb->inodes_count++;
+		mutex_unlock(&sbi->lock);
+		percpu_counter_dec(&sbi->free_inodes_counter);
+		assoofs_save_sb_info(sb);
+		g = 0;
+		break;
+	}
+	kfree(tried);
+	return g;
+}
+
+/*
+* Devuelve al grupo el numero de un inodo borrado cuyo registro ya esta limpio en disco
+*/
+
+static void assoofs_free_inode_number(struct super_block *sb, uint64_t ino, bool is_dir) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	uint64_t g = (ino - 1) / sbi->inodes_per_group, index = (ino - 1) % sbi->inodes_per_group;
+	struct assoofs_group_info *grp = &sbi->groups[g];
+	struct assoofs_group_desc *desc;
+	struct buffer_head *desc_bh;
+
+	mutex_lock(&grp->lock);
+	desc = assoofs_get_group_desc(sb, g, &desc_bh);
+	if (!desc || assoofs_load_inode_bitmap(sb, g)) {
+		mutex_unlock(&grp->lock);
+		printk(KERN_ERR "FREE INODE: se pierde el inodo %llu\n", ino);
+		return;
+	}
+	// puede estar ya libre si un corte dejo el registro limpio pero aun en la lista de huerfanos
+	if (test_bit_le(index, grp->inode_bitmap_bh->b_data)) {
+		mutex_unlock(&grp->lock);
+		return;
+	}
+	__set_bit_le(index, grp->inode_bitmap_bh->b_data);
+	mark_buffer_dirty(grp->inode_bitmap_bh);
+	grp->inode_hint = min_t(uint32_t, grp->inode_hint, index);
+	desc->free_inodes_count++;
+	if (is_dir && desc->dirs_count)
+		desc->dirs_count--;
+	mark_buffer_dirty(desc_bh);
+	mutex_unlock(&grp->lock);
+
+	percpu_counter_inc(&sbi->free_inodes_counter);
+	mutex_lock(&sbi->lock);
+	sbi->asb->inodes_count--;
+	mutex_unlock(&sbi->lock);
+	assoofs_save_sb_info(sb);
+}
+
+/*
+* Primer bloque del grupo en el que esta el inodo ino, objetivo de los datos cuando el padre esta en otro grupo
+*/
+
+static uint64_t assoofs_inode_group_goal(struct super_block *sb, uint64_t ino) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+	return assoofs_group_first_block(sbi, (ino - 1) / sbi->inodes_per_group);
+}
+
+
+/*
+* Actualiza la info persistente ene el superbloque
+* Solo marca como sucio el bloque retenido en sbh, la escritura a disco se hace en assoofs_sync_fs
+*/
+
+void assoofs_save_sb_info(struct super_block *vsb) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(vsb); // Informacion persistente del superbloque en memoria
+	//marcamos el bloque como sucio, el writeback o el sync lo llevaran a disco
+	
+	mark_buffer_dirty(sbi->sbh);
+}
+
+/*
+* Vuelca los contadores por cpu en el superbloque y lo escribe en disco
+*/
+
+static void assoofs_commit_super(struct super_block *sb, int wait) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	uint64_t i;
+
+	// montado de solo lectura no ha cambiado nada, y una imagen puede estar en un dispositivo que no se puede escribir
+	if (sb_rdonly(sb))
+		return;
+
+	mutex_lock(&sbi->lock);
+	sbi->asb->free_blocks_count = percpu_counter_sum_positive(&sbi->free_blocks_counter);
+	sbi->asb->free_inodes_count = percpu_counter_sum_positive(&sbi->free_inodes_counter);
+	mark_buffer_dirty(sbi->sbh);
+	mutex_unlock(&sbi->lock);
+
+	if (wait) {
+		// los descriptores y los mapas de bits ya estan marcados como sucios desde cada reserva; los que no se han cargado no han cambiado
+		for (i = 0; i < sbi->group_desc_blocks; i++)
+			if (READ_ONCE(sbi->group_desc_bh[i]))
+				assoofs_sync_buffer(sb, sbi->group_desc_bh[i]);
+		for (i = 0; i < sbi->groups_count; i++) {
+			if (READ_ONCE(sbi->groups[i].bitmap_bh))
+				assoofs_sync_buffer(sb, sbi->groups[i].bitmap_bh);
+			if (READ_ONCE(sbi->groups[i].inode_bitmap_bh))
+				assoofs_sync_buffer(sb, sbi->groups[i].inode_bitmap_bh);
+		}
+		assoofs_sync_buffer(sb, sbi->sbh);
+	}
+}
+
+/*
+* Estadisticas del sistema de ficheros (df). Solo lee los contadores por cpu, no accede a disco ni toma cerrojos
+*/
+
+static int assoofs_statfs(struct dentry *dentry, struct kstatfs *buf) {
+
+	struct super_block *sb = dentry->d_sb;
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+
+	buf->f_type = ASSOOFS_MAGIC;
+	buf->f_bsize = ASSOOFS_DEFAULT_BLOCK_SIZE;
+	buf->f_blocks = sbi->asb->blocks_count;
+	// los bloques prometidos a escrituras diferidas ya no estan disponibles aunque sigan libres en el mapa de bits
+	buf->f_bfree = max_t(s64, 0, percpu_counter_read_positive(&sbi->free_blocks_counter) -
+			percpu_counter_read_positive(&sbi->delalloc_blocks_counter));
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = sbi->groups_count * sbi->inodes_per_group;
+	buf->f_ffree = percpu_counter_read_positive(&sbi->free_inodes_counter);
+	buf->f_namelen = ASSOOFS_FILENAME_MAXLEN;
+	buf->f_fsid.val[0] = (u32)id;
+	buf->f_fsid.val[1] = (u32)(id >> 32);
+	return 0;
+}
+
+/*
+* Opciones que se ven en /proc/mounts
+*/
+
+static int assoofs_show_options(struct seq_file *seq, struct dentry *root) {
+
+	if (ASSOOFS_SB(root->d_sb)->compress)
+		seq_puts(seq, ",compress");
+	if (ASSOOFS_SB(root->d_sb)->preload)
+		seq_puts(seq, ",preload");
+	return 0;
+}
+
+/*
+* Remontaje: se pueden cambiar las opciones, pero una imagen de solo lectura no pasa a escritura
+*/
+
+static int assoofs_remount(struct super_block *sb, int *flags, char *data) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	bool preload;
+	int ret;
+
+	sync_filesystem(sb);
+	if (sbi->image_ro && !(*flags & SB_RDONLY)) {
+		printk(KERN_ERR "Read-only image, it cannot be remounted read-write\n");
+		return -EROFS;
+	}
+	preload = sbi->preload;
+	ret = assoofs_parse_options(sbi, data);
+	if (ret)
+		return ret;
+	// la tabla precargada se usa sin cerrojos, asi que preload solo se decide al montar
+	if (sbi->preload != preload)
+		printk(KERN_INFO "preload no cambia al remontar\n");
+	sbi->preload = preload;
+
+	// de solo lectura no se libera nada: se termina lo pendiente antes y se retoma al volver a escritura
+	if (*flags & SB_RDONLY)
+		flush_work(&sbi->reclaim_work);
+	else if (sb_rdonly(sb))
+		assoofs_reclaim_orphans(sb);
+	return 0;
+}
+
+/*
+* sync(2) y syncfs(2): aqui es donde los contadores llegan al superbloque en disco
+*/
+
+static int assoofs_sync_fs(struct super_block *sb, int wait) {
+
+	assoofs_usage_flush(ASSOOFS_SB(sb)); // los contadores de uso pendientes tambien llegan con sync
+	assoofs_commit_super(sb, wait);
+	return 0;
+}
+
+/*
+* Desmontaje: ultima escritura del superbloque y liberacion de la informacion en memoria
+*/
+
+static void assoofs_put_super(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+	assoofs_sysfs_unregister(sbi); // antes que nada, los ficheros de sysfs leen lo que se libera aqui
+	flush_work(&sbi->reclaim_work); // los borrados que han llegado al desalojar los ultimos inodos
+	assoofs_release_reclaim(sbi);
+	assoofs_commit_super(sb, 1);
+	if (atomic64_read(&sbi->compress_raw_bytes))
+		printk(KERN_INFO "COMPRESS: %lld bytes guardados en %lld\n",
+				(long long)atomic64_read(&sbi->compress_raw_bytes), (long long)atomic64_read(&sbi->compress_stored_bytes));
+	kvfree(sbi->compress_wrkmem);
+	kvfree(sbi->compress_buf);
+	assoofs_release_decompress(sbi);
+	assoofs_xattr_cache_destroy(sbi);
+	assoofs_release_itable(sbi);
+	assoofs_release_groups(sbi);
+	percpu_counter_destroy(&sbi->free_blocks_counter);
+	percpu_counter_destroy(&sbi->free_inodes_counter);
+	percpu_counter_destroy(&sbi->delalloc_blocks_counter);
+	free_percpu(sbi->stats);
+	brelse(sbi->sbh);
+	sb->s_fs_info = NULL;
+	kfree(sbi);
+}
+
+/*
+* Desmontaje: antes de que se suelten los dentries se suben los contadores de uso pendientes,
+* que retienen el dentry de cada directorio afectado
+*/
+
+static void assoofs_kill_sb(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+	if (sbi) {
+		assoofs_usage_flush(sbi);
+		cancel_delayed_work_sync(&sbi->usage_work);
+	}
+	kill_block_super(sb);
+}
+
+/*
+* sysfs: /sys/fs/assoofs/<dispositivo>/ con
+*  - mem_*: la memoria que ocupan las caches del montaje, en bytes; mem_total es la suma de las demas
+*  - ops_*, *_bytes, buffer_*, itable_*, extent_tree_*: los contadores de struct assoofs_stats
+*  - lat_*: un histograma de latencia por linea "<desde ns> <operaciones>", hasta el ultimo cubo con algo
+* Cada fichero es un valor (o un histograma); index dice cual de los contadores lee.
+*/
+
+struct assoofs_attr {
+	struct attribute attr;
+	ssize_t (*show)(struct assoofs_sb_info *sbi, int index, char *buf);
+	int index;
+};
+
+#define ASSOOFS_ATTR_RO(_name) \
+static struct assoofs_attr assoofs_attr_##_name = { \
+	.attr = { .name = #_name, .mode = 0444 }, \
+	.show = assoofs_##_name##_show, \
+}
+
+#define ASSOOFS_STAT_ATTR(_name, _item) \
+static struct assoofs_attr assoofs_attr_##_name = { \
+	.attr = { .name = #_name, .mode = 0444 }, \
+	.show = assoofs_stat_show, \
+	.index = _item, \
+}
+
+#define ASSOOFS_LAT_ATTR(_name, _op) \
+static struct assoofs_attr assoofs_attr_##_name = { \
+	.attr = { .name = #_name, .mode = 0444 }, \
+	.show = assoofs_lat_show, \
+	.index = _op, \
+}
+
+static unsigned long assoofs_mem_extent_trees(struct assoofs_sb_info *sbi) {
+
+	return atomic_long_read(&sbi->extent_nodes) * sizeof(struct assoofs_free_extent);
+}
+
+static unsigned long assoofs_mem_xattr_cache(struct assoofs_sb_info *sbi) {
+
+	return READ_ONCE(sbi->xattr_cache_count) * sizeof(struct assoofs_xattr_cache_entry);
+}
+
+static unsigned long assoofs_mem_compress(struct assoofs_sb_info *sbi) {
+
+	unsigned long bytes = 0;
+
+	if (READ_ONCE(sbi->compress_buf))
+		bytes += LZ4_MEM_COMPRESS + ASSOOFS_CLUSTER_SIZE;
+	if (READ_ONCE(sbi->decompress_buf))
+		bytes += num_possible_cpus() * ASSOOFS_CLUSTER_SIZE;
+	return bytes;
+}
+
+static unsigned long assoofs_mem_inode_table(struct assoofs_sb_info *sbi) {
+
+	return sbi->itable_bh ? sbi->groups_count * sbi->itable_blocks * ASSOOFS_DEFAULT_BLOCK_SIZE : 0;
+}
+
+static ssize_t assoofs_mem_extent_trees_show(struct assoofs_sb_info *sbi, int index, char *buf) {
+
+	return snprintf(buf, PAGE_SIZE, "%lu\n", assoofs_mem_extent_trees(sbi));
+}
+
+static ssize_t assoofs_mem_xattr_cache_show(struct assoofs_sb_info *sbi, int index, char *buf) {
+
+	return snprintf(buf, PAGE_SIZE, "%lu\n", assoofs_mem_xattr_cache(sbi));
+}
+
+static ssize_t assoofs_mem_compress_show(struct assoofs_sb_info *sbi, int index, char *buf) {
+
+	return snprintf(buf, PAGE_SIZE, "%lu\n", assoofs_mem_compress(sbi));
+}
+
+static ssize_t assoofs_mem_inode_table_show(struct assoofs_sb_info *sbi, int index, char *buf) {
+
+	return snprintf(buf, PAGE_SIZE, "%lu\n", assoofs_mem_inode_table(sbi));
+}
+
+static ssize_t assoofs_mem_total_show(struct assoofs_sb_info *sbi, int index, char *buf) {
+
+	return snprintf(buf, PAGE_SIZE, "%lu\n", assoofs_mem_extent_trees(sbi) + assoofs_mem_xattr_cache(sbi) +
+			assoofs_mem_compress(sbi) + assoofs_mem_inode_table(sbi));
+}
+
+static ssize_t assoofs_stat_show(struct assoofs_sb_info *sbi, int index, char *buf) {
+
+	uint64_t sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(sbi->stats, cpu)->count[index];
+	return snprintf(buf, PAGE_SIZE, "%llu\n", sum);
+}
+
+static ssize_t assoofs_lat_show(struct assoofs_sb_info *sbi, int index, char *buf) {
+
+	uint64_t hist[ASSOOFS_LAT_BUCKETS] = { 0 };
+	ssize_t len = 0;
+	int cpu, b, last = -1;
+
+	for_each_possible_cpu(cpu)
+		for (b = 0; b < ASSOOFS_LAT_BUCKETS; b++)
+			hist[b] += per_cpu_ptr(sbi->stats, cpu)->lat[index][b];
+	for (b = 0; b < ASSOOFS_LAT_BUCKETS; b++)
+		if (hist[b])
+			last = b;
+	for (b = 0; b <= last; b++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%llu %llu\n", b ? 1ULL << b : 0ULL, hist[b]);
+	return len;
+}
+
+ASSOOFS_ATTR_RO(mem_extent_trees);
+ASSOOFS_ATTR_RO(mem_xattr_cache);
+ASSOOFS_ATTR_RO(mem_compress);
+ASSOOFS_ATTR_RO(mem_inode_table);
+ASSOOFS_ATTR_RO(mem_total);
+ASSOOFS_STAT_ATTR(ops_lookup, ASSOOFS_STAT_LOOKUP);
+ASSOOFS_STAT_ATTR(ops_create, ASSOOFS_STAT_CREATE);
+ASSOOFS_STAT_ATTR(ops_mkdir, ASSOOFS_STAT_MKDIR);
+ASSOOFS_STAT_ATTR(ops_unlink, ASSOOFS_STAT_UNLINK);
+ASSOOFS_STAT_ATTR(ops_read, ASSOOFS_STAT_READ);
+ASSOOFS_STAT_ATTR(ops_write, ASSOOFS_STAT_WRITE);
+ASSOOFS_STAT_ATTR(ops_fsync, ASSOOFS_STAT_FSYNC);
+ASSOOFS_STAT_ATTR(read_bytes, ASSOOFS_STAT_READ_BYTES);
+ASSOOFS_STAT_ATTR(write_bytes, ASSOOFS_STAT_WRITE_BYTES);
+ASSOOFS_STAT_ATTR(buffer_hits, ASSOOFS_STAT_BUFFER_HITS);
+ASSOOFS_STAT_ATTR(buffer_reads, ASSOOFS_STAT_BUFFER_READS);
+ASSOOFS_STAT_ATTR(buffer_writes, ASSOOFS_STAT_BUFFER_WRITES);
+ASSOOFS_STAT_ATTR(itable_hits, ASSOOFS_STAT_ITABLE_HITS);
+ASSOOFS_STAT_ATTR(itable_misses, ASSOOFS_STAT_ITABLE_MISSES);
+ASSOOFS_STAT_ATTR(extent_tree_hits, ASSOOFS_STAT_EXTENT_HITS);
+ASSOOFS_STAT_ATTR(extent_tree_misses, ASSOOFS_STAT_EXTENT_MISSES);
+ASSOOFS_LAT_ATTR(lat_lookup, ASSOOFS_LAT_LOOKUP);
+ASSOOFS_LAT_ATTR(lat_create, ASSOOFS_LAT_CREATE);
+ASSOOFS_LAT_ATTR(lat_read, ASSOOFS_LAT_READ);
+ASSOOFS_LAT_ATTR(lat_write, ASSOOFS_LAT_WRITE);
+ASSOOFS_LAT_ATTR(lat_fsync, ASSOOFS_LAT_FSYNC);
+
+static struct attribute *assoofs_sb_attrs[] = {
+	&assoofs_attr_mem_extent_trees.attr,
+	&assoofs_attr_mem_xattr_cache.attr,
+	&assoofs_attr_mem_compress.attr,
+	&assoofs_attr_mem_inode_table.attr,
+	&assoofs_attr_mem_total.attr,
+	&assoofs_attr_ops_lookup.attr,
+	&assoofs_attr_ops_create.attr,
+	&assoofs_attr_ops_mkdir.attr,
+	&assoofs_attr_ops_unlink.attr,
+	&assoofs_attr_ops_read.attr,
+	&assoofs_attr_ops_write.attr,
+	&assoofs_attr_ops_fsync.attr,
+	&assoofs_attr_read_bytes.attr,
+	&assoofs_attr_write_bytes.attr,
+	&assoofs_attr_buffer_hits.attr,
+	&assoofs_attr_buffer_reads.attr,
+	&assoofs_attr_buffer_writes.attr,
+	&assoofs_attr_itable_hits.attr,
+	&assoofs_attr_itable_misses.attr,
+	&assoofs_attr_extent_tree_hits.attr,
+	&assoofs_attr_extent_tree_misses.attr,
+	&assoofs_attr_lat_lookup.attr,
+	&assoofs_attr_lat_create.attr,
+	&assoofs_attr_lat_read.attr,
+	&assoofs_attr_lat_write.attr,
+	&assoofs_attr_lat_fsync.attr,
+	NULL,
+};
+
+static ssize_t assoofs_attr_show(struct kobject *kobj, struct attribute *attr, char *buf) {
+
+	struct assoofs_sb_info *sbi = container_of(kobj, struct assoofs_sb_info, kobj);
+	struct assoofs_attr *a = container_of(attr, struct assoofs_attr, attr);
+
+	return a->show(sbi, a->index, buf);
+}
+
+static const struct sysfs_ops assoofs_attr_ops = {
+	.show = assoofs_attr_show,
+};
+
+static void assoofs_sb_kobj_release(struct kobject *kobj) {
+
+	struct assoofs_sb_info *sbi = container_of(kobj, struct assoofs_sb_info, kobj);
+
+	complete(&sbi->kobj_unregister);
+}
+
+static struct kobj_type assoofs_sb_ktype = {
+	.default_attrs = assoofs_sb_attrs,
+	.sysfs_ops = &assoofs_attr_ops,
+	.release = assoofs_sb_kobj_release,
+};
+
+static int assoofs_sysfs_register(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	int ret;
+
+	if (!assoofs_kset)
+		return -ENOENT;
+	init_completion(&sbi->kobj_unregister);
+	ret = kobject_init_and_add(&sbi->kobj, &assoofs_sb_ktype, &assoofs_kset->kobj, "%s", sb->s_id);
+	if (ret) {
+		kobject_put(&sbi->kobj);
+		wait_for_completion(&sbi->kobj_unregister);
+		return ret;
+	}
+	sbi->sysfs = true;
+	return 0;
+}
+
+/*
+* Quita el directorio del montaje y espera a que se suelte la ultima referencia a kobj,
+* que esta dentro de sbi
+*/
+
+static void assoofs_sysfs_unregister(struct assoofs_sb_info *sbi) {
+
+	if (!sbi->sysfs)
+		return;
+	kobject_del(&sbi->kobj);
+	kobject_put(&sbi->kobj);
+	wait_for_completion(&sbi->kobj_unregister);
+	sbi->sysfs = false;
+}
+
+/*
+* Contadores recursivos de uso (rbytes, rinodes) de los directorios. Un cambio en un fichero o en un
+* directorio se apunta como pendiente en su padre, y usage_work lo aplica al registro del padre y lo
+* apunta a su vez en el abuelo, y asi hasta la raiz. Muchas escrituras en un mismo directorio acaban
+* en una sola actualizacion de cada antecesor. Tras un corte pueden perderse los cambios que estaban
+* pendientes.
+*/
+
+static void assoofs_usage_add(struct dentry *dir, int64_t bytes, int64_t inodes) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(dir->d_sb);
+	struct assoofs_inode_mem *mem = ASSOOFS_I(d_inode(dir));
+
+	spin_lock(&sbi->usage_lock);
+	mem->usage_bytes += bytes;
+	mem->usage_inodes += inodes;
+	if (list_empty(&mem->usage_list)) {
+		list_add_tail(&mem->usage_list, &sbi->usage_dirty);
+		mem->usage_dentry = dget(dir); // la lista retiene el directorio hasta aplicarlos
+	}
+	spin_unlock(&sbi->usage_lock);
+
+	schedule_delayed_work(&sbi->usage_work, ASSOOFS_USAGE_DELAY); // no hace nada si ya estaba programado
+}
+
+/*
+* dentry es el del fichero o directorio que ha cambiado; se carga a su padre. Un fichero ya borrado
+* que sigue abierto no cuenta: su padre lo descontó entero al borrarlo.
+*/
+
+static void assoofs_usage_charge(struct dentry *dentry, int64_t bytes, int64_t inodes) {
+
+	struct dentry *parent;
+
+	if ((!bytes && !inodes) || IS_ROOT(dentry) || d_unhashed(dentry))
+		return;
+
+	parent = dget_parent(dentry);
+	assoofs_usage_add(parent, bytes, inodes);
+	dput(parent);
+}
+
+/*
+* Aplica todos los cambios pendientes. Lo que se aplica en un directorio se apunta en su padre, que
+* va al final de la lista, asi que al terminar todo ha llegado a la raiz.
+*/
+
+static void assoofs_usage_flush(struct assoofs_sb_info *sbi) {
+
+	struct assoofs_inode_mem *mem;
+	struct dentry *dentry, *parent;
+	struct inode *inode;
+	int64_t bytes, inodes;
+
+	mutex_lock(&sbi->usage_mutex);
+	spin_lock(&sbi->usage_lock);
+	while (!list_empty(&sbi->usage_dirty)) {
+		mem = list_first_entry(&sbi->usage_dirty, struct assoofs_inode_mem, usage_list);
+		list_del_init(&mem->usage_list);
+		dentry = mem->usage_dentry;
+		bytes = mem->usage_bytes;
+		inodes = mem->usage_inodes;
+		mem->usage_dentry = NULL;
+		mem->usage_bytes = mem->usage_inodes = 0;
+		spin_unlock(&sbi->usage_lock);
+
+		// un directorio ya borrado no guarda nada, pero lo que quedaba pendiente en el sigue subiendo
+		inode = d_inode(dentry);
+		inode_lock(inode);
+		mem->info.rbytes += bytes;
+		mem->info.rinodes += inodes;
+		if (inode->i_nlink)
+			assoofs_save_inode_info(inode->i_sb, &mem->info);
+		inode_unlock(inode);
+
+		if (!IS_ROOT(dentry)) {
+			parent = dget_parent(dentry);
+			assoofs_usage_add(parent, bytes, inodes);
+			dput(parent);
+		}
+		dput(dentry);
+		spin_lock(&sbi->usage_lock);
+	}
+	spin_unlock(&sbi->usage_lock);
+	mutex_unlock(&sbi->usage_mutex);
+}
+
+static void assoofs_usage_work(struct work_struct *work) {
+
+	assoofs_usage_flush(container_of(to_delayed_work(work), struct assoofs_sb_info, usage_work));
+}
+
+/*
+* Lista de huerfanos: inodos sin ninguna entrada en un directorio cuyos bloques aun no se han
+* liberado. En disco empieza en orphan_head y sigue por el next_orphan de cada registro; en memoria
+* sbi->orphans tiene los mismos en el mismo orden. Tras un corte, la lista que haya en disco se
+* termina de liberar al montar.
+*/
+
+static int assoofs_orphan_add(struct inode *inode) {
+
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_inode_info *inode_pos;
+	struct assoofs_orphan *orphan;
+	struct buffer_head *bh;
+
+	orphan = kmalloc(sizeof(struct assoofs_orphan), GFP_KERNEL);
+	if (!orphan)
+		return -ENOMEM;
+	orphan->ino = inode->i_ino;
+	orphan->released = false;
+	INIT_LIST_HEAD(&orphan->reclaim);
+
+	// se mete el primero: su registro apunta al que lo era hasta ahora
+	mutex_lock(&sbi->orphan_lock);
+	inode_pos = assoofs_inode_slot(sb, orphan->ino, &bh);
+	if (!inode_pos) {
+		mutex_unlock(&sbi->orphan_lock);
+		kfree(orphan);
+		return -EIO;
+	}
+	inode_pos->next_orphan = sbi->asb->orphan_head;
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	sbi->asb->orphan_head = orphan->ino;
+	assoofs_save_sb_info(sb);
+	list_add(&orphan->list, &sbi->orphans);
+	mutex_unlock(&sbi->orphan_lock);
+
+	ASSOOFS_I(inode)->orphan = orphan;
+	return 0;
+}
+
+/*
+* Saca un huerfano de la lista (y de reclaim_inodes si estaba): el anterior, o orphan_head si es el
+* primero, pasa a apuntar al siguiente. El llamante libera orphan.
+*/
+
+static void assoofs_orphan_del(struct super_block *sb, struct assoofs_orphan *orphan) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_inode_info *inode_pos;
+	struct assoofs_orphan *prev;
+	struct buffer_head *bh;
+	uint32_t next = 0;
+
+	mutex_lock(&sbi->orphan_lock);
+	inode_pos = assoofs_inode_slot(sb, orphan->ino, &bh);
+	if (inode_pos) {
+		next = inode_pos->next_orphan;
+		inode_pos->next_orphan = 0;
+		mark_buffer_dirty(bh);
+		brelse(bh);
+	} else {
+		printk(KERN_ERR "ORPHAN: no se pudo leer el inodo %llu, se pierde el resto de la lista\n", orphan->ino);
+	}
+
+	if (orphan->list.prev == &sbi->orphans) {
+		sbi->asb->orphan_head = next;
+		assoofs_save_sb_info(sb);
+	} else {
+		prev = list_prev_entry(orphan, list);
+		inode_pos = assoofs_inode_slot(sb, prev->ino, &bh);
+		if (inode_pos) {
+			inode_pos->next_orphan = next;
+			mark_buffer_dirty(bh);
+			brelse(bh);
+		}
+	}
+	list_del(&orphan->list);
+	spin_lock(&sbi->reclaim_lock);
+	list_del_init(&orphan->reclaim);
+	spin_unlock(&sbi->reclaim_lock);
+	mutex_unlock(&sbi->orphan_lock);
+}
+
+/*
+* El inodo de un huerfano ha salido de memoria: ya se puede liberar, salvo montado de solo lectura,
+* que se deja para cuando se vuelva a montar de escritura
+*/
+
+static void assoofs_orphan_release(struct super_block *sb, struct assoofs_orphan *orphan) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+	mutex_lock(&sbi->orphan_lock);
+	orphan->released = true;
+	if (!sb_rdonly(sb)) {
+		spin_lock(&sbi->reclaim_lock);
+		list_add_tail(&orphan->reclaim, &sbi->reclaim_inodes);
+		spin_unlock(&sbi->reclaim_lock);
+		schedule_work(&sbi->reclaim_work);
+	}
+	mutex_unlock(&sbi->orphan_lock);
+}
+
+/*
+* Al montar: construye sbi->orphans a partir de la lista en disco. Ninguno tiene inodo en memoria.
+*/
+
+static int assoofs_load_orphans(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_inode_info *inode_pos;
+	struct assoofs_orphan *orphan;
+	struct buffer_head *bh;
+	uint64_t ino = sbi->asb->orphan_head, n = 0;
+
+	while (ino) {
+		// una lista con un ciclo no puede tener mas elementos que inodos
+		if (++n > sbi->groups_count * sbi->inodes_per_group) {
+			printk(KERN_ERR "ORPHAN: la lista de huerfanos esta corrupta\n");
+			return -EIO;
+		}
+		inode_pos = assoofs_inode_slot(sb, ino, &bh);
+		if (!inode_pos)
+			return -EIO;
+		orphan = kmalloc(sizeof(struct assoofs_orphan), GFP_KERNEL);
+		if (!orphan) {
+			brelse(bh);
+			return -ENOMEM;
+		}
+		orphan->ino = ino;
+		orphan->released = true;
+		INIT_LIST_HEAD(&orphan->reclaim);
+		list_add_tail(&orphan->list, &sbi->orphans);
+		ino = inode_pos->next_orphan;
+		brelse(bh);
+	}
+	if (n)
+		printk(KERN_INFO "ORPHAN: %llu inodos borrados pendientes de liberar\n", n);
+	return 0;
+}
+
+/*
+* Pasa a reclaim_work todos los huerfanos que ya se pueden liberar y no estaban ya en su lista
+* (al montar y al volver a montar de escritura)
+*/
+
+static void assoofs_reclaim_orphans(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_orphan *orphan;
+
+	mutex_lock(&sbi->orphan_lock);
+	spin_lock(&sbi->reclaim_lock);
+	list_for_each_entry(orphan, &sbi->orphans, list)
+		if (orphan->released && list_empty(&orphan->reclaim))
+			list_add_tail(&orphan->reclaim, &sbi->reclaim_inodes);
+	spin_unlock(&sbi->reclaim_lock);
+	mutex_unlock(&sbi->orphan_lock);
+	schedule_work(&sbi->reclaim_work);
+}
+
+/*
+* Apunta en ranges un tramo que ya no apunta ningun fichero, para devolverlo con assoofs_reclaim_later
+*/
+
+static void assoofs_defer_free(struct list_head *ranges, uint64_t start, uint64_t len, bool shared) {
+
+	struct assoofs_reclaim_range *range = kmalloc(sizeof(struct assoofs_reclaim_range), GFP_NOFS | __GFP_NOFAIL);
+
+	range->start = start;
+	range->len = len;
+	range->shared = shared;
+	list_add_tail(&range->list, ranges);
+}
+
+/*
+* Pasa los tramos de ranges a reclaim_work. El registro que los apuntaba ya tiene que estar en disco.
+*/
+
+static void assoofs_reclaim_later(struct super_block *sb, struct list_head *ranges) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+	spin_lock(&sbi->reclaim_lock);
+	list_splice_tail_init(ranges, &sbi->reclaim_ranges);
+	spin_unlock(&sbi->reclaim_lock);
+	schedule_work(&sbi->reclaim_work);
+}
+
+/*
+* Libera un huerfano cuyo inodo ya no esta en memoria. Su registro se saca de la lista y se borra, y
+* se escribe, antes de soltar nada; sus tramos pasan a reclaim_ranges y sus bloques compartidos
+* (empaquetado, atributos) se sueltan aqui. Despues su numero vuelve a estar libre; el registro
+* conserva la generacion, que el siguiente inodo con ese numero incrementa.
+*/
+
+static int assoofs_reclaim_inode(struct super_block *sb, struct assoofs_orphan *orphan) {
+
+	struct assoofs_inode_info *inode_info = NULL, *inode_pos;
+	struct buffer_head *bh;
+	LIST_HEAD(ranges);
+	uint32_t generation;
+	int ret;
+
+	inode_pos = assoofs_inode_slot(sb, orphan->ino, &bh);
+	if (!inode_pos)
+		return -EIO;
+	// un registro ya borrado (corte justo despues de hacerlo) solo tiene que salir de la lista
+	if (inode_pos->inode_no == orphan->ino) {
+		inode_info = assoofs_get_inode_info(sb, orphan->ino);
+		if (!inode_info) {
+			brelse(bh);
+			return -ENOMEM;
+		}
+	}
+	brelse(bh);
+
+	if (inode_info) {
+		if ((inode_info->flags & ASSOOFS_INODE_COMPRESSED) && !(inode_info->flags & ASSOOFS_INODE_INLINE)) {
+			ret = assoofs_cut_clusters(sb, inode_info, inode_info->file_size, 0, &ranges);
+			if (ret) {
+				// lo que ya se ha quitado del indice se libera igual, con el registro al dia
+				assoofs_save_inode_info(sb, inode_info);
+				assoofs_sync_inode_info(sb, orphan->ino);
+				assoofs_reclaim_later(sb, &ranges);
+				assoofs_release_extents(container_of(inode_info, struct assoofs_inode_mem, info));
+				kfree(container_of(inode_info, struct assoofs_inode_mem, info));
+				return ret;
+			}
+		}
+		assoofs_cut_extents(sb, inode_info, 0, U64_MAX, &ranges); // hasta el final: no parte ningun tramo
+		assoofs_defer_free_extents(inode_info, &ranges);
+	}
+
+	assoofs_orphan_del(sb, orphan);
+	inode_pos = assoofs_inode_slot(sb, orphan->ino, &bh);
+	if (inode_pos) {
+		generation = inode_pos->generation;
+		memset(inode_pos, 0, sizeof(*inode_pos));
+		inode_pos->generation = generation;
+		mark_buffer_dirty(bh);
+		ret = assoofs_sync_buffer(sb, bh);
+		brelse(bh);
+		if (ret)
+			printk(KERN_ERR "RECLAIM: no se pudo escribir el registro del inodo %llu\n", orphan->ino);
+	}
+	if (!inode_info) {
+		assoofs_free_inode_number(sb, orphan->ino, false);
+		return 0;
+	}
+
+	if (inode_info->flags & ASSOOFS_INODE_TAIL)
+		assoofs_release_tail(sb, inode_info);
+	if (inode_info->xattr_block)
+		assoofs_xattr_release_block(sb, inode_info->xattr_block);
+
+	assoofs_free_inode_number(sb, orphan->ino, S_ISDIR(inode_info->mode));
+
+	assoofs_reclaim_later(sb, &ranges);
+	assoofs_release_extents(container_of(inode_info, struct assoofs_inode_mem, info));
+	kfree(container_of(inode_info, struct assoofs_inode_mem, info));
+	return 0;
+}
+
+/*
+* Liberacion en segundo plano: primero los tramos pendientes, de ASSOOFS_RECLAIM_BATCH bloques cada vez
+* dejando paso a otros entre tanda y tanda, y despues los huerfanos de uno en uno. Montado de solo
+* lectura no se toca nada; lo que quede se retoma al volver a escritura.
+*/
+
+static void assoofs_reclaim_work(struct work_struct *work) {
+
+	struct assoofs_sb_info *sbi = container_of(work, struct assoofs_sb_info, reclaim_work);
+	struct super_block *sb = sbi->sb;
+	struct assoofs_reclaim_range *range;
+	struct assoofs_orphan *orphan;
+	uint64_t start, n;
+	bool shared;
+
+	while (!sb_rdonly(sb)) {
+		spin_lock(&sbi->reclaim_lock);
+		range = list_first_entry_or_null(&sbi->reclaim_ranges, struct assoofs_reclaim_range, list);
+		if (range) {
+			start = range->start;
+			n = min_t(uint64_t, range->len, ASSOOFS_RECLAIM_BATCH);
+			shared = range->shared;
+			range->start += n;
+			range->len -= n;
+			if (range->len)
+				range = NULL;
+			else
+				list_del(&range->list);
+			spin_unlock(&sbi->reclaim_lock);
+
+			if (shared)
+				assoofs_refcount_adjust(sb, start, n, -1);
+			else
+				assoofs_free_blocks(sb, start, n);
+			kfree(range);
+			cond_resched();
+			continue;
+		}
+		orphan = list_first_entry_or_null(&sbi->reclaim_inodes, struct assoofs_orphan, reclaim);
+		spin_unlock(&sbi->reclaim_lock);
+		if (!orphan)
+			break;
+
+		if (assoofs_reclaim_inode(sb, orphan)) {
+			// se queda en la lista de huerfanos: se reintenta al volver a montar
+			printk(KERN_ERR "RECLAIM: no se pudo liberar el inodo %llu\n", orphan->ino);
+			mutex_lock(&sbi->orphan_lock);
+			spin_lock(&sbi->reclaim_lock);
+			list_del_init(&orphan->reclaim);
+			spin_unlock(&sbi->reclaim_lock);
+			mutex_unlock(&sbi->orphan_lock);
+		} else {
+			kfree(orphan);
+		}
+		cond_resched();
+	}
+}
+
+/*
+* Desmontaje: lo que reclaim_work no ha llegado a liberar. Los huerfanos siguen en la lista en disco y
+* se liberan al volver a montar; los tramos de un truncate se pierden hasta que se repare la imagen.
+*/
+
+static void assoofs_release_reclaim(struct assoofs_sb_info *sbi) {
+
+	struct assoofs_reclaim_range *range, *rtmp;
+	struct assoofs_orphan *orphan, *otmp;
+	uint64_t lost = 0;
+
+	list_for_each_entry_safe(range, rtmp, &sbi->reclaim_ranges, list) {
+		lost += range->len;
+		kfree(range);
+	}
+	if (lost)
+		printk(KERN_ERR "RECLAIM: se pierden %llu bloques de ficheros truncados\n", lost);
+	list_for_each_entry_safe(orphan, otmp, &sbi->orphans, list)
+		kfree(orphan);
+}
+
+/*
+* Escritura de un inodo sucio (writeback, sync, desmontaje): aqui se asigna sitio a los bloques que
+* esperan en memoria y se guardan las fechas. El resto de la info persistente ya se guarda en cada operacion.
+*/
+
+static int assoofs_write_inode(struct inode *inode, struct writeback_control *wbc) {
+
+	int ret;
+
+	if (!inode->i_private)
+		return 0;
+
+	// el writeback en segundo plano no espera a una escritura en curso, lo deja sucio para la proxima vuelta
+	if (wbc->sync_mode == WB_SYNC_ALL) {
+		inode_lock(inode);
+	} else if (!inode_trylock(inode)) {
+		mark_inode_dirty(inode);
+		return 0;
+	}
+	ret = assoofs_pack_tail(inode);
+	if (!ret)
+		ret = assoofs_flush_delalloc(inode);
+	if (!ret)
+		ret = assoofs_flush_cluster(inode);
+	if (!ret)
+		ret = assoofs_save_inode_times(inode); // las fechas que solo estaban en memoria
+	inode_unlock(inode);
+	return ret;
+}
+
+/*
+* El inodo sale de memoria: se vuelca lo que quede pendiente (si el fichero sigue existiendo)
+* y se libera el inodo en memoria
+*/
+
+static void assoofs_evict_inode(struct inode *inode) {
+
+	int ret;
+
+	truncate_inode_pages_final(&inode->i_data);
+	if (inode->i_private) {
+		if (inode->i_nlink) {
+			// empaquetar es opcional: si falla los datos se vuelcan igual en un bloque propio
+			assoofs_pack_tail(inode);
+			ret = assoofs_flush_delalloc(inode);
+			if (ret)
+				printk(KERN_ERR "%s: inodo %lu: se pierden %llu bloques sin escribir (error %d)\n",
+						__func__, inode->i_ino, ASSOOFS_I(inode)->delalloc_count, ret);
+			ret = assoofs_flush_cluster(inode);
+			if (ret)
+				printk(KERN_ERR "%s: inodo %lu: se pierde un cluster sin escribir (error %d)\n", __func__, inode->i_ino, ret);
+			assoofs_save_inode_times(inode);
+		}
+		assoofs_drop_delalloc(inode); // un fichero borrado antes del volcado nunca llega a pedir bloques
+		// borrado: sus bloques y su registro los libera reclaim_work, el inodo en memoria ya no hace falta
+		if (!inode->i_nlink && ASSOOFS_I(inode)->orphan)
+			assoofs_orphan_release(inode->i_sb, ASSOOFS_I(inode)->orphan);
+		kvfree(ASSOOFS_I(inode)->cluster_buf);
+		assoofs_release_extents(ASSOOFS_I(inode));
+		invalidate_inode_buffers(inode);
+		kfree(ASSOOFS_I(inode));
+		inode->i_private = NULL;
+	}
+	clear_inode(inode);
+}
+
+
+/*
+* Direccionamiento directo de la tabla de inodos: el inodo ino esta en el grupo (ino - 1) / inodes_per_group,
+* en la posicion (ino - 1) % inodes_per_group de su tabla. Devuelve el bloque de la tabla que tiene su
+* registro, o 0 si el numero no es valido o no se pudo leer el descriptor del grupo.
+*/
+
+static uint64_t assoofs_inode_block(struct super_block *sb, uint64_t inode_no) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_group_desc *desc;
+	uint64_t index;
+
+	if (inode_no < ASSOOFS_ROOTDIR_INODE_NUMBER || inode_no > sbi->groups_count * sbi->inodes_per_group)
+		return 0;
+
+	desc = assoofs_get_group_desc(sb, (inode_no - 1) / sbi->inodes_per_group, NULL);
+	if (!desc)
+		return 0;
+	index = (inode_no - 1) % sbi->inodes_per_group;
+	return desc->inode_table + index / ASSOOFS_INODES_PER_BLOCK;
+}
+
+/*
+* Devuelve un puntero al registro del inodo inode_no dentro de *bh, que el llamante tiene que liberar,
+* o NULL si el numero no es valido o no se pudo leer el bloque.
+*/
+
+static struct assoofs_inode_info *assoofs_inode_slot(struct super_block *sb, uint64_t inode_no, struct buffer_head **bh) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	uint64_t block, index;
+	bool hit;
+
+	// con la tabla precargada el bloque ya esta en memoria: se coge otra referencia y listo
+	if (sbi->itable_bh && inode_no >= ASSOOFS_ROOTDIR_INODE_NUMBER && inode_no <= sbi->groups_count * sbi->inodes_per_group) {
+		index = (inode_no - 1) % sbi->inodes_per_group;
+		*bh = sbi->itable_bh[(inode_no - 1) / sbi->inodes_per_group * sbi->itable_blocks + index / ASSOOFS_INODES_PER_BLOCK];
+		get_bh(*bh);
+		assoofs_stat_inc(sb, ASSOOFS_STAT_ITABLE_HITS);
+		return (struct assoofs_inode_info *)(*bh)->b_data + (inode_no - 1) % ASSOOFS_INODES_PER_BLOCK;
+	}
+
+	block = assoofs_inode_block(sb, inode_no);
+	if (!block)
+		return NULL;
+	*bh = assoofs_bread_hit(sb, block, &hit);
+	assoofs_stat_inc(sb, hit ? ASSOOFS_STAT_ITABLE_HITS : ASSOOFS_STAT_ITABLE_MISSES);
+	if (!*bh)
+		return NULL;
+	return (struct assoofs_inode_info *)(*bh)->b_data + (inode_no - 1) % ASSOOFS_INODES_PER_BLOCK;
+}
+
+/*
+* Opcion preload: lee la tabla de inodos de todos los grupos y retiene sus bloques hasta el desmontaje,
+* asi buscar un inodo nunca va al disco. La tabla de cada grupo esta seguida, se piden todos sus bloques
+* de golpe con el plug puesto para que el bloque los junte en lecturas grandes y luego se recogen.
+*/
+
+static int assoofs_preload_itable(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_group_desc *desc;
+	struct blk_plug plug;
+	uint64_t g, i, first;
+
+	sbi->itable_blocks = DIV_ROUND_UP(sbi->inodes_per_group, ASSOOFS_INODES_PER_BLOCK);
+	sbi->itable_bh = kvcalloc(sbi->groups_count * sbi->itable_blocks, sizeof(struct buffer_head *), GFP_KERNEL);
+	if (!sbi->itable_bh)
+		return -ENOMEM;
+
+	for (g = 0; g < sbi->groups_count; g++) {
+		desc = assoofs_get_group_desc(sb, g, NULL);
+		if (!desc)
+			goto out_release;
+		first = desc->inode_table;
+
+		blk_start_plug(&plug);
+		for (i = 0; i < sbi->itable_blocks; i++)
+			sb_breadahead(sb, first + i);
+		blk_finish_plug(&plug);
+
+		for (i = 0; i < sbi->itable_blocks; i++) {
+			sbi->itable_bh[g * sbi->itable_blocks + i] = assoofs_bread(sb, first + i);
+			if (!sbi->itable_bh[g * sbi->itable_blocks + i])
+				goto out_release;
+		}
+		cond_resched();
+	}
+	printk(KERN_INFO "PRELOAD: %llu bloques de la tabla de inodos en memoria\n", sbi->groups_count * sbi->itable_blocks);
+	return 0;
+
+out_release:
+	assoofs_release_itable(sbi);
+	return -EIO;
+}
+
+/*
+* Suelta los bloques de la tabla de inodos precargados, si los hay
+*/
+
+static void assoofs_release_itable(struct assoofs_sb_info *sbi) {
+
+	uint64_t i;
+
+	if (!sbi->itable_bh)
+		return;
+	for (i = 0; i < sbi->groups_count * sbi->itable_blocks; i++)
+		brelse(sbi->itable_bh[i]);
+	kvfree(sbi->itable_bh);
+	sbi->itable_bh = NULL;
+}
+
+/*
+* Reserva un inodo en memoria (struct assoofs_inode_mem) y devuelve su info persistente, vacia.
+* Se libera en assoofs_evict_inode.
+*/
+
+static struct assoofs_inode_info *assoofs_new_inode_info(void) {
+
+	struct assoofs_inode_mem *mem = kzalloc(sizeof(struct assoofs_inode_mem), GFP_KERNEL);
+
+	if (!mem)
+		return NULL;
+	mutex_init(&mem->cluster_lock);
+	init_rwsem(&mem->xattr_sem);
+	INIT_LIST_HEAD(&mem->usage_list);
+	return &mem->info;
+}
+
+	/* 
+	* Funcion que obtiene la informacion persistente del inodo del superbloque sb
+	*/
+	
+struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no){
+
+		struct assoofs_inode_info *inode_info;
+		struct buffer_head *bh;
+		struct assoofs_inode_info *buffer = NULL;
+		
+		//Vamos directamente al registro del inodo en la tabla de su grupo
+		inode_info = assoofs_inode_slot(sb, inode_no, &bh);
+		if (!inode_info) {
+			printk(KERN_ERR "GET INODEINFO: inode %llu out of range\n", inode_no);
+			return NULL;
+		}
+
+		//Un hueco que no se ha usado nunca tiene inode_no a 0
+		if (inode_info->inode_no == inode_no) {
+			buffer = assoofs_new_inode_info(); //reservamos memoria para el inodo en memoria, que contiene la info persistente
+			if (buffer)
+				memcpy(buffer, inode_info, sizeof(*buffer)); //esta es la copia que se devuelve si se encuentra
+		}
+
+		trace_assoofs_get_inode_info(sb, inode_no, bh->b_blocknr);
+		brelse(bh);
+
+		//Los tramos que no caben en el registro estan en las hojas de su indice
+		if (buffer && buffer->extent_block && assoofs_load_extents(sb, buffer)) {
+			kfree(container_of(buffer, struct assoofs_inode_mem, info));
+			return NULL;
+		}
+
+		return buffer;
+	}
+
+/*
+* ACtualiza en disco la info persistente de un inodo
+*/
+
+int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info) {
+
+
+	struct buffer_head *bh;
+	struct assoofs_inode_info *inode_pos;
+	struct assoofs_inode_mem *mem;
+
+	inode_pos = assoofs_inode_slot(sb, inode_info->inode_no, &bh);
+	if (!inode_pos) {
+		printk(KERN_ERR "SAVE INODE INFO: inode %llu out of range\n", inode_info->inode_no);
+		return -EIO;
+	}
+
+	// las fechas pendientes (lazytime) viajan con cualquier otro cambio del registro
+	mem = container_of(inode_info, struct assoofs_inode_mem, info);
+	if (mem->vfs_inode)
+		assoofs_times_to_info(mem->vfs_inode, inode_info);
+
+	//Actualizamos y marcamos el bloque como sucio; llega a disco con fsync, sync o el writeback del dispositivo
+	// (menos next_orphan, que es de la lista de huerfanos y no de la copia en memoria)
+	inode_info->next_orphan = inode_pos->next_orphan;
+	memcpy(inode_pos, inode_info, sizeof(*inode_pos));
+	mark_buffer_dirty(bh);
+	trace_assoofs_save_inode_info(sb, inode_info->inode_no, bh->b_blocknr);
+	brelse(bh);
+
+	// y la parte de la tabla de tramos que ha cambiado, si esta en las hojas de un indice
+	if (mem->extents_dirty && (!mem->extents || !assoofs_store_extents(sb, mem)))
+		mem->extents_dirty = false;
+
+	// todo lo que se guarda hoy (tamanyo, tramos, hijos) hace falta para leer los datos
+	mem->meta_dirty = true;
+	mem->datasync_dirty = true;
+
+	return 0; //devuelve 0 si todo va bien
+}
+
+/*
+* Copia las fechas del inodo del VFS a la info persistente y al reves. En disco van segundos y nanosegundos por separado
+*/
+
+static void assoofs_times_to_info(struct inode *inode, struct assoofs_inode_info *inode_info) {
+
+	inode_info->atime = inode->i_atime.tv_sec;
+	inode_info->atime_nsec = inode->i_atime.tv_nsec;
+	inode_info->mtime = inode->i_mtime.tv_sec;
+	inode_info->mtime_nsec = inode->i_mtime.tv_nsec;
+	inode_info->ctime = inode->i_ctime.tv_sec;
+	inode_info->ctime_nsec = inode->i_ctime.tv_nsec;
+}
+
+static void assoofs_times_from_info(struct inode *inode, struct assoofs_inode_info *inode_info) {
+
+	inode->i_atime.tv_sec = inode_info->atime;
+	inode->i_atime.tv_nsec = inode_info->atime_nsec;
+	inode->i_mtime.tv_sec = inode_info->mtime;
+	inode->i_mtime.tv_nsec = inode_info->mtime_nsec;
+	inode->i_ctime.tv_sec = inode_info->ctime;
+	inode->i_ctime.tv_nsec = inode_info->ctime_nsec;
+}
+
+/*
+* Guarda solo las fechas del inodo, si han cambiado desde la ultima vez que se escribio su registro.
+* Lo llaman write_inode (sync, caducidad de I_DIRTY_TIME con lazytime, ultimo iput) y fsync; un cambio
+* solo de fechas no hace falta para leer los datos, asi que fdatasync no lo escribe.
+*/
+
+static int assoofs_save_inode_times(struct inode *inode) {
+
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	struct assoofs_inode_info *inode_info = &mem->info;
+	struct assoofs_inode_info *inode_pos;
+	struct buffer_head *bh;
+
+	assoofs_times_to_info(inode, inode_info);
+	inode_pos = assoofs_inode_slot(inode->i_sb, inode_info->inode_no, &bh);
+	if (!inode_pos)
+		return -EIO;
+
+	if (inode_pos->atime != inode_info->atime || inode_pos->atime_nsec != inode_info->atime_nsec ||
+			inode_pos->mtime != inode_info->mtime || inode_pos->mtime_nsec != inode_info->mtime_nsec ||
+			inode_pos->ctime != inode_info->ctime || inode_pos->ctime_nsec != inode_info->ctime_nsec) {
+		inode_pos->atime = inode_info->atime;
+		inode_pos->atime_nsec = inode_info->atime_nsec;
+		inode_pos->mtime = inode_info->mtime;
+		inode_pos->mtime_nsec = inode_info->mtime_nsec;
+		inode_pos->ctime = inode_info->ctime;
+		inode_pos->ctime_nsec = inode_info->ctime_nsec;
+		mark_buffer_dirty(bh);
+		mem->meta_dirty = true;
+	}
+	brelse(bh);
+	return 0;
+}
+
+/*
+* Anyade info al inodo: escribe el registro de un inodo recien numerado por assoofs_new_inode_number
+*/
+void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode) {
+
+	struct assoofs_inode_mem *mem = container_of(inode, struct assoofs_inode_mem, info);
+	struct assoofs_inode_info *inode_pos;
+	struct buffer_head *bh;
+
+	// un numero reutilizado estrena generacion, asi un identificador del inodo anterior ya no vale
+	inode_pos = assoofs_inode_slot(sb, inode->inode_no, &bh);
+	if (inode_pos) {
+		inode->generation = inode_pos->generation + 1;
+		trace_assoofs_add_inode_info(sb, inode->inode_no, bh->b_blocknr);
+		brelse(bh);
+	}
+	if (mem->vfs_inode)
+		mem->vfs_inode->i_generation = inode->generation;
+	assoofs_save_inode_info(sb, inode);
+}
+
+/*
+* Para mostrar lo que tiene un dir. De paso se piden por adelantado (sin esperar) los bloques de la
+* tabla de inodos con los registros de los hijos: detras de un listado suele venir un lookup y un stat
+* de cada uno (ls -l, find), que asi encuentran el registro ya en memoria. Los hijos de un directorio
+* suelen estar seguidos en la tabla, asi que no se pide dos veces el mismo bloque.
+*/
+struct assoofs_iterate_ctx {
+	struct dir_context *ctx;
+	struct super_block *sb;
+	uint64_t last_block;
+};
+
+static int assoofs_iterate_actor(void *priv, const char *name, int len, uint64_t inode_no) {
+
+	struct assoofs_iterate_ctx *ictx = priv;
+	struct dir_context *ctx = ictx->ctx;
+	uint64_t block = assoofs_inode_block(ictx->sb, inode_no);
+
+	if (block && block != ictx->last_block) {
+		sb_breadahead(ictx->sb, block);
+		ictx->last_block = block;
+	}
+
+	dir_emit(ctx, name, len, inode_no, DT_UNKNOWN);
+	ctx->pos += sizeof(struct assoofs_dir_record_entry); //cade vez que anyadimos una entrada al contexto ctx incremenetamos el valor de pos con el tamanyo de esa nueva entrada
+	return 0;
+}
+
+static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
+    
+	
+	//accedemos al inodo, a la info persistente al inodo y al superbloque de acuerdo al campo filp
+	struct inode *inode;
+	struct super_block *sb;
+	struct assoofs_inode_info *inode_info;
+	struct assoofs_iterate_ctx ictx = { .ctx = ctx };
+	int ret;
+	
+	inode = filp->f_path.dentry->d_inode; //EL FILP TINE F_PATH CON D_INODE QUE ES PARA IDENTIFICAR AL INODO
+	sb = inode->i_sb;
+	inode_info = inode->i_private; //info persistente al inodo
+	
+    
+	if (ctx->pos) return 0; //si pos es distinto de 0 ya estaba creado
+	if ((!S_ISDIR(inode_info->mode))) return -1; //si el inodo obtenido se coresponde con un directorio
+
+	//recorremos las entradas, en linea o en el bloque del directorio, y por cada archivo llamamos a dir_emit que añade entradas al contexto
+	ictx.sb = sb;
+	ret = assoofs_dir_walk(sb, inode_info, assoofs_iterate_actor, &ictx);
+	trace_assoofs_iterate(inode, ret < 0 ? ret : 0);
+	if (ret < 0)
+		return ret;
+
+	return 0;
+	
+}
+
+
+/*
+* Tabla de tramos de un fichero: extents[] del registro o, cuando no caben ahi, la copia en memoria de las
+* hojas de su indice. En *max deja el sitio que tiene; los tramos en uso van primero y el resto esta a cero.
+*/
+
+static struct assoofs_extent *assoofs_extent_table(struct assoofs_inode_info *inode_info, int *max) {
+
+	struct assoofs_inode_mem *mem = container_of(inode_info, struct assoofs_inode_mem, info);
+
+	if (!mem->extents) {
+		*max = ASSOOFS_INODE_EXTENTS;
+		return inode_info->extents;
+	}
+	*max = mem->extents_max;
+	return mem->extents;
+}
+
+static inline struct assoofs_extent *assoofs_extent_at(struct assoofs_inode_info *inode_info, int i) {
+
+	int max;
+
+	return assoofs_extent_table(inode_info, &max) + i;
+}
+
+/*
+* Tramos en uso de una tabla. Los libres estan todos al final, asi que basta con una biseccion.
+*/
+
+static int assoofs_extent_count(struct assoofs_extent *ext, int max) {
+
+	int lo = 0, hi = max, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ext[mid].len)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+* Posicion del primero de los used tramos de ext que acaba despues del bloque logico iblock, o used si no hay
+*/
+
+static int assoofs_extent_search(struct assoofs_extent *ext, int used, uint64_t iblock) {
+
+	int lo = 0, hi = used, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((uint64_t)ext[mid].logical + assoofs_ext_len(&ext[mid]) <= iblock)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+* La tabla ha cambiado a partir de la posicion pos: el siguiente assoofs_save_inode_info copia esas hojas
+*/
+
+static void assoofs_extents_changed(struct assoofs_inode_info *inode_info, int pos) {
+
+	struct assoofs_inode_mem *mem = container_of(inode_info, struct assoofs_inode_mem, info);
+
+	if (!mem->extents_dirty || pos < mem->extents_dirty_from)
+		mem->extents_dirty_from = pos;
+	mem->extents_dirty = true;
+}
+
+/*
+* Se asegura de que caben n tramos mas en la tabla de un fichero. Cuando extents[] del registro se queda
+* corto todos pasan a hojas de un bloque apuntadas desde un bloque indice (extent_block), y despues se
+* anyaden hojas segun hacen falta, cerca del indice. Las hojas no se devuelven hasta que se libera el
+* inodo. Si falta algun bloque no cambia nada; -EFBIG si no caben ni con el indice lleno.
+*/
+
+static int assoofs_extent_room(struct super_block *sb, struct assoofs_inode_info *inode_info, int n) {
+
+	struct assoofs_inode_mem *mem = container_of(inode_info, struct assoofs_inode_mem, info);
+	struct assoofs_extent_index *idx;
+	struct assoofs_extent *ext, *table;
+	struct buffer_head *ibh, *bh;
+	uint64_t block;
+	uint32_t leaves, old_leaves, i;
+	int max, used, ret;
+
+	ext = assoofs_extent_table(inode_info, &max);
+	used = assoofs_extent_count(ext, max);
+	if (used + n <= max)
+		return 0;
+
+	leaves = DIV_ROUND_UP(used + n, ASSOOFS_EXTENTS_PER_BLOCK);
+	if (leaves > ASSOOFS_EXTENT_INDEX_LEAVES)
+		return -EFBIG;
+	table = kvzalloc(leaves * ASSOOFS_EXTENTS_PER_BLOCK * sizeof(struct assoofs_extent), GFP_KERNEL);
+	if (!table)
+		return -ENOMEM;
+
+	// la primera vez hace falta tambien el indice
+	ibh = mem->extent_bh;
+	if (!ibh) {
+		ret = assoofs_sb_get_a_freeblock(sb, inode_info->data_block_number, &block);
+		if (ret)
+			goto out_free_table;
+		ibh = sb_getblk(sb, block);
+		if (!ibh) {
+			assoofs_free_blocks(sb, block, 1);
+			ret = -ENOMEM;
+			goto out_free_table;
+		}
+		lock_buffer(ibh);
+		memset(ibh->b_data, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+		((struct assoofs_extent_index *)ibh->b_data)->magic = ASSOOFS_EXTENT_MAGIC;
+		set_buffer_uptodate(ibh);
+		unlock_buffer(ibh);
+	}
+	idx = (struct assoofs_extent_index *)ibh->b_data;
+
+	// hojas nuevas a cero: lo que no se llegue a usar de ellas es el final de la tabla
+	old_leaves = idx->leaves;
+	for (i = old_leaves; i < leaves; i++) {
+		ret = assoofs_sb_get_a_freeblock(sb, ibh->b_blocknr, &block);
+		if (ret)
+			goto out_free_leaves;
+		bh = sb_getblk(sb, block);
+		if (!bh) {
+			assoofs_free_blocks(sb, block, 1);
+			ret = -ENOMEM;
+			goto out_free_leaves;
+		}
+		lock_buffer(bh);
+		memset(bh->b_data, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+		idx->leaf[i] = block;
+	}
+	idx->leaves = leaves;
+	mark_buffer_dirty(ibh);
+
+	memcpy(table, ext, used * sizeof(struct assoofs_extent));
+	if (mem->extents) {
+		kvfree(mem->extents);
+	} else {
+		memset(inode_info->extents, 0, sizeof(inode_info->extents));
+		inode_info->extent_block = ibh->b_blocknr;
+		mem->extent_bh = ibh;
+	}
+	mem->extents = table;
+	mem->extents_max = leaves * ASSOOFS_EXTENTS_PER_BLOCK;
+	assoofs_extents_changed(inode_info, 0);
+	trace_assoofs_extent_room(sb, inode_info->inode_no, used, leaves);
+	return 0;
+
+out_free_leaves:
+	while (i-- > old_leaves) {
+		assoofs_free_blocks(sb, idx->leaf[i], 1);
+		idx->leaf[i] = 0;
+	}
+	if (!mem->extent_bh) {
+		block = ibh->b_blocknr;
+		brelse(ibh);
+		assoofs_free_blocks(sb, block, 1);
+	}
+out_free_table:
+	kvfree(table);
+	return ret;
+}
+
+/*
+* Copia a las hojas del indice la parte de la tabla en memoria que ha cambiado. Solo se ensucian
+* las hojas cuyo contenido es distinto; se escriben con el registro (fsync) o con el writeback.
+*/
+
+static int assoofs_store_extents(struct super_block *sb, struct assoofs_inode_mem *mem) {
+
+	struct assoofs_extent_index *idx = (struct assoofs_extent_index *)mem->extent_bh->b_data;
+	size_t size = ASSOOFS_EXTENTS_PER_BLOCK * sizeof(struct assoofs_extent);
+	struct assoofs_extent *ext;
+	struct buffer_head *bh;
+	uint32_t i;
+	int ret = 0;
+
+	for (i = mem->extents_dirty_from / ASSOOFS_EXTENTS_PER_BLOCK; i < idx->leaves; i++) {
+		ext = mem->extents + i * ASSOOFS_EXTENTS_PER_BLOCK;
+		bh = assoofs_bread(sb, idx->leaf[i]);
+		if (!bh) {
+			ret = -EIO;
+			continue;
+		}
+		if (memcmp(bh->b_data, ext, size)) {
+			memcpy(bh->b_data, ext, size);
+			mark_buffer_dirty(bh);
+		}
+		brelse(bh);
+	}
+	return ret;
+}
+
+/*
+* Escribe y espera el indice de tramos de un inodo y sus hojas, si los tiene. Una hoja que no esta
+* en la cache de buffers no puede estar sucia.
+*/
+
+static int assoofs_sync_extents(struct super_block *sb, struct assoofs_inode_info *inode_info) {
+
+	struct assoofs_inode_mem *mem = container_of(inode_info, struct assoofs_inode_mem, info);
+	struct assoofs_extent_index *idx;
+	struct buffer_head *bh;
+	uint32_t i;
+	int ret, err;
+
+	if (!mem->extent_bh)
+		return 0;
+	idx = (struct assoofs_extent_index *)mem->extent_bh->b_data;
+	ret = assoofs_sync_buffer(sb, mem->extent_bh);
+	for (i = 0; i < idx->leaves; i++) {
+		bh = sb_find_get_block(sb, idx->leaf[i]);
+		if (!bh)
+			continue;
+		err = assoofs_sync_buffer(sb, bh);
+		ret = ret ?: err;
+		brelse(bh);
+	}
+	return ret;
+}
+
+/*
+* Lee el indice de tramos de un inodo y copia sus hojas a memoria; el indice se queda retenido. Las
+* hojas se piden todas de golpe antes de esperar a ninguna.
+*/
+
+static int assoofs_load_extents(struct super_block *sb, struct assoofs_inode_info *inode_info) {
+
+	struct assoofs_inode_mem *mem = container_of(inode_info, struct assoofs_inode_mem, info);
+	size_t size = ASSOOFS_EXTENTS_PER_BLOCK * sizeof(struct assoofs_extent);
+	struct assoofs_extent_index *idx;
+	struct buffer_head *ibh, *bh;
+	struct blk_plug plug;
+	uint32_t i;
+
+	ibh = assoofs_bread(sb, inode_info->extent_block);
+	if (!ibh)
+		return -EIO;
+	idx = (struct assoofs_extent_index *)ibh->b_data;
+	if (idx->magic != ASSOOFS_EXTENT_MAGIC || !idx->leaves || idx->leaves > ASSOOFS_EXTENT_INDEX_LEAVES) {
+		printk(KERN_ERR "LOAD EXTENTS: el indice de tramos del inodo %llu no es valido\n", inode_info->inode_no);
+		brelse(ibh);
+		return -EIO;
+	}
+	mem->extents = kvzalloc(idx->leaves * size, GFP_KERNEL);
+	if (!mem->extents) {
+		brelse(ibh);
+		return -ENOMEM;
+	}
+
+	blk_start_plug(&plug);
+	for (i = 0; i < idx->leaves; i++)
+		sb_breadahead(sb, idx->leaf[i]);
+	blk_finish_plug(&plug);
+	for (i = 0; i < idx->leaves; i++) {
+		bh = assoofs_bread(sb, idx->leaf[i]);
+		if (!bh) {
+			kvfree(mem->extents);
+			mem->extents = NULL;
+			brelse(ibh);
+			return -EIO;
+		}
+		memcpy(mem->extents + i * ASSOOFS_EXTENTS_PER_BLOCK, bh->b_data, size);
+		brelse(bh);
+	}
+	mem->extents_max = idx->leaves * ASSOOFS_EXTENTS_PER_BLOCK;
+	mem->extent_bh = ibh;
+	return 0;
+}
+
+/*
+* Suelta la tabla de tramos en memoria de un inodo y su indice
+*/
+
+static void assoofs_release_extents(struct assoofs_inode_mem *mem) {
+
+	kvfree(mem->extents);
+	mem->extents = NULL;
+	brelse(mem->extent_bh);
+	mem->extent_bh = NULL;
+}
+
+/*
+* Apunta en ranges el indice de tramos de un inodo que se libera y sus hojas
+*/
+
+static void assoofs_defer_free_extents(struct assoofs_inode_info *inode_info, struct list_head *ranges) {
+
+	struct assoofs_inode_mem *mem = container_of(inode_info, struct assoofs_inode_mem, info);
+	struct assoofs_extent_index *idx;
+	uint32_t i;
+
+	if (!mem->extent_bh)
+		return;
+	idx = (struct assoofs_extent_index *)mem->extent_bh->b_data;
+	for (i = 0; i < idx->leaves; i++)
+		assoofs_defer_free(ranges, idx->leaf[i], 1, false);
+	assoofs_defer_free(ranges, inode_info->extent_block, 1, false);
+}
+
+/*
+* Busca el tramo que contiene el bloque logico iblock y devuelve su posicion, o -1 si iblock cae en
+* un hueco. En ese caso, si next no es NULL, deja en *next el primer bloque logico del siguiente
+* tramo (U64_MAX si no hay ninguno detras).
+*/
+
+static int assoofs_lookup_extent(struct assoofs_inode_info *inode_info, uint64_t iblock, uint64_t *next) {
+
+	struct assoofs_extent *ext;
+	int i, max, used;
+
+	ext = assoofs_extent_table(inode_info, &max);
+	used = assoofs_extent_count(ext, max);
+	i = assoofs_extent_search(ext, used, iblock);
+	if (i < used && ext[i].logical <= iblock)
+		return i;
+	if (next)
+		*next = i < used ? ext[i].logical : U64_MAX;
+	return -1;
+}
+
+/*
+* Traduce el bloque logico iblock de un fichero a bloque del dispositivo buscando en sus tramos.
+* Si unwritten no es NULL indica ademas si el bloque esta reservado pero sin escribir.
+*/
+
+static int assoofs_map_block(struct assoofs_inode_info *inode_info, uint64_t iblock, uint64_t *block, bool *unwritten) {
+
+	struct assoofs_extent *ext;
+	int i = assoofs_lookup_extent(inode_info, iblock, NULL);
+
+	if (i < 0)
+		return -ENOENT;
+	ext = assoofs_extent_at(inode_info, i);
+	*block = ext->start + (iblock - ext->logical);
+	if (unwritten)
+		*unwritten = assoofs_ext_unwritten(ext);
+	return 0;
+}
+
+/*
+* Bloque logico siguiente al final del ultimo tramo de un fichero (0 si no tiene bloques) y posicion
+* de ese tramo. Los huecos de en medio no se descuentan.
+*/
+
+static uint64_t assoofs_inode_blocks(struct assoofs_inode_info *inode_info, int *last) {
+
+	struct assoofs_extent *ext;
+	int max;
+
+	ext = assoofs_extent_table(inode_info, &max);
+	*last = assoofs_extent_count(ext, max) - 1;
+	return *last < 0 ? 0 : (uint64_t)ext[*last].logical + assoofs_ext_len(&ext[*last]);
+}
+
+/*
+* Mete el tramo [logical, logical + len) -> start en su sitio dentro de la tabla, que tiene que estar
+* libre en el fichero, y lo une con los vecinos si son contiguos. Si la tabla esta llena se hace sitio.
+*/
+
+static int assoofs_insert_extent(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t logical, uint64_t start, uint32_t len) {
+
+	struct assoofs_extent *ext;
+	int i, max, used, ret;
+
+	ext = assoofs_extent_table(inode_info, &max);
+	used = assoofs_extent_count(ext, max);
+	i = assoofs_extent_search(ext, used, logical);
+
+	// pegado al anterior en el fichero y en el dispositivo: solo crece
+	if (i > 0 && ext[i - 1].logical + assoofs_ext_len(&ext[i - 1]) == logical &&
+			ext[i - 1].start + assoofs_ext_len(&ext[i - 1]) == start &&
+			(ext[i - 1].len & ASSOOFS_EXTENT_FLAGS) == (len & ASSOOFS_EXTENT_FLAGS) &&
+			assoofs_ext_len(&ext[i - 1]) + (len & ~ASSOOFS_EXTENT_FLAGS) <= ASSOOFS_EXTENT_MAX_LEN) {
+		ext[i - 1].len += len & ~ASSOOFS_EXTENT_FLAGS;
+		assoofs_extents_changed(inode_info, i - 1);
+	} else {
+		if (used == max) {
+			ret = assoofs_extent_room(sb, inode_info, 1);
+			if (ret)
+				return ret;
+			ext = assoofs_extent_table(inode_info, &max);
+		}
+		memmove(&ext[i + 1], &ext[i], (used - i) * sizeof(*ext));
+		ext[i].logical = logical;
+		ext[i].start = start;
+		ext[i].len = len;
+		assoofs_extents_changed(inode_info, i);
+	}
+
+	assoofs_merge_extents(inode_info);
+	inode_info->data_block_number = ext[0].start;
+	return 0;
+}
+
+/*
+* Asigna count bloques a un fichero a partir del bloque logico lblock, que tiene que ser un hueco
+* (normalmente el final del fichero). Se pide todo de una vez con objetivo en la posicion que le
+* corresponde respecto al tramo anterior, asi una escritura grande que continua el fichero acaba en
+* un unico tramo contiguo. Con unwritten los bloques nuevos quedan marcados como reservados sin
+* escribir (fallocate, o rellenar un hueco que solo se va a escribir en parte).
+*/
+
+static int assoofs_extend_file(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t lblock, uint64_t count, bool unwritten) {
+
+	struct assoofs_extent *ext;
+	uint64_t goal, block, got;
+	uint32_t flag = unwritten ? ASSOOFS_EXTENT_UNWRITTEN : 0;
+	int i, max, ret;
+
+	while (count) {
+		ext = assoofs_extent_table(inode_info, &max);
+		i = assoofs_extent_search(ext, assoofs_extent_count(ext, max), lblock);
+		if (i > 0)
+			goal = ext[i - 1].start + (lblock - ext[i - 1].logical);
+		else if (ext[0].len && ext[0].start > ext[0].logical - lblock)
+			goal = ext[0].start - (ext[0].logical - lblock);
+		else
+			goal = inode_info->data_block_number; // fichero vacio: data_block_number solo es una pista
+
+		ret = assoofs_new_blocks(sb, goal, min_t(uint64_t, count, ASSOOFS_EXTENT_MAX_LEN), &block, &got);
+		if (ret)
+			return ret;
+
+		ret = assoofs_insert_extent(sb, inode_info, lblock, block, got | flag);
+		if (ret) {
+			assoofs_free_blocks(sb, block, got);
+			printk(KERN_ERR "EXTEND FILE: no caben mas tramos en el inodo %llu\n", inode_info->inode_no);
+			return ret;
+		}
+		lblock += got;
+		count -= got;
+	}
+	return 0;
+}
+
+/*
+* Escribe ceros en count bloques del dispositivo a partir de block, sin leerlos antes
+*/
+
+static int assoofs_zero_blocks(struct super_block *sb, uint64_t block, uint64_t count) {
+
+	struct buffer_head *bh;
+	int ret = 0;
+
+	for (; count; block++, count--) {
+		bh = sb_getblk(sb, block);
+		if (!bh)
+			return -ENOMEM;
+		lock_buffer(bh);
+		memset(bh->b_data, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		if (assoofs_sync_buffer(sb, bh))
+			ret = -EIO;
+		brelse(bh);
+	}
+	return ret;
+}
+
+/*
+* Une tramos consecutivos del mismo tipo (y ambos compartidos o ninguno) que tambien son contiguos
+* en el fichero y en el dispositivo. Se hace en una pasada, compactando la tabla sobre si misma.
+*/
+
+static void assoofs_merge_extents(struct assoofs_inode_info *inode_info) {
+
+	struct assoofs_extent *ext;
+	int i, j, max, used, first = -1;
+
+	ext = assoofs_extent_table(inode_info, &max);
+	used = assoofs_extent_count(ext, max);
+	for (i = 0, j = 1; j < used; j++) {
+		if ((ext[i].len & ASSOOFS_EXTENT_FLAGS) == (ext[j].len & ASSOOFS_EXTENT_FLAGS) &&
+				ext[i].logical + assoofs_ext_len(&ext[i]) == ext[j].logical &&
+				ext[i].start + assoofs_ext_len(&ext[i]) == ext[j].start &&
+				assoofs_ext_len(&ext[i]) + assoofs_ext_len(&ext[j]) <= ASSOOFS_EXTENT_MAX_LEN) {
+			ext[i].len += assoofs_ext_len(&ext[j]);
+			if (first < 0)
+				first = i;
+		} else if (++i != j) {
+			ext[i] = ext[j];
+		}
+	}
+	if (first >= 0) {
+		memset(&ext[i + 1], 0, (used - i - 1) * sizeof(*ext));
+		assoofs_extents_changed(inode_info, first);
+	}
+}
+
+/*
+* Marca los bloques logicos [first, end) de un fichero como escritos o como reservados sin escribir,
+* partiendo los tramos que solo quedan cubiertos en parte; para eso se hace sitio para dos tramos mas
+* (los de los dos extremos). Si aun asi no cabe:
+*  - al pasar a escrito se ponen a cero los trozos del tramo que no se escriben y se marca entero
+*  - al pasar a sin escribir se ponen a cero los bloques en disco y el tramo sigue como escrito
+* Los tramos se recorren de atras hacia delante para que partir uno no mueva los que faltan por ver.
+*/
+
+static int assoofs_set_extent_state(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t first, uint64_t end, bool unwritten) {
+
+	struct assoofs_extent *ext;
+	struct assoofs_extent pieces[3];
+	uint64_t a, b, len;
+	uint32_t flag = unwritten ? ASSOOFS_EXTENT_UNWRITTEN : 0;
+	int i, j, max, used, npieces, err, ret = 0;
+
+	assoofs_extent_room(sb, inode_info, 2);
+	ext = assoofs_extent_table(inode_info, &max);
+	used = assoofs_extent_count(ext, max);
+
+	for (i = min(assoofs_extent_search(ext, used, end), used - 1); i >= 0; i--) {
+		len = assoofs_ext_len(&ext[i]);
+		if (ext[i].logical + len <= first)
+			break;
+		if (assoofs_ext_unwritten(&ext[i]) == unwritten || ext[i].logical >= end)
+			continue;
+
+		a = max(first, (uint64_t)ext[i].logical) - ext[i].logical;
+		b = min(end, ext[i].logical + len) - ext[i].logical;
+
+		npieces = 0;
+		if (a > 0) {
+			pieces[npieces].logical = ext[i].logical;
+			pieces[npieces].start = ext[i].start;
+			pieces[npieces++].len = ext[i].len - len + a; // conserva el tipo original
+		}
+		pieces[npieces].logical = ext[i].logical + a;
+		pieces[npieces].start = ext[i].start + a;
+		pieces[npieces++].len = (b - a) | flag | (ext[i].len & ASSOOFS_EXTENT_SHARED);
+		if (b < len) {
+			pieces[npieces].logical = ext[i].logical + b;
+			pieces[npieces].start = ext[i].start + b;
+			pieces[npieces++].len = (ext[i].len - len) + (len - b);
+		}
+
+		if (used + npieces - 1 <= max) {
+			memmove(&ext[i + npieces], &ext[i + 1], (used - i - 1) * sizeof(*ext));
+			for (j = 0; j < npieces; j++)
+				ext[i + j] = pieces[j];
+			used += npieces - 1;
+		} else if (assoofs_ext_shared(&ext[i])) {
+			ret = -EFBIG; // poner a cero bloques compartidos cambiaria tambien el otro fichero
+		} else if (!unwritten) {
+			// si no se consigue poner a cero el resto el tramo sigue sin escribir: se pierde lo escrito,
+			// pero no se dejan ver los bloques viejos
+			err = 0;
+			if (a > 0)
+				err = assoofs_zero_blocks(sb, ext[i].start, a);
+			if (!err && b < len)
+				err = assoofs_zero_blocks(sb, ext[i].start + b, len - b);
+			if (!err)
+				ext[i].len = len;
+			ret = err ?: ret;
+		} else {
+			ret = assoofs_zero_blocks(sb, ext[i].start + a, b - a) ?: ret;
+		}
+		assoofs_extents_changed(inode_info, i);
+	}
+
+	assoofs_merge_extents(inode_info);
+	return ret;
+}
+
+/*
+* Quita de la tabla los bloques logicos [first, end) sin tocar el disco. Los bloques del dispositivo
+* que dejan de estar apuntados se apuntan en ranges (assoofs_defer_free). Los tramos que caen enteros
+* dentro se quitan todos de una vez. Un tramo que contiene todo el rango se parte en dos, haciendo
+* sitio en la tabla si hace falta; si no se consigue no se quita nada y se devuelve el error.
+*/
+
+static int assoofs_cut_extents(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t first, uint64_t end,
+		struct list_head *ranges) {
+
+	struct assoofs_extent *ext;
+	uint64_t a, b, len;
+	int i, lo, max, used, ret;
+
+	ext = assoofs_extent_table(inode_info, &max);
+	used = assoofs_extent_count(ext, max);
+	i = assoofs_extent_search(ext, used, first);
+	if (i == used || ext[i].logical >= end)
+		return 0;
+
+	len = assoofs_ext_len(&ext[i]);
+	a = max(first, (uint64_t)ext[i].logical) - ext[i].logical;
+	b = min(end, ext[i].logical + len) - ext[i].logical;
+	if (a > 0 && b < len) {
+		// en medio del tramo: hace falta un hueco mas en la tabla, que puede cambiar de sitio
+		ret = assoofs_extent_room(sb, inode_info, 1);
+		if (ret)
+			return ret;
+		ext = assoofs_extent_table(inode_info, &max);
+		assoofs_extents_changed(inode_info, i);
+		assoofs_defer_free(ranges, ext[i].start + a, b - a, assoofs_ext_shared(&ext[i]));
+		memmove(&ext[i + 2], &ext[i + 1], (used - i - 1) * sizeof(*ext));
+		ext[i + 1].logical = ext[i].logical + b;
+		ext[i + 1].start = ext[i].start + b;
+		ext[i + 1].len = (ext[i].len - len) + (len - b);
+		ext[i].len = (ext[i].len - len) + a;
+		return 0;
+	}
+
+	assoofs_extents_changed(inode_info, i);
+	// el primero puede quedarse con su principio
+	if (a > 0) {
+		assoofs_defer_free(ranges, ext[i].start + a, len - a, assoofs_ext_shared(&ext[i]));
+		ext[i].len = (ext[i].len - len) + a;
+		i++;
+	}
+	// los que caen enteros dentro
+	for (lo = i; i < used && (uint64_t)ext[i].logical + assoofs_ext_len(&ext[i]) <= end; i++)
+		assoofs_defer_free(ranges, ext[i].start, assoofs_ext_len(&ext[i]), assoofs_ext_shared(&ext[i]));
+	// y el ultimo puede quedarse con su final
+	if (i < used && ext[i].logical < end) {
+		b = end - ext[i].logical;
+		assoofs_defer_free(ranges, ext[i].start, b, assoofs_ext_shared(&ext[i]));
+		ext[i].logical += b;
+		ext[i].start += b;
+		ext[i].len -= b;
+	}
+	if (i > lo) {
+		memmove(&ext[lo], &ext[i], (used - i) * sizeof(*ext));
+		memset(&ext[used - (i - lo)], 0, (i - lo) * sizeof(*ext));
+	}
+
+	if (ext[0].len)
+		inode_info->data_block_number = ext[0].start;
+	return 0;
+}
+
+/*
+* Quita a un fichero los bloques logicos [first, end) y los devuelve al asignador (FALLOC_FL_PUNCH_HOLE).
+* Un tramo que solo queda cubierto en parte se parte en dos (ver assoofs_cut_extents). El registro del
+* inodo y sus tramos se escriben antes de liberar nada, para que un bloque reutilizado nunca siga
+* apuntado desde este fichero.
+*/
+
+static int assoofs_punch_extents(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t first, uint64_t end) {
+
+	struct assoofs_reclaim_range *range, *tmp;
+	LIST_HEAD(ranges);
+	int ret;
+
+	ret = assoofs_cut_extents(sb, inode_info, first, end, &ranges);
+	if (list_empty(&ranges))
+		return ret;
+
+	assoofs_save_inode_info(sb, inode_info);
+	ret = assoofs_sync_extents(sb, inode_info) ?: ret;
+	ret = assoofs_sync_inode_info(sb, inode_info->inode_no) ?: ret;
+	// si el tramo estaba clonado solo se quita una referencia y los bloques siguen ocupados mientras alguien los use
+	list_for_each_entry_safe(range, tmp, &ranges, list) {
+		if (range->shared)
+			assoofs_refcount_adjust(sb, range->start, range->len, -1);
+		else
+			assoofs_free_blocks(sb, range->start, range->len);
+		kfree(range);
+	}
+	return ret;
+}
+
+/*
+* Copia en escritura del trozo [r0, r1) del tramo i de un fichero, cuyos bloques comparte con otro:
+* se le dan bloques nuevos, se copia lo que la escritura de [pos, pos + count) no va a tapar entero y
+* el fichero suelta su referencia a los viejos. Partir el tramo necesita hasta dos huecos mas en la
+* tabla; si no se consiguen se copia el tramo entero, que no necesita ninguno.
+*/
+
+static int assoofs_cow_blocks(struct inode *inode, int i, uint64_t r0, uint64_t r1, loff_t pos, size_t count) {
+
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	struct assoofs_extent *ext, old, pieces[3];
+	struct buffer_head *obh, *nbh;
+	uint64_t len, block, got, b, full_first, full_end;
+	int j, max, used, npieces, ret;
+	bool whole;
+
+	assoofs_extent_room(sb, inode_info, 2);
+	ext = assoofs_extent_table(inode_info, &max);
+	used = assoofs_extent_count(ext, max);
+	old = ext[i];
+	len = assoofs_ext_len(&old);
+	whole = used + (r0 > old.logical) + (r1 < old.logical + len) > max;
+	if (whole) {
+		r0 = old.logical;
+		r1 = old.logical + len;
+	}
+
+	ret = assoofs_new_blocks(sb, old.start + len, r1 - r0, &block, &got);
+	if (ret)
+		return ret;
+	if (got < r1 - r0) {
+		// el tramo entero tiene que ir junto; un trozo puede quedarse mas corto si cabe el resto aparte
+		if (whole || used + (r0 > old.logical) + 1 > max) {
+			assoofs_free_blocks(sb, block, got);
+			return -ENOSPC;
+		}
+		r1 = r0 + got;
+	}
+
+	// los bloques que la escritura tapa enteros no hace falta copiarlos; un tramo sin escribir sigue sin escribir
+	full_first = DIV_ROUND_UP(pos, ASSOOFS_DEFAULT_BLOCK_SIZE);
+	full_end = (pos + count) / ASSOOFS_DEFAULT_BLOCK_SIZE;
+	for (b = r0; b < r1 && !assoofs_ext_unwritten(&old); b++) {
+		if (b >= full_first && b < full_end)
+			continue;
+		obh = assoofs_bread(sb, old.start + (b - old.logical));
+		nbh = sb_getblk(sb, block + (b - r0));
+		if (!obh || !nbh) {
+			brelse(obh);
+			brelse(nbh);
+			assoofs_free_blocks(sb, block, r1 - r0);
+			return -EIO;
+		}
+		lock_buffer(nbh);
+		memcpy(nbh->b_data, obh->b_data, ASSOOFS_DEFAULT_BLOCK_SIZE);
+		set_buffer_uptodate(nbh);
+		unlock_buffer(nbh);
+		mark_buffer_dirty_inode(nbh, inode);
+		brelse(obh);
+		brelse(nbh);
+	}
+
+	npieces = 0;
+	if (r0 > old.logical) {
+		pieces[npieces] = old;
+		pieces[npieces++].len = (old.len - len) + (r0 - old.logical);
+	}
+	pieces[npieces].logical = r0;
+	pieces[npieces].start = block;
+	pieces[npieces++].len = (r1 - r0) | (old.len & ASSOOFS_EXTENT_UNWRITTEN);
+	if (r1 < old.logical + len) {
+		pieces[npieces].logical = r1;
+		pieces[npieces].start = old.start + (r1 - old.logical);
+		pieces[npieces++].len = (old.len - len) + (old.logical + len - r1);
+	}
+	memmove(&ext[i + npieces], &ext[i + 1], (used - i - 1) * sizeof(*ext));
+	for (j = 0; j < npieces; j++)
+		ext[i + j] = pieces[j];
+	assoofs_extents_changed(inode_info, i);
+	assoofs_merge_extents(inode_info);
+	inode_info->data_block_number = ext[0].start;
+	assoofs_save_inode_info(sb, inode_info);
+
+	trace_assoofs_cow(sb, inode_info->inode_no, r0, r1 - 1, block);
+	return assoofs_refcount_adjust(sb, old.start + (r0 - old.logical), r1 - r0, -1);
+}
+
+/*
+* Antes de escribir en los bloques logicos [first, end) de un fichero se copian los que comparte con
+* otro (reflink). Solo se mira la tabla de referencias en los tramos marcados como compartidos.
+*/
+
+static int assoofs_unshare(struct inode *inode, uint64_t first, uint64_t end, loff_t pos, size_t count) {
+
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	struct assoofs_extent *ext;
+	uint64_t iblock, next, eend, phys, shared, shared_len;
+	int i, ret;
+
+	for (iblock = first; iblock < end; ) {
+		i = assoofs_lookup_extent(inode_info, iblock, &next);
+		if (i < 0) {
+			iblock = next;
+			continue;
+		}
+		ext = assoofs_extent_at(inode_info, i);
+		eend = min(end, (uint64_t)ext->logical + assoofs_ext_len(ext));
+		if (!assoofs_ext_shared(ext)) {
+			iblock = eend;
+			continue;
+		}
+		phys = ext->start + (iblock - ext->logical);
+		shared = assoofs_refcount_next_shared(inode->i_sb, phys, eend - iblock, &shared_len);
+		if (shared == U64_MAX) {
+			iblock = eend;
+			continue;
+		}
+		iblock += shared - phys;
+		ret = assoofs_cow_blocks(inode, i, iblock, iblock + shared_len, pos, count);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+* Asignacion diferida: apunta n bloques mas como prometidos a escrituras diferidas si quedan libres.
+* Lejos del limite basta con los valores aproximados de los contadores; cerca se suman los exactos.
+*/
+
+static bool assoofs_claim_delalloc(struct assoofs_sb_info *sbi, uint64_t n) {
+
+	s64 free = percpu_counter_read_positive(&sbi->free_blocks_counter);
+	s64 dirty = percpu_counter_read_positive(&sbi->delalloc_blocks_counter);
+
+	if (free < dirty + (s64)n + 4 * percpu_counter_batch * num_online_cpus()) {
+		free = percpu_counter_sum_positive(&sbi->free_blocks_counter);
+		dirty = percpu_counter_sum_positive(&sbi->delalloc_blocks_counter);
+		if (free < dirty + (s64)n)
+			return false;
+	}
+	percpu_counter_add(&sbi->delalloc_blocks_counter, n);
+	return true;
+}
+
+/*
+* Bloques del indice de tramos que le harian falta a un fichero para extra tramos mas, o U32_MAX si no
+* caben ni con el indice lleno.
+*/
+
+static uint32_t assoofs_extent_meta(struct assoofs_inode_info *inode_info, uint64_t extra) {
+
+	struct assoofs_inode_mem *mem = container_of(inode_info, struct assoofs_inode_mem, info);
+	struct assoofs_extent *ext;
+	uint64_t leaves;
+	int max, used;
+
+	ext = assoofs_extent_table(inode_info, &max);
+	used = assoofs_extent_count(ext, max);
+	if (used + extra <= max)
+		return 0;
+	leaves = DIV_ROUND_UP(used + extra, ASSOOFS_EXTENTS_PER_BLOCK);
+	if (leaves > ASSOOFS_EXTENT_INDEX_LEAVES)
+		return U32_MAX;
+	if (!mem->extent_bh)
+		return leaves + 1;
+	return leaves - ((struct assoofs_extent_index *)mem->extent_bh->b_data)->leaves;
+}
+
+/*
+* Ajusta los bloques prometidos para el indice de tramos a lo que queda en memoria. Solo se
+* devuelven: lo que ya se ha prometido basta para volcar menos bloques.
+*/
+
+static void assoofs_delalloc_meta_trim(struct inode *inode) {
+
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	uint32_t meta;
+
+	meta = mem->delalloc_count ? assoofs_extent_meta(&mem->info, mem->delalloc_count) : 0;
+	if (meta < mem->delalloc_meta) {
+		percpu_counter_sub(&ASSOOFS_SB(inode->i_sb)->delalloc_blocks_counter, mem->delalloc_meta - meta);
+		mem->delalloc_meta = meta;
+	}
+}
+
+/*
+* Vuelca los bloques de un fichero que esperan en memoria. Se piden todos de una vez detras del ultimo
+* tramo, asi lo que se ha ido anyadiendo con escrituras pequenyas acaba en un solo tramo. Primero se
+* escriben los datos y despues la info del inodo que apunta a ellos. Con el cerrojo del inodo cogido.
+*/
+
+static int assoofs_flush_delalloc(struct inode *inode) {
+
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	struct assoofs_inode_info *inode_info = &mem->info;
+	struct buffer_head **bhs;
+	uint64_t allocated, block, i, n, written = 0;
+	int last, ret;
+
+	if (!mem->delalloc_count)
+		return 0;
+
+	trace_assoofs_flush_delalloc(inode, mem->delalloc_count);
+
+	bhs = kmalloc_array(mem->delalloc_count, sizeof(struct buffer_head *), GFP_NOFS);
+	if (!bhs)
+		return -ENOMEM;
+
+	// los bloques en memoria van detras de los que ya tiene asignados el fichero, puede que tras un hueco
+	allocated = max(assoofs_inode_blocks(inode_info, &last), mem->delalloc_first);
+	ret = 0;
+	if (mem->delalloc_first + mem->delalloc_count > allocated)
+		ret = assoofs_extend_file(sb, inode_info, allocated, mem->delalloc_first + mem->delalloc_count - allocated, false);
+
+	// si solo se ha conseguido parte del espacio se escribe lo que quepa y el resto sigue esperando
+	for (n = 0; n < mem->delalloc_count; n++) {
+		if (assoofs_map_block(inode_info, mem->delalloc_first + n, &block, NULL))
+			break;
+		bhs[n] = sb_getblk(sb, block);
+		if (!bhs[n]) {
+			ret = -ENOMEM;
+			break;
+		}
+		lock_buffer(bhs[n]);
+		memcpy(bhs[n]->b_data, mem->delalloc_blocks[n], ASSOOFS_DEFAULT_BLOCK_SIZE);
+		set_buffer_uptodate(bhs[n]);
+		unlock_buffer(bhs[n]);
+		mark_buffer_dirty(bhs[n]);
+		assoofs_write_buffer(sb, bhs[n]); // se mandan todas las escrituras antes de esperar a ninguna
+	}
+	for (i = 0; i < n; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i]))
+			ret = -EIO;
+		else
+			written = i + 1;
+		brelse(bhs[i]);
+	}
+	kfree(bhs);
+
+	// los que ya estan en disco dejan de ocupar memoria y de contar como prometidos
+	if (written) {
+		for (i = 0; i < written; i++)
+			kfree(mem->delalloc_blocks[i]);
+		memmove(mem->delalloc_blocks, mem->delalloc_blocks + written, (mem->delalloc_count - written) * sizeof(char *));
+		mem->delalloc_first += written;
+		mem->delalloc_count -= written;
+		percpu_counter_sub(&ASSOOFS_SB(sb)->delalloc_blocks_counter, written);
+		assoofs_delalloc_meta_trim(inode);
+	}
+	if (mem->delalloc_count)
+		mark_inode_dirty(inode);
+
+	assoofs_save_inode_info(sb, inode_info);
+	return ret;
+}
+
+/*
+* Descarta los bloques en memoria de un fichero sin escribirlos (el fichero ya no existe)
+*/
+
+static void assoofs_drop_delalloc(struct inode *inode) {
+
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	uint64_t i;
+
+	for (i = 0; i < mem->delalloc_count; i++)
+		kfree(mem->delalloc_blocks[i]);
+	if (mem->delalloc_count + mem->delalloc_meta)
+		percpu_counter_sub(&ASSOOFS_SB(inode->i_sb)->delalloc_blocks_counter, mem->delalloc_count + mem->delalloc_meta);
+	mem->delalloc_count = 0;
+	mem->delalloc_meta = 0;
+	kfree(mem->delalloc_blocks);
+	mem->delalloc_blocks = NULL;
+}
+
+/*
+* Prepara una escritura de los bloques logicos [first, needed). Lo que cae dentro de los tramos del
+* fichero (o de sus huecos) lo resuelve write; los bloques que faltan detras del ultimo tramo se dejan
+* en memoria sin asignar, pero se apuntan como prometidos para que write_inode no se quede sin espacio.
+* Una escritura que empieza mas alla de lo que hay no rellena lo de en medio: queda un hueco. Si los
+* bloques no caben en memoria se vuelca lo que hubiera y una escritura mas grande que el limite se
+* asigna directamente, porque ya se sabe todo lo que va a ocupar.
+*/
+
+static int assoofs_delalloc_reserve(struct inode *inode, uint64_t first, uint64_t needed) {
+
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	uint64_t allocated, start, end, n;
+	uint32_t meta;
+	int last, ret;
+
+	allocated = assoofs_inode_blocks(&mem->info, &last);
+	if (needed <= allocated)
+		return 0;
+	start = max(first, allocated);
+
+	if (mem->delalloc_count) {
+		end = mem->delalloc_first + mem->delalloc_count;
+		// los bloques en memoria son siempre seguidos: si la escritura no continua los que hay, se vuelcan
+		if (start > end || start < mem->delalloc_first) {
+			ret = assoofs_flush_delalloc(inode);
+			if (ret)
+				return ret;
+			allocated = assoofs_inode_blocks(&mem->info, &last);
+			if (needed <= allocated)
+				return 0;
+			start = max(first, allocated);
+		} else if (needed <= end) {
+			return 0;
+		}
+	}
+	if (!mem->delalloc_count)
+		mem->delalloc_first = start;
+	end = mem->delalloc_first + mem->delalloc_count;
+
+	n = needed - end;
+	// en el peor caso el volcado deja un tramo por bloque: tambien se prometen los bloques del indice de
+	// tramos que harian falta, para que write_inode no se quede sin sitio para apuntarlos
+	meta = assoofs_extent_meta(&mem->info, mem->delalloc_count + n);
+	// si no caben en memoria (o sus tramos en el indice) el espacio se pide ya, para que el error le llegue a quien escribe
+	if (mem->delalloc_count + n > ASSOOFS_DELALLOC_MAX_BLOCKS || meta == U32_MAX) {
+		ret = assoofs_flush_delalloc(inode);
+		if (ret)
+			return ret;
+		allocated = assoofs_inode_blocks(&mem->info, &last);
+		if (needed <= allocated)
+			return 0;
+		start = max(first, allocated);
+		meta = assoofs_extent_meta(&mem->info, needed - start);
+		if (needed - start > ASSOOFS_DELALLOC_MAX_BLOCKS || meta == U32_MAX)
+			return assoofs_extend_file(sb, &mem->info, start, needed - start, false);
+		mem->delalloc_first = start;
+		n = needed - start;
+	}
+	meta = max(meta, mem->delalloc_meta);
+
+	if (!assoofs_claim_delalloc(ASSOOFS_SB(sb), n + meta - mem->delalloc_meta))
+		return -ENOSPC;
+	mem->delalloc_meta = meta;
+	if (!mem->delalloc_blocks) {
+		mem->delalloc_blocks = kcalloc(ASSOOFS_DELALLOC_MAX_BLOCKS, sizeof(char *), GFP_KERNEL);
+		if (!mem->delalloc_blocks) {
+			percpu_counter_sub(&ASSOOFS_SB(sb)->delalloc_blocks_counter, n);
+			return -ENOMEM;
+		}
+	}
+	for (; n; n--) {
+		// a cero: lo que no llegue a escribirse de estos bloques se lee como ceros
+		mem->delalloc_blocks[mem->delalloc_count] = kzalloc(ASSOOFS_DEFAULT_BLOCK_SIZE, GFP_KERNEL);
+		if (!mem->delalloc_blocks[mem->delalloc_count]) {
+			percpu_counter_sub(&ASSOOFS_SB(sb)->delalloc_blocks_counter, n);
+			return -ENOMEM;
+		}
+		mem->delalloc_count++;
+	}
+
+	// write_inode los volcara cuando toque escribir el inodo (o antes con sync/fsync)
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/*
+* Devuelve el bloque en memoria que corresponde al bloque logico iblock de un fichero, o NULL si no lo hay
+*/
+
+static char *assoofs_delalloc_block(struct inode *inode, uint64_t iblock) {
+
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+
+	if (iblock < mem->delalloc_first || iblock >= mem->delalloc_first + mem->delalloc_count)
+		return NULL;
+	return mem->delalloc_blocks[iblock - mem->delalloc_first];
+}
+
+/*
+* Saca de linea el contenido de un fichero que ya no cabe en su registro: los bytes pasan al primer
+* bloque, que se queda en memoria como cualquier escritura diferida. Con el cerrojo del inodo.
+*/
+
+static int assoofs_uninline_file(struct inode *inode) {
+
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	uint8_t data[ASSOOFS_INLINE_DATA_SIZE];
+	int ret;
+
+	memcpy(data, inode_info->inline_data, ASSOOFS_INLINE_DATA_SIZE);
+	inode_info->flags &= ~ASSOOFS_INODE_INLINE;
+	memset(inode_info->inline_data, 0, ASSOOFS_INLINE_DATA_SIZE);
+
+	// uno comprimido lo pasa al primer cluster en memoria, que se comprimira al guardarlo
+	if (inode_info->flags & ASSOOFS_INODE_COMPRESSED) {
+		mutex_lock(&ASSOOFS_I(inode)->cluster_lock);
+		ret = assoofs_load_cluster(inode, 0, false);
+		if (!ret) {
+			memcpy(ASSOOFS_I(inode)->cluster_buf, data, ASSOOFS_INLINE_DATA_SIZE);
+			ASSOOFS_I(inode)->cluster_dirty = true;
+		}
+		mutex_unlock(&ASSOOFS_I(inode)->cluster_lock);
+	} else {
+		ret = assoofs_delalloc_reserve(inode, 0, 1);
+	}
+	if (ret) {
+		inode_info->flags |= ASSOOFS_INODE_INLINE;
+		memcpy(inode_info->inline_data, data, ASSOOFS_INLINE_DATA_SIZE);
+		return ret;
+	}
+	// un fichero en linea no tiene bloques ni nada diferido, asi que el bloque 0 siempre queda en memoria
+	if (!(inode_info->flags & ASSOOFS_INODE_COMPRESSED))
+		memcpy(assoofs_delalloc_block(inode, 0), data, ASSOOFS_INLINE_DATA_SIZE);
+	return 0;
+}
+
+/*
+* Empaquetado de ficheros pequenyos: un fichero que no cabe en linea pero ocupa como mucho
+* ASSOOFS_TAIL_MAX_SIZE bytes no recibe un bloque propio, su contenido se copia detras del de otros
+* ficheros en el bloque compartido abierto en su grupo. Se hace al volcar la asignacion diferida,
+* cuando el fichero entero esta en el primer bloque en memoria. Con el cerrojo del inodo.
+*/
+
+static int assoofs_pack_tail(struct inode *inode) {
+
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	struct assoofs_inode_info *inode_info = &mem->info;
+	struct assoofs_group_info *grp;
+	struct assoofs_tail_header *hdr;
+	struct buffer_head *bh = NULL;
+	uint64_t g, block, size = inode_info->file_size;
+	uint32_t offset;
+	int last, ret;
+
+	if (!S_ISREG(inode_info->mode) || mem->delalloc_count != 1 || mem->delalloc_first
+	    || !size || size > ASSOOFS_TAIL_MAX_SIZE || assoofs_inode_blocks(inode_info, &last))
+		return 0;
+
+	g = inode_info->data_block_number / sbi->blocks_per_group;
+	if (g >= sbi->groups_count)
+		g = 0;
+	grp = &sbi->groups[g];
+
+	mutex_lock(&sbi->tail_lock);
+	if (grp->tail_block) {
+		bh = assoofs_bread(sb, grp->tail_block);
+		if (bh && ((struct assoofs_tail_header *)bh->b_data)->used + size > ASSOOFS_DEFAULT_BLOCK_SIZE) {
+			brelse(bh);
+			bh = NULL;
+		}
+	}
+	if (!bh) {
+		// sin sitio en el bloque abierto se empieza otro; si no hay bloques el volcado normal dara el error
+		if (assoofs_sb_get_a_freeblock(sb, inode_info->data_block_number, &block)) {
+			mutex_unlock(&sbi->tail_lock);
+			return 0;
+		}
+		bh = sb_getblk(sb, block);
+		if (!bh) {
+			assoofs_free_blocks(sb, block, 1);
+			mutex_unlock(&sbi->tail_lock);
+			return -ENOMEM;
+		}
+		lock_buffer(bh);
+		memset(bh->b_data, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+		((struct assoofs_tail_header *)bh->b_data)->used = sizeof(struct assoofs_tail_header);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		grp->tail_block = block;
+	}
+
+	hdr = (struct assoofs_tail_header *)bh->b_data;
+	offset = hdr->used;
+	memcpy(bh->b_data + offset, mem->delalloc_blocks[0], size);
+	hdr->used += size;
+	hdr->refs++;
+	// el contenido tiene que estar en disco antes que el registro que apunta a el
+	mark_buffer_dirty(bh);
+	ret = assoofs_sync_buffer(sb, bh);
+	if (ret) {
+		hdr->used -= size;
+		hdr->refs--;
+		mark_buffer_dirty(bh);
+	}
+	block = bh->b_blocknr;
+	brelse(bh);
+	mutex_unlock(&sbi->tail_lock);
+	if (ret)
+		return ret;
+
+	inode_info->flags |= ASSOOFS_INODE_TAIL;
+	inode_info->tail_block = block;
+	inode_info->tail_offset = offset;
+	inode_info->tail_len = size;
+	assoofs_drop_delalloc(inode);
+	assoofs_save_inode_info(sb, inode_info);
+	trace_assoofs_pack_tail(sb, inode_info->inode_no, size, block, offset);
+	return 0;
+}
+
+/*
+* Quita a un fichero de su bloque compartido. Cuando ya no queda nadie el bloque se libera, salvo
+* que sea el abierto de algun grupo, que entonces vuelve a estar vacio.
+*/
+
+static void assoofs_release_tail(struct super_block *sb, struct assoofs_inode_info *inode_info) {
+
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_tail_header *hdr;
+	struct buffer_head *bh;
+	uint64_t g, block = inode_info->tail_block;
+	bool open = false, empty;
+
+	inode_info->flags &= ~ASSOOFS_INODE_TAIL;
+	inode_info->tail_block = 0;
+	inode_info->tail_offset = inode_info->tail_len = 0;
+
+	mutex_lock(&sbi->tail_lock);
+	bh = assoofs_bread(sb, block);
+	if (!bh) {
+		// sin poder leer la cabecera el bloque se queda ocupado
+		printk(KERN_ERR "RELEASE TAIL: no se pudo leer el bloque compartido %llu\n", block);
+		mutex_unlock(&sbi->tail_lock);
+		return;
+	}
+	hdr = (struct assoofs_tail_header *)bh->b_data;
+	if (hdr->refs)
+		hdr->refs--;
+	empty = !hdr->refs;
+	if (empty) {
+		for (g = 0; g < sbi->groups_count && !open; g++)
+			open = sbi->groups[g].tail_block == block;
+		if (open)
+			hdr->used = sizeof(struct assoofs_tail_header);
+	}
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	if (empty && !open)
+		assoofs_free_blocks(sb, block, 1);
+	mutex_unlock(&sbi->tail_lock);
+}
+
+/*
+* Saca a un fichero de su bloque compartido para que pueda crecer: el contenido vuelve al primer
+* bloque en memoria y se le asignara sitio (o se empaquetara de nuevo) en el siguiente volcado.
+*/
+
+static int assoofs_unpack_tail(struct inode *inode) {
+
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	struct buffer_head *bh;
+	int ret;
+
+	bh = assoofs_bread(inode->i_sb, inode_info->tail_block);
+	if (!bh)
+		return -EIO;
+	ret = assoofs_delalloc_reserve(inode, 0, 1);
+	if (ret) {
+		brelse(bh);
+		return ret;
+	}
+	memcpy(assoofs_delalloc_block(inode, 0), bh->b_data + inode_info->tail_offset, inode_info->tail_len);
+	brelse(bh);
+
+	assoofs_release_tail(inode->i_sb, inode_info);
+	assoofs_save_inode_info(inode->i_sb, inode_info);
+	return 0;
+}
+
+/*
+* Compresion: memoria de trabajo del compresor LZ4 y un cluster comprimido, comun a todo el montaje.
+* Se reserva la primera vez que hace falta, con compress_lock cogido.
+*/
+
+static int assoofs_compress_workspace(struct assoofs_sb_info *sbi) {
+
+	if (sbi->compress_buf)
+		return 0;
+	sbi->compress_wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_NOFS);
+	sbi->compress_buf = kvmalloc(ASSOOFS_CLUSTER_SIZE, GFP_NOFS);
+	if (!sbi->compress_wrkmem || !sbi->compress_buf) {
+		kvfree(sbi->compress_wrkmem);
+		kvfree(sbi->compress_buf);
+		sbi->compress_wrkmem = NULL;
+		sbi->compress_buf = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+* Descompresion: un cluster comprimido por cpu. Las lecturas lo usan sin dormir (get_cpu_ptr),
+* asi dos lecturas de ficheros distintos nunca se esperan. Se reserva con el primer cluster que se lee.
+*/
+
+static int assoofs_decompress_workspace(struct assoofs_sb_info *sbi) {
+
+	char * __percpu *bufs;
+	int cpu, ret = 0;
+
+	if (READ_ONCE(sbi->decompress_buf))
+		return 0;
+
+	mutex_lock(&sbi->compress_lock);
+	if (sbi->decompress_buf)
+		goto out;
+	bufs = alloc_percpu(char *);
+	if (!bufs) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for_each_possible_cpu(cpu) {
+		*per_cpu_ptr(bufs, cpu) = kvmalloc(ASSOOFS_CLUSTER_SIZE, GFP_KERNEL);
+		if (!*per_cpu_ptr(bufs, cpu))
+			ret = -ENOMEM;
+	}
+	if (ret) {
+		for_each_possible_cpu(cpu)
+			kvfree(*per_cpu_ptr(bufs, cpu));
+		free_percpu(bufs);
+		goto out;
+	}
+	WRITE_ONCE(sbi->decompress_buf, bufs);
+out:
+	mutex_unlock(&sbi->compress_lock);
+	return ret;
+}
+
+/*
+* Libera los buffers de descompresion al desmontar
+*/
+
+static void assoofs_release_decompress(struct assoofs_sb_info *sbi) {
+
+	int cpu;
+
+	if (!sbi->decompress_buf)
+		return;
+	for_each_possible_cpu(cpu)
+		kvfree(*per_cpu_ptr(sbi->decompress_buf, cpu));
+	free_percpu(sbi->decompress_buf);
+	sbi->decompress_buf = NULL;
+}
+
+/*
+* Devuelve la entrada del indice del cluster de un fichero comprimido dentro de *bh, que el llamante
+* tiene que liberar. Las de los primeros clusters estan en el registro del inodo y entonces *bh es
+* NULL. Si falta algun bloque del indice devuelve NULL, o lo crea a cero si create. Los bloques
+* nuevos se escriben antes de apuntarlos. Con cluster_lock cogido.
+*/
+
+static struct assoofs_cluster_entry *assoofs_cluster_entry(struct super_block *sb, struct assoofs_inode_info *inode_info,
+		uint64_t cluster, bool create, struct buffer_head **bh) {
+
+	struct buffer_head *root_bh;
+	uint32_t *leaf;
+	uint64_t block;
+	int ret;
+
+	*bh = NULL;
+	if (cluster < ASSOOFS_INLINE_CLUSTERS)
+		return (struct assoofs_cluster_entry *)inode_info->inline_data + cluster;
+	cluster -= ASSOOFS_INLINE_CLUSTERS;
+
+	if (cluster / ASSOOFS_CLUSTERS_PER_BLOCK >= ASSOOFS_CLUSTER_INDEX_BLOCKS)
+		return create ? ERR_PTR(-EFBIG) : NULL;
+
+	if (!inode_info->cluster_index) {
+		if (!create)
+			return NULL;
+		ret = assoofs_sb_get_a_freeblock(sb, inode_info->data_block_number, &block);
+		if (ret)
+			return ERR_PTR(ret);
+		ret = assoofs_zero_blocks(sb, block, 1);
+		if (ret) {
+			assoofs_free_blocks(sb, block, 1);
+			return ERR_PTR(ret);
+		}
+		inode_info->cluster_index = block;
+	}
+
+	root_bh = assoofs_bread(sb, inode_info->cluster_index);
+	if (!root_bh)
+		return ERR_PTR(-EIO);
+	leaf = (uint32_t *)root_bh->b_data + cluster / ASSOOFS_CLUSTERS_PER_BLOCK;
+	if (!*leaf) {
+		if (!create) {
+			brelse(root_bh);
+			return NULL;
+		}
+		ret = assoofs_sb_get_a_freeblock(sb, inode_info->cluster_index, &block);
+		if (ret) {
+			brelse(root_bh);
+			return ERR_PTR(ret);
+		}
+		ret = assoofs_zero_blocks(sb, block, 1);
+		if (!ret) {
+			*leaf = block;
+			mark_buffer_dirty(root_bh);
+			ret = assoofs_sync_buffer(sb, root_bh);
+			// sin la raiz en disco la hoja nueva no esta apuntada: se deja como estaba
+			if (ret) {
+				*leaf = 0;
+				mark_buffer_dirty(root_bh);
+			}
+		}
+		if (ret) {
+			brelse(root_bh);
+			assoofs_free_blocks(sb, block, 1);
+			return ERR_PTR(ret);
+		}
+	}
+	block = *leaf;
+	brelse(root_bh);
+
+	*bh = assoofs_bread(sb, block);
+	if (!*bh)
+		return ERR_PTR(-EIO);
+	return (struct assoofs_cluster_entry *)(*bh)->b_data + cluster % ASSOOFS_CLUSTERS_PER_BLOCK;
+}
+
+/*
+* Quita a un fichero comprimido los clusters que quedan enteros por encima de size (hasta old_size) y
+* apunta sus bloques en ranges. Sus entradas se ponen a cero; los bloques del indice que cambian se
+* escriben aqui, una vez cada uno, y las entradas del registro las guarda el llamante. Con size 0
+* tambien se sueltan los bloques del indice. Con cluster_lock cogido, o sin inodo en memoria.
+*/
+
+static int assoofs_cut_clusters(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t old_size, uint64_t size, struct list_head *ranges) {
+
+	struct assoofs_cluster_entry *entry;
+	struct buffer_head *bh, *leaf_bh = NULL;
+	uint64_t cluster, end = DIV_ROUND_UP(old_size, ASSOOFS_CLUSTER_SIZE);
+	uint32_t *leaf;
+	int i, ret = 0;
+
+	for (cluster = DIV_ROUND_UP(size, ASSOOFS_CLUSTER_SIZE); cluster < end; cluster++) {
+		entry = assoofs_cluster_entry(sb, inode_info, cluster, false, &bh);
+		if (IS_ERR(entry)) {
+			ret = PTR_ERR(entry);
+			break;
+		}
+		if (!entry)
+			continue;
+		if (entry->start) {
+			assoofs_defer_free(ranges, entry->start, DIV_ROUND_UP(entry->size & ~ASSOOFS_CLUSTER_RAW, ASSOOFS_DEFAULT_BLOCK_SIZE), false);
+			memset(entry, 0, sizeof(*entry));
+			if (bh)
+				mark_buffer_dirty(bh);
+		}
+		if (bh && leaf_bh && bh->b_blocknr == leaf_bh->b_blocknr) {
+			brelse(bh);
+			continue;
+		}
+		if (leaf_bh) {
+			ret = assoofs_sync_buffer(sb, leaf_bh) ?: ret;
+			brelse(leaf_bh);
+		}
+		leaf_bh = bh;
+	}
+	if (leaf_bh) {
+		ret = assoofs_sync_buffer(sb, leaf_bh) ?: ret;
+		brelse(leaf_bh);
+	}
+
+	if (!ret && !size && inode_info->cluster_index) {
+		bh = assoofs_bread(sb, inode_info->cluster_index);
+		if (!bh)
+			return -EIO;
+		leaf = (uint32_t *)bh->b_data;
+		for (i = 0; i < ASSOOFS_CLUSTER_INDEX_BLOCKS; i++)
+			if (leaf[i])
+				assoofs_defer_free(ranges, leaf[i], 1, false);
+		brelse(bh);
+		assoofs_defer_free(ranges, inode_info->cluster_index, 1, false);
+		inode_info->cluster_index = 0;
+	}
+	return ret;
+}
+
+/*
+* Guarda el cluster en memoria si ha cambiado: se comprime, se escribe en bloques nuevos (detras del
+* anterior cluster del fichero) y solo cuando esta en disco se cambia su entrada del indice y se
+* liberan los bloques viejos. Asi un corte deja la version anterior o la nueva, nunca una mezcla.
+* Si comprimido no ahorra al menos un bloque se guarda tal cual. Con cluster_lock cogido.
+*/
+
+static int assoofs_store_cluster(struct inode *inode) {
+
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	struct assoofs_inode_info *inode_info = &mem->info;
+	struct assoofs_cluster_entry *entry, old;
+	struct buffer_head *ibh, *bhs[ASSOOFS_CLUSTER_BLOCKS];
+	uint64_t usize, block, got, n, i;
+	const char *src;
+	uint32_t size;
+	int csize, ret = 0;
+
+	if (!mem->cluster_valid || !mem->cluster_dirty)
+		return 0;
+
+	usize = min_t(uint64_t, ASSOOFS_CLUSTER_SIZE, inode_info->file_size - mem->cluster_no * ASSOOFS_CLUSTER_SIZE);
+	entry = assoofs_cluster_entry(sb, inode_info, mem->cluster_no, true, &ibh);
+	if (IS_ERR(entry))
+		return PTR_ERR(entry);
+
+	mutex_lock(&sbi->compress_lock);
+	ret = assoofs_compress_workspace(sbi);
+	if (ret)
+		goto out_unlock;
+
+	// el limite de salida es un bloque menos que sin comprimir: si no cabe, LZ4 devuelve 0
+	csize = LZ4_compress_default(mem->cluster_buf, sbi->compress_buf, usize,
+			(DIV_ROUND_UP(usize, ASSOOFS_DEFAULT_BLOCK_SIZE) - 1) * ASSOOFS_DEFAULT_BLOCK_SIZE, sbi->compress_wrkmem);
+	if (csize > 0) {
+		src = sbi->compress_buf;
+		size = csize;
+	} else {
+		src = mem->cluster_buf;
+		size = usize | ASSOOFS_CLUSTER_RAW;
+	}
+	n = DIV_ROUND_UP(size & ~ASSOOFS_CLUSTER_RAW, ASSOOFS_DEFAULT_BLOCK_SIZE);
+
+	// un cluster va en bloques seguidos: si no hay tantos juntos no se puede guardar
+	ret = assoofs_new_blocks(sb, inode_info->data_block_number, n, &block, &got);
+	if (!ret && got < n) {
+		assoofs_free_blocks(sb, block, got);
+		ret = -ENOSPC;
+	}
+	if (ret)
+		goto out_unlock;
+
+	for (i = 0; i < n; i++) {
+		bhs[i] = sb_getblk(sb, block + i);
+		if (!bhs[i]) {
+			ret = -ENOMEM;
+			break;
+		}
+		lock_buffer(bhs[i]);
+		memset(bhs[i]->b_data, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+		memcpy(bhs[i]->b_data, src + i * ASSOOFS_DEFAULT_BLOCK_SIZE,
+				min_t(uint64_t, ASSOOFS_DEFAULT_BLOCK_SIZE, (size & ~ASSOOFS_CLUSTER_RAW) - i * ASSOOFS_DEFAULT_BLOCK_SIZE));
+		set_buffer_uptodate(bhs[i]);
+		unlock_buffer(bhs[i]);
+		mark_buffer_dirty(bhs[i]);
+		assoofs_write_buffer(sb, bhs[i]); // se mandan todas las escrituras antes de esperar a ninguna
+	}
+	n = i;
+	for (i = 0; i < n; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i]))
+			ret = -EIO;
+		brelse(bhs[i]);
+	}
+	mutex_unlock(&sbi->compress_lock);
+	if (ret) {
+		assoofs_free_blocks(sb, block, DIV_ROUND_UP(size & ~ASSOOFS_CLUSTER_RAW, ASSOOFS_DEFAULT_BLOCK_SIZE));
+		brelse(ibh);
+		return ret;
+	}
+
+	old = *entry;
+	entry->start = block;
+	entry->size = size;
+	if (ibh) {
+		mark_buffer_dirty(ibh);
+		ret = assoofs_sync_buffer(sb, ibh);
+		brelse(ibh);
+	}
+	if (old.start)
+		assoofs_free_blocks(sb, old.start, DIV_ROUND_UP(old.size & ~ASSOOFS_CLUSTER_RAW, ASSOOFS_DEFAULT_BLOCK_SIZE));
+
+	atomic64_add(usize, &sbi->compress_raw_bytes);
+	atomic64_add(n * ASSOOFS_DEFAULT_BLOCK_SIZE, &sbi->compress_stored_bytes);
+	mem->cluster_dirty = false;
+	inode_info->data_block_number = block + n; // el siguiente cluster, justo detras
+	assoofs_save_inode_info(sb, inode_info);
+	return ret;
+
+out_unlock:
+	mutex_unlock(&sbi->compress_lock);
+	brelse(ibh);
+	return ret;
+}
+
+/*
+* Guarda el cluster en memoria de un fichero comprimido (write_inode, fsync, desalojo)
+*/
+
+static int assoofs_flush_cluster(struct inode *inode) {
+
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	int ret;
+
+	if (!(mem->info.flags & ASSOOFS_INODE_COMPRESSED))
+		return 0;
+	mutex_lock(&mem->cluster_lock);
+	ret = assoofs_store_cluster(inode);
+	mutex_unlock(&mem->cluster_lock);
+	return ret;
+}
+
+/*
+* Deja en cluster_buf el cluster descomprimido, guardando antes el que hubiera si ha cambiado.
+* Con keep a false el llamante lo va a sobrescribir entero y no se lee. Con cluster_lock cogido.
+*/
+
+static int assoofs_load_cluster(struct inode *inode, uint64_t cluster, bool keep) {
+
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	struct assoofs_cluster_entry *entry, e = { 0 };
+	struct buffer_head *bh, *bhs[ASSOOFS_CLUSTER_BLOCKS];
+	uint64_t i, n, got = 0, stored;
+	char *src;
+	int ret;
+
+	if (mem->cluster_valid && mem->cluster_no == cluster)
+		return 0;
+	ret = assoofs_store_cluster(inode);
+	if (ret)
+		return ret;
+	if (!mem->cluster_buf) {
+		mem->cluster_buf = kvmalloc(ASSOOFS_CLUSTER_SIZE, GFP_KERNEL);
+		if (!mem->cluster_buf)
+			return -ENOMEM;
+	}
+	mem->cluster_valid = false;
+
+	if (keep && cluster * ASSOOFS_CLUSTER_SIZE < mem->info.file_size) {
+		entry = assoofs_cluster_entry(sb, &mem->info, cluster, false, &bh);
+		if (IS_ERR(entry))
+			return PTR_ERR(entry);
+		if (entry) {
+			e = *entry;
+			brelse(bh);
+		}
+	}
+	if (!e.start) {
+		// nunca escrito: ceros
+		memset(mem->cluster_buf, 0, ASSOOFS_CLUSTER_SIZE);
+		goto done;
+	}
+
+	stored = e.size & ~ASSOOFS_CLUSTER_RAW;
+	n = DIV_ROUND_UP(stored, ASSOOFS_DEFAULT_BLOCK_SIZE);
+	if (!(e.size & ASSOOFS_CLUSTER_RAW)) {
+		ret = assoofs_decompress_workspace(sbi);
+		if (ret)
+			return ret;
+	}
+
+	// se piden todos los bloques del cluster antes de esperar al primero
+	for (i = 1; i < n; i++)
+		sb_breadahead(sb, e.start + i);
+	for (got = 0; got < n; got++) {
+		bhs[got] = assoofs_bread(sb, e.start + got);
+		if (!bhs[got]) {
+			ret = -EIO;
+			break;
+		}
+	}
+
+	if (!ret && (e.size & ASSOOFS_CLUSTER_RAW)) {
+		for (i = 0; i < n; i++)
+			memcpy(mem->cluster_buf + i * ASSOOFS_DEFAULT_BLOCK_SIZE, bhs[i]->b_data,
+					min_t(uint64_t, ASSOOFS_DEFAULT_BLOCK_SIZE, stored - i * ASSOOFS_DEFAULT_BLOCK_SIZE));
+		memset(mem->cluster_buf + stored, 0, ASSOOFS_CLUSTER_SIZE - stored);
+	} else if (!ret) {
+		// con todo leido ya no hay que dormir: se junta en el buffer de esta cpu y se descomprime
+		src = *get_cpu_ptr(sbi->decompress_buf);
+		for (i = 0; i < n; i++)
+			memcpy(src + i * ASSOOFS_DEFAULT_BLOCK_SIZE, bhs[i]->b_data,
+					min_t(uint64_t, ASSOOFS_DEFAULT_BLOCK_SIZE, stored - i * ASSOOFS_DEFAULT_BLOCK_SIZE));
+		ret = LZ4_decompress_safe(src, mem->cluster_buf, stored, ASSOOFS_CLUSTER_SIZE);
+		put_cpu_ptr(sbi->decompress_buf);
+		if (ret < 0) {
+			printk(KERN_ERR "LOAD CLUSTER: cluster %llu del inodo %llu corrupto\n", cluster, mem->info.inode_no);
+			ret = -EIO;
+		} else {
+			memset(mem->cluster_buf + ret, 0, ASSOOFS_CLUSTER_SIZE - ret);
+			ret = 0;
+		}
+	}
+	for (i = 0; i < got; i++)
+		brelse(bhs[i]);
+	if (ret)
+		return ret;
+
+done:
+	mem->cluster_no = cluster;
+	mem->cluster_valid = true;
+	return 0;
+}
+
+/*
+* Lectura de un fichero comprimido: cluster a cluster a traves del cluster en memoria, asi una
+* lectura secuencial descomprime cada cluster una sola vez. Con el cerrojo del inodo (compartido).
+*/
+
+static ssize_t assoofs_read_compressed(struct inode *inode, char __user *buf, size_t len, loff_t *ppos) {
+
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	size_t nbytes = 0, chunk, offset;
+	int ret = 0;
+
+	mutex_lock(&mem->cluster_lock);
+	while (nbytes < len) {
+		offset = *ppos % ASSOOFS_CLUSTER_SIZE;
+		chunk = min(len - nbytes, (size_t)(ASSOOFS_CLUSTER_SIZE - offset));
+		ret = assoofs_load_cluster(inode, *ppos / ASSOOFS_CLUSTER_SIZE, true);
+		if (ret)
+			break;
+		if (copy_to_user(buf + nbytes, mem->cluster_buf + offset, chunk)) {
+			ret = -EFAULT;
+			break;
+		}
+		nbytes += chunk;
+		*ppos += chunk;
+	}
+	mutex_unlock(&mem->cluster_lock);
+	return nbytes ? nbytes : ret;
+}
+
+/*
+* Escritura en un fichero comprimido: se copia al cluster en memoria y se comprime cuando la escritura
+* pasa a otro cluster o se escribe el inodo; muchas escrituras pequenyas seguidas cuestan una sola
+* compresion. Un cluster que se sobrescribe entero o que empieza detras del final no se lee.
+* Con el cerrojo del inodo. Deja en *written lo que se ha copiado.
+*/
+
+static int assoofs_write_compressed(struct inode *inode, const char __user *buf, size_t len, loff_t *ppos, size_t *written) {
+
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	uint64_t cluster, cstart;
+	size_t chunk, offset;
+	int ret = 0;
+
+	mutex_lock(&mem->cluster_lock);
+	while (*written < len) {
+		cluster = *ppos / ASSOOFS_CLUSTER_SIZE;
+		cstart = cluster * ASSOOFS_CLUSTER_SIZE;
+		offset = *ppos - cstart;
+		chunk = min(len - *written, (size_t)(ASSOOFS_CLUSTER_SIZE - offset));
+		ret = assoofs_load_cluster(inode, cluster, offset || cstart + chunk < mem->info.file_size);
+		if (ret)
+			break;
+		if (copy_from_user(mem->cluster_buf + offset, buf + *written, chunk)) {
+			ret = -EFAULT;
+			break;
+		}
+		mem->cluster_dirty = true;
+		*written += chunk;
+		*ppos += chunk;
+		// el tamanyo tiene que estar al dia antes de pasar al siguiente: store_cluster lo usa
+		if (*ppos > mem->info.file_size)
+			mem->info.file_size = *ppos;
+	}
+	mutex_unlock(&mem->cluster_lock);
+	if (mem->cluster_dirty)
+		mark_inode_dirty(inode);
+	return ret;
+}
+
+/*
+* Cerrojo de las lecturas: en una imagen de solo lectura nada cambia los tramos ni el tamanyo,
+* asi que no se coge y las lecturas de un mismo fichero no se tocan
+*/
+
+static inline void assoofs_read_lock(struct inode *inode) {
+
+	if (!ASSOOFS_SB(inode->i_sb)->image_ro)
+		inode_lock_shared(inode);
+}
+
+static inline void assoofs_read_unlock(struct inode *inode) {
+
+	if (!ASSOOFS_SB(inode->i_sb)->image_ro)
+		inode_unlock_shared(inode);
+}
+
+/*
+* FUncion que permite leer de un archivo
+*lee el contenido de un fichero recibiendo el descriprtor de fichero, el buffer donde se guarda lo *que leo, el size, y desde donde empieza a leer.
+*/
+static ssize_t assoofs_do_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos) {
+   
+	struct buffer_head *bh;
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	struct super_block *sb = inode->i_sb;
+	char *buffer;
+	size_t nbytes = 0, chunk, offset;
+	uint64_t block, iblock;
+	bool unwritten;
+	ssize_t err = 0;
+	//obtenemis la info persistente al inodo a partir de filp
+	struct assoofs_inode_info *inode_info = inode->i_private;
+
+	// atime segun relatime/noatime; con lazytime se queda en memoria hasta que se escriba el inodo
+	file_accessed(filp);
+	
+	// los tramos y los bloques en memoria solo cambian con el cerrojo del inodo en exclusiva
+	assoofs_read_lock(inode);
+
+	//para saber si hemos llegado al final del fichero
+	if (*ppos >= inode_info->file_size) {
+		assoofs_read_unlock(inode);
+		return 0;
+	}
+	len = min((size_t)(inode_info->file_size - *ppos), len); // Hay que comparar len con el tama~no del fichero por si llegamos al final del fichero
+
+	// un fichero pequenyo esta entero en el registro del inodo
+	if (inode_info->flags & ASSOOFS_INODE_INLINE) {
+		if (copy_to_user(buf, inode_info->inline_data + *ppos, len)) {
+			assoofs_read_unlock(inode);
+			return -EFAULT;
+		}
+		*ppos += len;
+		assoofs_read_unlock(inode);
+		return len;
+	}
+
+	// empaquetado: un solo bloque, compartido con otros ficheros pequenyos
+	if (inode_info->flags & ASSOOFS_INODE_TAIL) {
+		bh = assoofs_bread(sb, inode_info->tail_block);
+		if (!bh) {
+			assoofs_read_unlock(inode);
+			return -EIO;
+		}
+		if (copy_to_user(buf, bh->b_data + inode_info->tail_offset + *ppos, len)) {
+			brelse(bh);
+			assoofs_read_unlock(inode);
+			return -EFAULT;
+		}
+		brelse(bh);
+		*ppos += len;
+		assoofs_read_unlock(inode);
+		return len;
+	}
+
+	if (inode_info->flags & ASSOOFS_INODE_COMPRESSED) {
+		err = assoofs_read_compressed(inode, buf, len, ppos);
+		assoofs_read_unlock(inode);
+		return err;
+	}
+	
+	//para acceder al contenido del fichero bloque a bloque, cada bloque logico se traduce con los tramos del inodo
+	while (nbytes < len) {
+		offset = *ppos % ASSOOFS_DEFAULT_BLOCK_SIZE;
+		chunk = min(len - nbytes, (size_t)(ASSOOFS_DEFAULT_BLOCK_SIZE - offset));
+		iblock = *ppos / ASSOOFS_DEFAULT_BLOCK_SIZE;
+
+		buffer = NULL;
+		if (assoofs_map_block(inode_info, iblock, &block, &unwritten)) {
+			// sin bloque en disco: puede estar en memoria esperando a que se le asigne sitio
+			buffer = assoofs_delalloc_block(inode, iblock);
+			// o ser un hueco, que se lee como un bloque reservado sin escribir
+			unwritten = !buffer;
+		}
+
+		if (buffer) {
+			if (copy_to_user(buf + nbytes, buffer + offset, chunk)) {
+				printk(KERN_ERR "READ: error en copy to user\n");
+				err = -EFAULT;
+				break;
+			}
+			nbytes += chunk;
+			*ppos += chunk;
+			continue;
+		}
+
+		// un hueco o un bloque reservado con fallocate y sin escribir se lee como ceros sin ir a disco
+		if (unwritten) {
+			if (clear_user(buf + nbytes, chunk)) {
+				printk(KERN_ERR "READ: error en clear user\n");
+				err = -EFAULT;
+				break;
+			}
+			nbytes += chunk;
+			*ppos += chunk;
+			continue;
+		}
+
+		bh = assoofs_bread(sb, block);
+		if (!bh) {
+			printk(KERN_ERR "READ: error al leer el bloque %llu\n", block);
+			err = -EIO;
+			break;
+		}
+		buffer = (char *)bh->b_data + offset; //ahora es un puntero al contenido del fichero
+
+		//copiamos en el buffer buf el contenido del fichero leido
+		if(copy_to_user(buf + nbytes, buffer, chunk)){//copiamos algo del kernel a algo del usuario por eso no vale usar mcpy
+			brelse(bh);
+			printk(KERN_ERR "READ: error en copy to user\n");
+			err = -EFAULT;
+			break;
+		}
+		brelse(bh);
+
+		nbytes += chunk;
+		*ppos += chunk; //se aumenta cada vez que se haga una operacion de lectura
+	}
+	assoofs_read_unlock(inode);
+	return nbytes ? nbytes : err; //numero de bytes leidos puede ser lenght o menos 
+	
+
+}
+
+ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos) {
+
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	loff_t pos = *ppos;
+	u64 start = ktime_get_ns(), latency;
+	ssize_t ret = assoofs_do_read(filp, buf, len, ppos);
+
+	latency = ktime_get_ns() - start;
+	assoofs_stat_inc(inode->i_sb, ASSOOFS_STAT_READ);
+	if (ret > 0)
+		assoofs_stat_add(inode->i_sb, ASSOOFS_STAT_READ_BYTES, ret);
+	assoofs_stat_latency(inode->i_sb, ASSOOFS_LAT_READ, latency);
+	trace_assoofs_read(inode, pos, len, ret, latency);
+	return ret;
+}
+
+/*
+* Funcion que escribe en un fichero y devuelve la longitud de lo que ha escrito
+*recibe el fichero en el que se va a escribir, la direccion del buffer, longitud desde donde se *va a escribir en el fichero filp y el despalazamiento respecto al rprincipio del fichero donde *se va a empezar a escribir
+*/
+
+static ssize_t assoofs_do_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos) {
+    
+   struct inode *inode;
+	struct assoofs_inode_info *inode_info;
+	struct assoofs_inode_info before;
+	struct buffer_head *bh;
+	struct super_block *sb;
+	char *buffer;
+	size_t nbytes = 0, chunk, offset;
+	uint64_t needed, block, first_block, iblock, next;
+	loff_t start = *ppos;
+	bool unwritten, converted = false;
+	int ret, err;
+
+	sb = filp->f_path.dentry->d_inode->i_sb;
+	inode = filp->f_path.dentry->d_inode;
+	inode_info = inode->i_private; //obtenemis la info persistente al inodo a partir de filp
+
+	if (!len)
+		return 0;
+	if (*ppos + len > sb->s_maxbytes)
+		return -EFBIG;
+
+	// los tramos del inodo tambien los cambia fallocate
+	inode_lock(inode);
+	ret = file_update_time(filp); // mtime y ctime; solo marcan el inodo, el registro se escribe despues
+	if (ret) {
+		inode_unlock(inode);
+		return ret;
+	}
+	before = *inode_info;
+
+	// mientras quepa, el contenido se queda en el registro del inodo
+	if (inode_info->flags & ASSOOFS_INODE_INLINE) {
+		if (*ppos + len <= ASSOOFS_INLINE_DATA_SIZE) {
+			if (copy_from_user(inode_info->inline_data + *ppos, buf, len)) {
+				inode_unlock(inode);
+				return -EFAULT;
+			}
+			nbytes = len;
+			*ppos += len;
+			goto out;
+		}
+		ret = assoofs_uninline_file(inode);
+		if (ret) {
+			inode_unlock(inode);
+			return ret;
+		}
+	}
+
+	// comprimido: nada de tramos ni asignacion diferida, todo pasa por el cluster en memoria
+	if (inode_info->flags & ASSOOFS_INODE_COMPRESSED) {
+		ret = assoofs_write_compressed(inode, buf, len, ppos, &nbytes);
+		goto out;
+	}
+
+	// dentro de lo que ya ocupa en el bloque compartido se sobrescribe alli; si crece vuelve a memoria
+	if (inode_info->flags & ASSOOFS_INODE_TAIL) {
+		if (*ppos + len <= inode_info->tail_len) {
+			bh = assoofs_bread(sb, inode_info->tail_block);
+			if (!bh) {
+				inode_unlock(inode);
+				return -EIO;
+			}
+			if (copy_from_user(bh->b_data + inode_info->tail_offset + *ppos, buf, len)) {
+				brelse(bh);
+				inode_unlock(inode);
+				return -EFAULT;
+			}
+			mark_buffer_dirty(bh);
+			brelse(bh);
+			nbytes = len;
+			*ppos += len;
+			goto out;
+		}
+		ret = assoofs_unpack_tail(inode);
+		if (ret) {
+			inode_unlock(inode);
+			return ret;
+		}
+	}
+
+	// lo que pase del ultimo bloque asignado se queda en memoria y se le busca sitio al volcarlo
+	first_block = *ppos / ASSOOFS_DEFAULT_BLOCK_SIZE;
+	needed = DIV_ROUND_UP(*ppos + len, ASSOOFS_DEFAULT_BLOCK_SIZE);
+	ret = assoofs_delalloc_reserve(inode, first_block, needed);
+	// los bloques que comparte con un clon se copian antes de escribir encima
+	if (!ret)
+		ret = assoofs_unshare(inode, first_block, needed, *ppos, len);
+	if (ret) {
+		assoofs_save_inode_info(sb, inode_info); // los tramos que si se hayan conseguido
+		inode_unlock(inode);
+		return ret;
+	}
+
+	while (nbytes < len) {
+		offset = *ppos % ASSOOFS_DEFAULT_BLOCK_SIZE;
+		chunk = min(len - nbytes, (size_t)(ASSOOFS_DEFAULT_BLOCK_SIZE - offset));
+
+		//para acceder al contenido del fichero
+		iblock = *ppos / ASSOOFS_DEFAULT_BLOCK_SIZE;
+		if (assoofs_map_block(inode_info, iblock, &block, &unwritten)) {
+			// bloque diferido: solo se copia a memoria
+			buffer = assoofs_delalloc_block(inode, iblock);
+			if (!buffer) {
+				// hueco en medio del fichero: se le dan bloques sin escribir y se vuelve a intentar
+				assoofs_lookup_extent(inode_info, iblock, &next);
+				ret = assoofs_extend_file(sb, inode_info, iblock, min(needed, next) - iblock, true);
+				if (ret)
+					break;
+				continue;
+			}
+			if (copy_from_user(buffer + offset, buf + nbytes, chunk)) {
+				printk(KERN_ERR "Write: el copy_from_user no fue bien\n");
+				ret = -EFAULT;
+				break;
+			}
+			nbytes += chunk;
+			*ppos += chunk;
+			continue;
+		}
+		if (unwritten) {
+			// bloque reservado sin escribir: no hace falta leerlo, lo que no se escriba queda a cero
+			bh = sb_getblk(sb, block);
+			if (bh) {
+				lock_buffer(bh);
+				memset(bh->b_data, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+				set_buffer_uptodate(bh);
+				unlock_buffer(bh);
+			}
+			converted = true;
+		} else {
+			bh = assoofs_bread(sb, block);
+		}
+		if(!bh){
+			printk(KERN_ERR "Write: error al leer el numero de bloque\n");
+			ret = unwritten ? -ENOMEM : -EIO; // sb_getblk solo falla sin memoria
+			break;
+		}
+
+		buffer = (char *)bh->b_data + offset;//ahora es un puntero al contenido del fichero
+
+		//copiamos en el buffer buf el contenido del fichero leido
+		if(copy_from_user(buffer, buf + nbytes, chunk)){ //copiamos algo del kernel a algo del usuario por eso no vale usar mcpy
+			brelse(bh);
+			printk(KERN_ERR "Write: el copy_from_user no fue bien\n");
+			ret = -EFAULT;
+			break;
+		}
+		if (unwritten) {
+			// tiene que estar en disco antes de que el tramo se marque como escrito
+			mark_buffer_dirty(bh);
+			ret = assoofs_sync_buffer(sb, bh);
+			if (ret) {
+				brelse(bh);
+				break;
+			}
+		} else {
+			mark_buffer_dirty_inode(bh, inode); // lo escribe fsync o el writeback del dispositivo
+		}
+		brelse(bh);
+
+		nbytes += chunk;
+		*ppos += chunk;
+	}
+
+	// los datos ya estan en disco, ahora se marcan como escritos los bloques reservados que se han usado.
+	// Si no se puede, lo escrito se lee como ceros: sin nada escrito se devuelve el error y si no lo da el siguiente fsync
+	if (converted && nbytes) {
+		err = assoofs_set_extent_state(sb, inode_info, first_block, DIV_ROUND_UP(*ppos, ASSOOFS_DEFAULT_BLOCK_SIZE), false);
+		if (err) {
+			printk(KERN_ERR "Write: no se pudieron marcar como escritos los bloques del inodo %lu (error %d)\n", inode->i_ino, err);
+			mapping_set_error(inode->i_mapping, err);
+			ret = err;
+		}
+	}
+
+out:
+	//cada vez que se escribe hay que aumentar la longitud (file_size) si se ha escrito mas alla del final
+	if (*ppos > inode_info->file_size)
+		inode_info->file_size = *ppos;
+
+	// sobrescribir dentro del fichero no cambia el registro del inodo, asi fdatasync no tiene que escribirlo
+	if (memcmp(&before, inode_info, sizeof(before)) || ASSOOFS_I(inode)->extents_dirty)
+		assoofs_save_inode_info(sb, inode_info);//actualizamos el descriptor
+	assoofs_usage_charge(filp->f_path.dentry, inode_info->file_size - before.file_size, 0);
+	inode_unlock(inode);
+
+	if (!nbytes)
+		return ret ?: -EFAULT;
+
+	// O_SYNC y O_DSYNC: como antes, la escritura no vuelve hasta que esta en disco
+	if ((filp->f_flags & O_DSYNC) || IS_SYNC(inode)) {
+		ret = vfs_fsync_range(filp, start, *ppos - 1, (filp->f_flags & __O_SYNC) ? 0 : 1);
+		if (ret)
+			return ret;
+	}
+
+	//numero de bytes escritos
+	return nbytes;
+}
+
+ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos) {
+
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	loff_t pos = *ppos;
+	u64 start = ktime_get_ns(), latency;
+	ssize_t ret = assoofs_do_write(filp, buf, len, ppos);
+
+	latency = ktime_get_ns() - start;
+	assoofs_stat_inc(inode->i_sb, ASSOOFS_STAT_WRITE);
+	if (ret > 0)
+		assoofs_stat_add(inode->i_sb, ASSOOFS_STAT_WRITE_BYTES, ret);
+	assoofs_stat_latency(inode->i_sb, ASSOOFS_LAT_WRITE, latency);
+	trace_assoofs_write(inode, pos, len, ret, latency);
+	return ret;
+}
+
+
+/*
+* Pone a cero los bytes [pos, pos + count) de un fichero, que tienen que estar dentro de un mismo bloque.
+* Si el bloque es compartido con un clon antes se hace una copia propia.
+*/
+
+static int assoofs_zero_partial_block(struct inode *inode, loff_t pos, size_t count) {
+
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	struct buffer_head *bh;
+	uint64_t block;
+	bool unwritten;
+	int ret;
+
+	ret = assoofs_unshare(inode, pos / ASSOOFS_DEFAULT_BLOCK_SIZE, pos / ASSOOFS_DEFAULT_BLOCK_SIZE + 1, pos, count);
+	if (ret)
+		return ret;
+
+	if (assoofs_map_block(inode_info, pos / ASSOOFS_DEFAULT_BLOCK_SIZE, &block, &unwritten) || unwritten)
+		return 0; // sin escribir ya se lee como ceros
+
+	bh = assoofs_bread(sb, block);
+	if (!bh)
+		return -EIO;
+	memset(bh->b_data + pos % ASSOOFS_DEFAULT_BLOCK_SIZE, 0, count);
+	mark_buffer_dirty(bh);
+	ret = assoofs_sync_buffer(sb, bh);
+	brelse(bh);
+	return ret;
+}
+
+/*
+* Reserva espacio para un fichero sin escribir los datos (fallocate):
+*  - modo 0: reserva [offset, offset + len) con tramos sin escribir y amplia el tamanyo si hace falta
+*  - FALLOC_FL_KEEP_SIZE: igual pero sin cambiar el tamanyo del fichero
+*  - FALLOC_FL_ZERO_RANGE: ademas deja a cero lo que ya estuviera escrito en el rango; los bloques
+*    completos se vuelven a marcar como sin escribir y solo se escriben los trozos de los extremos
+*  - FALLOC_FL_PUNCH_HOLE (siempre con KEEP_SIZE): los bloques completos del rango vuelven al
+*    asignador y quedan como hueco; los trozos de los extremos se ponen a cero
+* Los bloques nuevos se piden de una vez por cada hueco del rango, asi suelen quedar contiguos.
+*/
+
+static long assoofs_fallocate(struct file *file, int mode, loff_t offset, loff_t len) {
+
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	struct assoofs_extent *ext;
+	loff_t end = offset + len, zero_end, tail;
+	uint64_t needed, allocated, first, last_full, iblock, next;
+	int ret = 0, last, i;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_ZERO_RANGE | FALLOC_FL_PUNCH_HOLE))
+		return -EOPNOTSUPP;
+	if (end > sb->s_maxbytes)
+		return -EFBIG;
+	// los clusters comprimidos no tienen bloques reservados sin escribir ni huecos que liberar por separado
+	if (inode_info->flags & ASSOOFS_INODE_COMPRESSED)
+		return -EOPNOTSUPP;
+
+	inode_lock(inode);
+
+	// los bloques reservados van detras del contenido, que tiene que salir antes del registro o del bloque compartido
+	if (inode_info->flags & ASSOOFS_INODE_INLINE)
+		ret = assoofs_uninline_file(inode);
+	else if (inode_info->flags & ASSOOFS_INODE_TAIL)
+		ret = assoofs_unpack_tail(inode);
+	if (ret) {
+		inode_unlock(inode);
+		return ret;
+	}
+
+	// lo que espera en memoria va detras de los bloques asignados: se vuelca antes de anyadir mas
+	ret = assoofs_flush_delalloc(inode);
+	if (ret) {
+		inode_unlock(inode);
+		return ret;
+	}
+	allocated = assoofs_inode_blocks(inode_info, &last);
+
+	if (mode & (FALLOC_FL_ZERO_RANGE | FALLOC_FL_PUNCH_HOLE)) {
+		// solo hay que limpiar la parte que ya tiene bloques; lo que se reserve despues ya sera sin escribir
+		zero_end = min_t(loff_t, end, allocated * ASSOOFS_DEFAULT_BLOCK_SIZE);
+		if (offset < zero_end) {
+			first = DIV_ROUND_UP(offset, ASSOOFS_DEFAULT_BLOCK_SIZE);
+			last_full = zero_end / ASSOOFS_DEFAULT_BLOCK_SIZE;
+			if (first < last_full && (mode & FALLOC_FL_PUNCH_HOLE))
+				ret = assoofs_punch_extents(sb, inode_info, first, last_full);
+			else if (first < last_full)
+				ret = assoofs_set_extent_state(sb, inode_info, first, last_full, true);
+
+			if (!ret && offset % ASSOOFS_DEFAULT_BLOCK_SIZE)
+				ret = assoofs_zero_partial_block(inode, offset,
+						min_t(loff_t, zero_end, round_up(offset, ASSOOFS_DEFAULT_BLOCK_SIZE)) - offset);
+
+			tail = round_down(zero_end, ASSOOFS_DEFAULT_BLOCK_SIZE);
+			if (!ret && zero_end % ASSOOFS_DEFAULT_BLOCK_SIZE && tail >= offset)
+				ret = assoofs_zero_partial_block(inode, tail, zero_end - tail);
+		}
+	}
+
+	// se reservan los huecos del rango, tanto los de en medio como lo que pase del ultimo tramo
+	needed = DIV_ROUND_UP(end, ASSOOFS_DEFAULT_BLOCK_SIZE);
+	for (iblock = offset / ASSOOFS_DEFAULT_BLOCK_SIZE; !ret && !(mode & FALLOC_FL_PUNCH_HOLE) && iblock < needed; ) {
+		i = assoofs_lookup_extent(inode_info, iblock, &next);
+		if (i >= 0) {
+			ext = assoofs_extent_at(inode_info, i);
+			iblock = (uint64_t)ext->logical + assoofs_ext_len(ext);
+			continue;
+		}
+		ret = assoofs_extend_file(sb, inode_info, iblock, min(needed, next) - iblock, true);
+		iblock = min(needed, next);
+	}
+
+	if (!ret && !(mode & FALLOC_FL_KEEP_SIZE) && end > inode_info->file_size) {
+		assoofs_usage_charge(file->f_path.dentry, end - inode_info->file_size, 0);
+		inode_info->file_size = end;
+	}
+
+	// cambian los bloques; el contenido solo si se han puesto a cero o liberado
+	inode->i_ctime = current_time(inode);
+	if (mode & (FALLOC_FL_ZERO_RANGE | FALLOC_FL_PUNCH_HOLE))
+		inode->i_mtime = inode->i_ctime;
+	assoofs_save_inode_info(sb, inode_info); // tambien lo que se haya conseguido si ha fallado a medias
+	inode_unlock(inode);
+
+	trace_assoofs_fallocate(inode, mode, offset, len, ret);
+	return ret;
+}
+
+
+/*
+* Cambia el tamanyo de un fichero (truncate, O_TRUNC). Al crecer solo cambia el tamanyo y lo nuevo
+* queda como hueco. Al encoger se pone a cero lo que sobra del nuevo ultimo bloque y los bloques de
+* mas dejan de ser del fichero en el momento, pero vuelven al asignador en segundo plano (reclaim_work),
+* asi truncar un fichero enorme no deja esperando a quien lo hace. Con el cerrojo del inodo.
+*/
+
+static int assoofs_truncate(struct inode *inode, loff_t size) {
+
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	struct assoofs_inode_info *inode_info = &mem->info;
+	uint64_t nblocks = DIV_ROUND_UP(size, ASSOOFS_DEFAULT_BLOCK_SIZE), keep, i;
+	LIST_HEAD(ranges);
+	int ret = 0;
+	char *data;
+
+	if (size == inode_info->file_size)
+		return 0;
+
+	if (inode_info->flags & ASSOOFS_INODE_INLINE) {
+		// lo que quede en el registro detras del final se tiene que leer como ceros si vuelve a crecer
+		if (size <= ASSOOFS_INLINE_DATA_SIZE) {
+			if (size < inode_info->file_size)
+				memset(inode_info->inline_data + size, 0, ASSOOFS_INLINE_DATA_SIZE - size);
+		} else {
+			ret = assoofs_uninline_file(inode);
+		}
+	} else if (inode_info->flags & ASSOOFS_INODE_COMPRESSED) {
+		// los clusters que pasan del final se leen como ceros aunque tengan entrada
+		if (size > inode_info->file_size)
+			goto done;
+		mutex_lock(&mem->cluster_lock);
+		if (size % ASSOOFS_CLUSTER_SIZE) {
+			ret = assoofs_load_cluster(inode, size / ASSOOFS_CLUSTER_SIZE, true);
+			if (!ret) {
+				memset(mem->cluster_buf + size % ASSOOFS_CLUSTER_SIZE, 0, ASSOOFS_CLUSTER_SIZE - size % ASSOOFS_CLUSTER_SIZE);
+				mem->cluster_dirty = true;
+			}
+		}
+		if (!ret && mem->cluster_valid && mem->cluster_no >= DIV_ROUND_UP(size, ASSOOFS_CLUSTER_SIZE))
+			mem->cluster_valid = mem->cluster_dirty = false;
+		if (!ret)
+			ret = assoofs_cut_clusters(sb, inode_info, inode_info->file_size, size, &ranges);
+		mutex_unlock(&mem->cluster_lock);
+	} else if (inode_info->flags & ASSOOFS_INODE_TAIL) {
+		// el trozo del bloque compartido que hay detras es de otro fichero: para crecer se saca de ahi
+		if (size > inode_info->file_size)
+			ret = assoofs_unpack_tail(inode);
+		else if (!size)
+			assoofs_release_tail(sb, inode_info);
+		else
+			inode_info->tail_len = size;
+	} else if (size < inode_info->file_size) {
+		// lo que espera en memoria por encima del nuevo final ya no se va a escribir
+		if (mem->delalloc_count && mem->delalloc_first + mem->delalloc_count > nblocks) {
+			keep = mem->delalloc_first < nblocks ? nblocks - mem->delalloc_first : 0;
+			for (i = keep; i < mem->delalloc_count; i++)
+				kfree(mem->delalloc_blocks[i]);
+			percpu_counter_sub(&ASSOOFS_SB(sb)->delalloc_blocks_counter, mem->delalloc_count - keep);
+			mem->delalloc_count = keep;
+			assoofs_delalloc_meta_trim(inode);
+		}
+		if (size % ASSOOFS_DEFAULT_BLOCK_SIZE) {
+			data = assoofs_delalloc_block(inode, size / ASSOOFS_DEFAULT_BLOCK_SIZE);
+			if (data)
+				memset(data + size % ASSOOFS_DEFAULT_BLOCK_SIZE, 0, ASSOOFS_DEFAULT_BLOCK_SIZE - size % ASSOOFS_DEFAULT_BLOCK_SIZE);
+			else
+				ret = assoofs_zero_partial_block(inode, size, ASSOOFS_DEFAULT_BLOCK_SIZE - size % ASSOOFS_DEFAULT_BLOCK_SIZE);
+		}
+		// hasta el final: ningun tramo se parte en dos
+		if (!ret)
+			ret = assoofs_cut_extents(sb, inode_info, nblocks, U64_MAX, &ranges);
+	}
+
+done:
+	if (!ret)
+		inode_info->file_size = size;
+	assoofs_save_inode_info(sb, inode_info);
+	if (!list_empty(&ranges)) {
+		// el registro tiene que dejar de apuntar a los bloques antes de que se puedan reutilizar
+		ret = assoofs_sync_extents(sb, inode_info) ?: ret;
+		ret = assoofs_sync_inode_info(sb, inode_info->inode_no) ?: ret;
+		assoofs_reclaim_later(sb, &ranges);
+	}
+	return ret;
+}
+
+/*
+* Cambio de atributos (chmod, chown, utimes, truncate). El VFS llama con el cerrojo del inodo cogido.
+*/
+
+static int assoofs_setattr(struct dentry *dentry, struct iattr *attr) {
+
+	struct inode *inode = d_inode(dentry);
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	uint64_t old_size = inode_info->file_size;
+	int ret;
+
+	ret = setattr_prepare(dentry, attr);
+	if (ret)
+		return ret;
+
+	if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != old_size) {
+		trace_assoofs_truncate(inode, old_size, attr->ia_size);
+		ret = assoofs_truncate(inode, attr->ia_size);
+		if (ret)
+			return ret;
+		assoofs_usage_charge(dentry, (int64_t)attr->ia_size - (int64_t)old_size, 0);
+	}
+	setattr_copy(inode, attr); // las fechas de un truncate vienen en attr
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/*
+* Primer trozo con datos de un fichero que termina despues del bloque logico iblock: [*start, *end).
+* Son datos los tramos escritos y los bloques en memoria; los huecos y los tramos reservados sin
+* escribir no. Los trozos que se tocan se unen. Devuelve false si no hay ninguno.
+*/
+
+static bool assoofs_next_data(struct inode *inode, uint64_t iblock, uint64_t *start, uint64_t *end) {
+
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	struct assoofs_extent *ext;
+	uint64_t s, e;
+	bool found = false;
+	int i, max, used;
+
+	*start = *end = U64_MAX;
+
+	// el primer tramo escrito que acaba despues de iblock y los escritos que le siguen pegados
+	ext = assoofs_extent_table(&mem->info, &max);
+	used = assoofs_extent_count(ext, max);
+	for (i = assoofs_extent_search(ext, used, iblock); i < used && assoofs_ext_unwritten(&ext[i]); i++)
+		;
+	if (i < used) {
+		found = true;
+		*start = ext[i].logical;
+		*end = *start + assoofs_ext_len(&ext[i]);
+		for (i++; i < used && ext[i].logical == *end && !assoofs_ext_unwritten(&ext[i]); i++)
+			*end += assoofs_ext_len(&ext[i]);
+	}
+
+	// los bloques en memoria van detras de todos los tramos, tras un hueco o pegados al ultimo
+	if (mem->delalloc_count && mem->delalloc_first + mem->delalloc_count > iblock) {
+		s = mem->delalloc_first;
+		e = s + mem->delalloc_count;
+		if (!found || s < *start) {
+			*end = found && e >= *start ? max(e, *end) : e;
+			*start = s;
+			found = true;
+		} else if (s <= *end) {
+			*end = max(e, *end);
+		}
+	}
+	return found;
+}
+
+/*
+* lseek con SEEK_DATA y SEEK_HOLE: el final del fichero cuenta como hueco. Un fichero en linea,
+* empaquetado o comprimido es todo datos. El resto de modos son los de siempre, con el tamanyo de inode_info.
+*/
+
+static loff_t assoofs_llseek(struct file *file, loff_t offset, int whence) {
+
+	struct inode *inode = file_inode(file);
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	uint64_t start, end;
+	loff_t size;
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return generic_file_llseek_size(file, offset, whence, inode->i_sb->s_maxbytes, inode_info->file_size);
+
+	assoofs_read_lock(inode);
+	size = inode_info->file_size;
+	if (offset < 0 || offset >= size) {
+		assoofs_read_unlock(inode);
+		return -ENXIO;
+	}
+
+	if (!(inode_info->flags & (ASSOOFS_INODE_INLINE | ASSOOFS_INODE_TAIL | ASSOOFS_INODE_COMPRESSED))) {
+		if (whence == SEEK_DATA) {
+			if (!assoofs_next_data(inode, offset / ASSOOFS_DEFAULT_BLOCK_SIZE, &start, &end) ||
+					start * ASSOOFS_DEFAULT_BLOCK_SIZE >= size) {
+				assoofs_read_unlock(inode);
+				return -ENXIO;
+			}
+			offset = max_t(loff_t, offset, start * ASSOOFS_DEFAULT_BLOCK_SIZE);
+		} else if (assoofs_next_data(inode, offset / ASSOOFS_DEFAULT_BLOCK_SIZE, &start, &end) &&
+				start <= offset / ASSOOFS_DEFAULT_BLOCK_SIZE) {
+			offset = min_t(loff_t, end * ASSOOFS_DEFAULT_BLOCK_SIZE, size);
+		}
+	} else if (whence == SEEK_HOLE) {
+		offset = size;
+	}
+	assoofs_read_unlock(inode);
+
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+
+/*
+* Suma delta a las referencias de los bloques escritos de [first, end) de un fichero, trozo a trozo
+* (un tramo no pasa de un grupo). Si un trozo falla devuelve el error y en *done el bloque logico
+* donde empezaba: lo de delante ya tiene sumado delta.
+*/
+
+static int assoofs_clone_refs(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t first, uint64_t end, int delta, uint64_t *done) {
+
+	struct assoofs_extent *ext;
+	uint64_t iblock, next, eend;
+	int i, ret = 0;
+
+	for (iblock = first; iblock < end; iblock = eend) {
+		i = assoofs_lookup_extent(inode_info, iblock, &next);
+		if (i < 0) {
+			eend = next;
+			continue;
+		}
+		ext = assoofs_extent_at(inode_info, i);
+		eend = min(end, (uint64_t)ext->logical + assoofs_ext_len(ext));
+		if (assoofs_ext_unwritten(ext))
+			continue;
+		ret = assoofs_refcount_adjust(sb, ext->start + (iblock - ext->logical), eend - iblock, delta);
+		if (ret)
+			break;
+	}
+	*done = min(iblock, end);
+	return ret;
+}
+
+/*
+* Clonado (FICLONE, FICLONERANGE y copy_file_range dentro del mismo sistema de ficheros): los bloques
+* escritos de [pos_in, pos_in + len) del origen pasan a estar tambien en [pos_out, pos_out + len) del
+* destino sin copiar nada. Los tramos de los dos se marcan como compartidos y cada bloque suma una
+* referencia en la tabla de su grupo; el primero que escriba encima se hace su copia. Los huecos y lo
+* reservado sin escribir quedan como hueco en el destino. Los rangos tienen que ir alineados a bloque,
+* salvo el final si llega al final del origen.
+*/
+
+static int assoofs_clone_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, u64 len) {
+
+	struct inode *src = file_inode(file_in), *dst = file_inode(file_out);
+	struct super_block *sb = src->i_sb;
+	struct assoofs_inode_info *src_info = src->i_private, *dst_info = dst->i_private;
+	struct assoofs_extent *ext;
+	uint64_t first_in, first_out, end_in, nblocks, iblock, next, end, phys;
+	int i, n, ret;
+
+	if (!S_ISREG(src_info->mode) || !S_ISREG(dst_info->mode))
+		return -EINVAL;
+
+	lock_two_nondirectories(src, dst);
+
+	// FICLONE pide el fichero entero con len == 0; la VFS no conoce el tamanyo, esta en inode_info
+	if (!len && pos_in < src_info->file_size)
+		len = src_info->file_size - pos_in;
+	ret = -EINVAL;
+	if (pos_in < 0 || pos_out < 0 || pos_in + len > src_info->file_size)
+		goto out;
+	if (pos_in % ASSOOFS_DEFAULT_BLOCK_SIZE || pos_out % ASSOOFS_DEFAULT_BLOCK_SIZE)
+		goto out;
+	if (len % ASSOOFS_DEFAULT_BLOCK_SIZE && (pos_in + len != src_info->file_size || pos_out + len < dst_info->file_size))
+		goto out;
+	if (src == dst && pos_out < pos_in + len && pos_in < pos_out + len)
+		goto out;
+	ret = -EFBIG;
+	if (pos_out + len > sb->s_maxbytes)
+		goto out;
+	ret = 0;
+	if (!len)
+		goto out;
+
+	// lo que esta en linea o empaquetado no tiene bloques propios que compartir
+	ret = -EOPNOTSUPP;
+	if (src_info->flags & (ASSOOFS_INODE_INLINE | ASSOOFS_INODE_TAIL))
+		goto out;
+	// los comprimidos no tienen tramos que compartir
+	if ((src_info->flags | dst_info->flags) & ASSOOFS_INODE_COMPRESSED)
+		goto out;
+	ret = 0;
+	if (dst_info->flags & ASSOOFS_INODE_INLINE)
+		ret = assoofs_uninline_file(dst);
+	else if (dst_info->flags & ASSOOFS_INODE_TAIL)
+		ret = assoofs_unpack_tail(dst);
+	ret = ret ?: assoofs_flush_delalloc(src);
+	if (!ret && dst != src)
+		ret = assoofs_flush_delalloc(dst);
+	if (ret)
+		goto out;
+
+	first_in = pos_in / ASSOOFS_DEFAULT_BLOCK_SIZE;
+	first_out = pos_out / ASSOOFS_DEFAULT_BLOCK_SIZE;
+	nblocks = DIV_ROUND_UP(len, ASSOOFS_DEFAULT_BLOCK_SIZE);
+	end_in = first_in + nblocks;
+
+	// antes de tocar el destino se le hace sitio para todos los trozos del origen, mas los dos en que
+	// puede quedar partido un tramo suyo al soltar el rango, para no dejarlo a medias
+	n = 2;
+	for (iblock = first_in; iblock < end_in; iblock = end) {
+		i = assoofs_lookup_extent(src_info, iblock, &next);
+		if (i < 0) {
+			end = next;
+			continue;
+		}
+		ext = assoofs_extent_at(src_info, i);
+		end = min(end_in, (uint64_t)ext->logical + assoofs_ext_len(ext));
+		if (!assoofs_ext_unwritten(ext))
+			n++;
+	}
+	ret = assoofs_extent_room(sb, dst_info, n);
+	if (ret)
+		goto out;
+
+	// las referencias se suman antes de tocar el destino: si la tabla de algun grupo esta llena se
+	// quita lo ya sumado (vuelve a caber, era lo que habia) y el destino se queda como estaba
+	ret = assoofs_clone_refs(sb, src_info, first_in, end_in, 1, &iblock);
+	if (ret) {
+		assoofs_clone_refs(sb, src_info, first_in, iblock, -1, &iblock);
+		goto out;
+	}
+
+	// lo que hubiera en el rango del destino se suelta como con FALLOC_FL_PUNCH_HOLE
+	ret = assoofs_punch_extents(sb, dst_info, first_out, first_out + nblocks);
+	if (ret) {
+		assoofs_clone_refs(sb, src_info, first_in, end_in, -1, &iblock);
+		goto out;
+	}
+	// con el sitio ya hecho en la tabla del destino meter los tramos no falla
+	for (iblock = first_in; !ret && iblock < end_in; iblock = end) {
+		i = assoofs_lookup_extent(src_info, iblock, &next);
+		if (i < 0) {
+			end = next;
+			continue;
+		}
+		ext = assoofs_extent_at(src_info, i);
+		end = min(end_in, (uint64_t)ext->logical + assoofs_ext_len(ext));
+		if (assoofs_ext_unwritten(ext))
+			continue;
+		phys = ext->start + (iblock - ext->logical);
+		ext->len |= ASSOOFS_EXTENT_SHARED; // antes de insertar: si origen y destino son el mismo, ext se mueve
+		assoofs_extents_changed(src_info, i);
+		ret = assoofs_insert_extent(sb, dst_info, first_out + (iblock - first_in), phys, (end - iblock) | ASSOOFS_EXTENT_SHARED);
+	}
+
+	if (!ret && pos_out + len > dst_info->file_size) {
+		assoofs_usage_charge(file_out->f_path.dentry, pos_out + len - dst_info->file_size, 0);
+		dst_info->file_size = pos_out + len;
+	}
+	dst->i_mtime = dst->i_ctime = current_time(dst);
+	assoofs_save_inode_info(sb, src_info);
+	if (dst != src)
+		assoofs_save_inode_info(sb, dst_info);
+
+out:
+	unlock_two_nondirectories(src, dst);
+	trace_assoofs_clone(src, pos_in, dst, pos_out, len, ret);
+	return ret;
+}
+
+
+/*
+* ioctl: FS_IOC_GETFLAGS y FS_IOC_SETFLAGS con FS_COMPR_FL (chattr +c / lsattr). El formato de lo que
+* ya esta escrito no se cambia, asi que solo se puede activar o quitar mientras el fichero no tiene
+* bloques (vacio o en linea).
+*/
+
+static long assoofs_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+
+	struct inode *inode = file_inode(file);
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	struct assoofs_inode_info *inode_info = &mem->info;
+	int flags, ret;
+
+	switch (cmd) {
+	case FS_IOC_GETFLAGS:
+		flags = (inode_info->flags & ASSOOFS_INODE_COMPRESSED) ? FS_COMPR_FL : 0;
+		return put_user(flags, (int __user *)arg);
+
+	case FS_IOC_SETFLAGS:
+		if (!inode_owner_or_capable(inode))
+			return -EACCES;
+		if (get_user(flags, (int __user *)arg))
+			return -EFAULT;
+		if (flags & ~FS_COMPR_FL)
+			return -EOPNOTSUPP;
+		ret = mnt_want_write_file(file);
+		if (ret)
+			return ret;
+
+		inode_lock(inode);
+		if (!(flags & FS_COMPR_FL) == !(inode_info->flags & ASSOOFS_INODE_COMPRESSED)) {
+			ret = 0;
+		} else if (!(inode_info->flags & ASSOOFS_INODE_INLINE) &&
+				(inode_info->file_size || inode_info->extents[0].len || inode_info->extent_block || mem->delalloc_count || inode_info->cluster_index)) {
+			ret = -EINVAL;
+		} else {
+			inode_info->flags ^= ASSOOFS_INODE_COMPRESSED;
+			inode->i_ctime = current_time(inode);
+			ret = assoofs_save_inode_info(inode->i_sb, inode_info);
+		}
+		inode_unlock(inode);
+		mnt_drop_write_file(file);
+		return ret;
+	}
+	return -ENOTTY;
+}
+
+
+/*
+* ioctl de los directorios: ASSOOFS_IOC_GETUSAGE devuelve sus contadores recursivos, despues de subir
+* los cambios pendientes
+*/
+
+static long assoofs_dir_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+
+	struct inode *inode = file_inode(file);
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	struct assoofs_usage usage;
+
+	if (cmd != ASSOOFS_IOC_GETUSAGE)
+		return -ENOTTY;
+
+	assoofs_usage_flush(ASSOOFS_SB(inode->i_sb));
+	inode_lock_shared(inode);
+	usage.bytes = inode_info->rbytes;
+	usage.inodes = inode_info->rinodes;
+	inode_unlock_shared(inode);
+
+	if (copy_to_user((void __user *)arg, &usage, sizeof(usage)))
+		return -EFAULT;
+	return 0;
+}
+
+
+/*
+* Escribe y espera el registro del inodo ino en la tabla de inodos
+*/
+
+static int assoofs_sync_inode_info(struct super_block *sb, uint64_t inode_no) {
+
+	struct buffer_head *bh;
+	int ret;
+
+	if (!assoofs_inode_slot(sb, inode_no, &bh))
+		return -EIO;
+	ret = assoofs_sync_buffer(sb, bh);
+	brelse(bh);
+	return ret;
+}
+
+/*
+* Escribe y espera el mapa de bits y el bloque de descriptores del grupo g si estan sucios
+*/
+
+static int assoofs_sync_group(struct super_block *sb, uint64_t g) {
+
+	struct assoofs_group_info *grp = &ASSOOFS_SB(sb)->groups[g];
+	struct buffer_head *desc_bh;
+	int ret = 0, err;
+
+	if (READ_ONCE(grp->bitmap_bh))
+		ret = assoofs_sync_buffer(sb, grp->bitmap_bh);
+	if (READ_ONCE(grp->inode_bitmap_bh)) {
+		err = assoofs_sync_buffer(sb, grp->inode_bitmap_bh);
+		ret = ret ?: err;
+	}
+	if (assoofs_get_group_desc(sb, g, &desc_bh)) {
+		err = assoofs_sync_buffer(sb, desc_bh);
+		ret = ret ?: err;
+	}
+	return ret;
+}
+
+/*
+* fsync/fdatasync de un fichero o directorio. Solo se escribe lo que necesita este inodo:
+*  - sus bloques de datos sucios (los que write asocia al inodo) y los que esperaban en memoria
+*  - si ha cambiado su registro: el registro, el mapa de bits y el descriptor de los grupos donde
+*    estan sus bloques y su inodo, y la entrada del directorio padre si se acaba de crear
+* fdatasync se salta el registro si lo unico que ha cambiado no hace falta para leer los datos.
+* Al final se vacia la cache de escritura del dispositivo.
+*/
+
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync) {
+
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_inode_mem *mem = ASSOOFS_I(inode);
+	struct assoofs_inode_info *inode_info = &mem->info;
+	struct assoofs_extent_index *idx;
+	struct assoofs_extent *ext;
+	struct buffer_head *bh;
+	u64 t0 = ktime_get_ns(), latency;
+	uint64_t g, block;
+	int i, max, ret, err;
+
+	inode_lock(inode);
+	ret = assoofs_pack_tail(inode);
+	if (!ret)
+		ret = assoofs_flush_delalloc(inode);
+	if (!ret)
+		ret = assoofs_flush_cluster(inode); // los clusters y el indice se escriben y se esperan al guardarlos
+	err = sync_mapping_buffers(inode->i_mapping);
+	ret = ret ?: err;
+	// y los errores de escritura apuntados en el mapping (una escritura que no pudo marcar sus bloques)
+	err = file_check_and_advance_wb_err(file);
+	ret = ret ?: err;
+
+	// el bloque compartido no esta en la lista de ningun inodo: una sobrescritura dentro de el se escribe aqui
+	if (inode_info->flags & ASSOOFS_INODE_TAIL) {
+		bh = assoofs_bread(sb, inode_info->tail_block);
+		if (bh) {
+			err = assoofs_sync_buffer(sb, bh);
+			brelse(bh);
+		} else {
+			err = -EIO;
+		}
+		ret = ret ?: err;
+	}
+
+	// fsync tambien escribe las fechas que solo estaban en memoria; fdatasync no las necesita
+	if (!datasync) {
+		err = assoofs_save_inode_times(inode);
+		ret = ret ?: err;
+	}
+
+	if (mem->meta_dirty && (!datasync || mem->datasync_dirty)) {
+		// los tramos de un fichero suelen caer en pocos grupos seguidos: cada uno se escribe una vez por racha
+		ext = assoofs_extent_table(inode_info, &max);
+		for (i = 0, g = U64_MAX; i < max && ext[i].len; i++) {
+			if (ext[i].start / sbi->blocks_per_group == g)
+				continue;
+			g = ext[i].start / sbi->blocks_per_group;
+			err = assoofs_sync_group(sb, g);
+			ret = ret ?: err;
+		}
+		// el indice y sus hojas se reservan cerca unos de otros
+		if (mem->extent_bh) {
+			idx = (struct assoofs_extent_index *)mem->extent_bh->b_data;
+			g = U64_MAX;
+			for (i = -1; i < (int)idx->leaves; i++) {
+				block = i < 0 ? inode_info->extent_block : idx->leaf[i];
+				if (block / sbi->blocks_per_group == g)
+					continue;
+				g = block / sbi->blocks_per_group;
+				err = assoofs_sync_group(sb, g);
+				ret = ret ?: err;
+			}
+			err = assoofs_sync_extents(sb, inode_info);
+			ret = ret ?: err;
+		}
+		if (inode_info->flags & ASSOOFS_INODE_TAIL) {
+			err = assoofs_sync_group(sb, inode_info->tail_block / sbi->blocks_per_group);
+			ret = ret ?: err;
+		}
+		// los bloques de los clusters no estan en los tramos: se escriben los grupos cargados, sync_dirty_buffer se salta los limpios
+		if (inode_info->flags & ASSOOFS_INODE_COMPRESSED) {
+			for (g = 0; g < sbi->groups_count; g++) {
+				if (!READ_ONCE(sbi->groups[g].bitmap_bh))
+					continue;
+				err = assoofs_sync_group(sb, g);
+				ret = ret ?: err;
+			}
+		}
+		err = assoofs_sync_group(sb, (inode_info->inode_no - 1) / sbi->inodes_per_group);
+		ret = ret ?: err;
+		err = assoofs_sync_inode_info(sb, inode_info->inode_no);
+		ret = ret ?: err;
+
+		// un fichero nuevo no se encuentra tras un corte si no esta tambien su entrada y el contador del padre.
+		// Si la entrada esta en linea basta con el registro del padre
+		if (mem->parent_ino) {
+			if (mem->dirent_block) {
+				bh = assoofs_bread(sb, mem->dirent_block);
+				if (bh) {
+					err = assoofs_sync_buffer(sb, bh);
+					brelse(bh);
+				} else {
+					err = -EIO;
+				}
+				ret = ret ?: err;
+			}
+			err = assoofs_sync_inode_info(sb, mem->parent_ino);
+			ret = ret ?: err;
+			if (!ret)
+				mem->parent_ino = mem->dirent_block = 0;
+		}
+
+		if (!ret)
+			mem->meta_dirty = mem->datasync_dirty = false;
+	}
+	inode_unlock(inode);
+
+	err = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
+	latency = ktime_get_ns() - t0;
+	assoofs_stat_inc(sb, ASSOOFS_STAT_FSYNC);
+	assoofs_stat_latency(sb, ASSOOFS_LAT_FSYNC, latency);
+	trace_assoofs_fsync(inode, start, end, datasync, ret ?: err, latency);
+	return ret ?: err;
+}
 
 
 static void __exit assoofs_exit(void) {
@@ -776,6 +7017,7 @@ static void __exit assoofs_exit(void) {
 		printk(KERN_ERR "AN error has occurred in the exit\n");
 
 	}
+	kset_unregister(assoofs_kset);
 
 
 }
@@ -1,37 +1,460 @@
 #define ASSOOFS_MAGIC 0x20190416
+#define ASSOOFS_VERSION 15
 #define ASSOOFS_DEFAULT_BLOCK_SIZE 4096
 #define ASSOOFS_FILENAME_MAXLEN 255
-#define ASSOOFS_START_INO 10
-#define ASSOOFS_RESERVED_INODES 3 
-#define ASSOOFS_LAST_RESERVED_BLOCK ASSOOFS_ROOTDIR_DATABLOCK_NUMBER
-#define ASSOOFS_LAST_RESERVED_INODE ASSOOFS_INODESTORE_BLOCK_NUMBER
 const int ASSOOFS_SUPERBLOCK_BLOCK_NUMBER = 0;
-const int ASSOOFS_INODESTORE_BLOCK_NUMBER = 1;
-const int ASSOOFS_ROOTDIR_DATABLOCK_NUMBER = 2;
+const int ASSOOFS_GROUP_DESC_BLOCK_NUMBER = 1;  /* primer bloque de la tabla de descriptores de grupo */
 const int ASSOOFS_ROOTDIR_INODE_NUMBER = 1;
-const int ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED = 64;
+#define ASSOOFS_INODE_EXTENTS 3
+#define ASSOOFS_INODE_SIZE 512   /* tamanyo del registro de un inodo, 8 por bloque de la tabla de inodos */
+#define ASSOOFS_INLINE_DATA_SIZE 128 /* datos de un fichero o directorio pequenyo guardados en el propio registro */
+#define ASSOOFS_XATTR_INLINE_SIZE 232 /* atributos extendidos guardados en el propio registro */
+#define ASSOOFS_GOAL_SCAN 8      /* tramos libres que se miran a partir del objetivo antes de usar el best-fit */
+#define ASSOOFS_DEFAULT_BLOCKS_PER_GROUP (8 * ASSOOFS_DEFAULT_BLOCK_SIZE)  /* lo que cubre un bloque de mapa de bits */
+#define ASSOOFS_BLOCKS_PER_INODE 4 /* proporcion por defecto entre bloques e inodos de un grupo */
+#define ASSOOFS_DELALLOC_MAX_BLOCKS 256 /* bloques de un fichero que pueden esperar en memoria a que se les asigne sitio */
 
+/*
+ * Disposicion del dispositivo:
+ *   bloque 0                 superbloque
+ *   bloques 1..n             descriptores de grupo
+ * y cada grupo g ocupa los bloques [g * blocks_per_group, (g + 1) * blocks_per_group):
+ *   mapa de bits de bloques libres (1 = libre), mapa de bits de inodos libres (1 = libre), su trozo
+ *   de la tabla de inodos y bloques de datos.
+ * El inodo ino esta en el grupo (ino - 1) / inodes_per_group, posicion (ino - 1) % inodes_per_group.
+ */
 struct assoofs_super_block_info {
     uint64_t version;
     uint64_t magic;
     uint64_t block_size;    
     uint64_t inodes_count;
-    uint64_t free_blocks;
-    char padding[4056];
+    uint64_t blocks_count;
+    uint64_t groups_count;
+    uint64_t blocks_per_group;
+    uint64_t inodes_per_group;
+    uint64_t free_blocks_count;  /* resumen de los grupos, se vuelca al hacer sync */
+    uint64_t free_inodes_count;
+    uint64_t flags;
+    uint64_t orphan_head;   /* primer inodo de la lista de huerfanos (next_orphan de cada registro), 0 si esta vacia */
+    char padding[4000];
 };
 
+#define ASSOOFS_SB_READONLY 0x1  /* imagen empaquetada con mkassoofs -r: solo se puede montar de lectura */
+
+/*
+ * Descriptor de un grupo de asignacion. Los contadores permiten saltarse grupos llenos sin leer su mapa de bits.
+ */
+struct assoofs_group_desc {
+    uint64_t block_bitmap;       /* bloque con el mapa de bits de bloques libres del grupo */
+    uint64_t inode_bitmap;       /* bloque con el mapa de bits de posiciones libres de su tabla de inodos */
+    uint64_t inode_table;        /* primer bloque del trozo de la tabla de inodos del grupo */
+    uint32_t free_blocks_count;
+    uint32_t free_inodes_count;
+    uint32_t used_inodes;        /* posiciones de la tabla de inodos usadas alguna vez; las de detras estan sin estrenar */
+    uint32_t dirs_count;
+    uint64_t refcount_block;     /* tabla de referencias de los bloques compartidos del grupo, 0 si no hay */
+};
+
+#define ASSOOFS_DESCS_PER_BLOCK (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_group_desc))
+
+/*
+ * Tabla de referencias de un grupo (reflink): un bloque con tramos [start, start + len) de bloques
+ * que usan refs >= 2 ficheros, ordenados por start y sin solaparse. Un bloque ocupado que no esta
+ * en la tabla lo usa un solo fichero.
+ */
+struct assoofs_refcount_rec {
+    uint32_t start;
+    uint32_t len;
+    uint32_t refs;
+};
+
+struct assoofs_refcount_block {
+    uint32_t count;
+    uint32_t pad;
+    struct assoofs_refcount_rec recs[];
+};
+
+#define ASSOOFS_REFCOUNT_RECS ((ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(struct assoofs_refcount_block)) / sizeof(struct assoofs_refcount_rec))
+
 struct assoofs_dir_record_entry {
     char filename[ASSOOFS_FILENAME_MAXLEN];
     uint64_t inode_no;
 };
 
+#define ASSOOFS_DIR_ENTRIES_PER_BLOCK (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_dir_record_entry))
+
+/*
+ * Tramo de bloques contiguos de un fichero: los bloques logicos [logical, logical + len)
+ * estan en [start, start + len) del dispositivo. Los tramos de un inodo se guardan en orden
+ * logico sin solaparse; lo que queda entre ellos es un hueco que se lee como ceros. El primero
+ * empieza en data_block_number; len == 0 marca el final. Los primeros ASSOOFS_INODE_EXTENTS van en
+ * el propio registro; si no caben, todos pasan a las hojas de un indice de tramos (extent_block).
+ * El bit alto de len marca un tramo reservado con fallocate que aun no se ha escrito:
+ * sus bloques se leen como ceros sin tocar el disco. El siguiente marca un tramo clonado,
+ * que hay que copiar antes de escribir encima si sus bloques siguen compartidos.
+ */
+struct assoofs_extent {
+    uint32_t logical;
+    uint32_t start;
+    uint32_t len;
+};
+
+#define ASSOOFS_EXTENT_UNWRITTEN 0x80000000U
+#define ASSOOFS_EXTENT_SHARED 0x40000000U    /* puede compartir bloques con otro fichero: mirar la tabla de referencias */
+#define ASSOOFS_EXTENT_FLAGS (ASSOOFS_EXTENT_UNWRITTEN | ASSOOFS_EXTENT_SHARED)
+#define ASSOOFS_EXTENT_MAX_LEN (ASSOOFS_EXTENT_SHARED - 1)
+
+static inline uint32_t assoofs_ext_len(const struct assoofs_extent *ext) {
+    return ext->len & ~ASSOOFS_EXTENT_FLAGS;
+}
+
+static inline int assoofs_ext_shared(const struct assoofs_extent *ext) {
+    return (ext->len & ASSOOFS_EXTENT_SHARED) != 0;
+}
+
+static inline int assoofs_ext_unwritten(const struct assoofs_extent *ext) {
+    return (ext->len & ASSOOFS_EXTENT_UNWRITTEN) != 0;
+}
+
+/*
+ * Indice de tramos de un fichero con mas de ASSOOFS_INODE_EXTENTS: un bloque con los numeros de sus hojas
+ * y cada hoja un bloque con ASSOOFS_EXTENTS_PER_BLOCK tramos. Los tramos siguen el mismo orden que en
+ * el registro, la hoja i tiene los [i * ASSOOFS_EXTENTS_PER_BLOCK, (i + 1) * ASSOOFS_EXTENTS_PER_BLOCK).
+ */
+struct assoofs_extent_index {
+    uint32_t magic;
+    uint32_t leaves;             /* hojas usadas en leaf[] */
+    uint32_t leaf[];
+};
+
+#define ASSOOFS_EXTENT_MAGIC 0x45585449
+#define ASSOOFS_EXTENTS_PER_BLOCK (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_extent))
+#define ASSOOFS_EXTENT_INDEX_LEAVES ((ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(struct assoofs_extent_index)) / sizeof(uint32_t))
+
+#define ASSOOFS_INODE_INLINE 0x1  /* el contenido esta en inline_data y no tiene bloques */
+#define ASSOOFS_INODE_TAIL 0x2    /* el contenido esta en un bloque compartido con otros ficheros pequenyos */
+#define ASSOOFS_INODE_COMPRESSED 0x4 /* el contenido se guarda en clusters comprimidos (chattr +c o montado con compress) */
+
 struct assoofs_inode_info {
     mode_t mode;
+    uint32_t generation;         /* se incrementa cada vez que se vuelve a usar el numero de inodo */
     uint64_t inode_no;
     uint64_t data_block_number;
     char campo_nuevo;
+    uint8_t pad;
+    uint16_t subdirs;            /* directorios: hijos que son directorios; su nlink es 2 + subdirs */
+    uint32_t next_orphan;        /* siguiente en la lista de huerfanos; solo lo escribe el codigo de esa lista */
     union {
         uint64_t file_size;
         uint64_t dir_children_count;
     };
+    struct assoofs_extent extents[ASSOOFS_INODE_EXTENTS];
+    uint32_t flags;
+    uint32_t tail_block;         /* con ASSOOFS_INODE_TAIL: bloque compartido, posicion y longitud del contenido */
+    uint16_t tail_offset;
+    uint16_t tail_len;
+    uint32_t cluster_index;      /* con ASSOOFS_INODE_COMPRESSED: bloque raiz del indice de clusters, 0 si aun no hay */
+    uint32_t atime_nsec;         /* marcas de tiempo: nanosegundos y, debajo, segundos desde la epoca */
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+    uint8_t inline_data[ASSOOFS_INLINE_DATA_SIZE];
+    uint64_t rbytes;             /* directorios: bytes e inodos de todo lo que cuelga de el, sin contarse a si mismo */
+    uint64_t rinodes;
+    uint32_t extent_block;       /* indice de tramos cuando no caben en extents[], 0 si no hay */
+    uint32_t xattr_block;        /* bloque con los atributos que no caben en xattr_data, 0 si no hay */
+    uint8_t xattr_data[ASSOOFS_XATTR_INLINE_SIZE];
+};
+
+/*
+ * Atributo extendido. Se guardan seguidos en xattr_data y en el bloque de atributos, y cada uno
+ * ocupa ASSOOFS_XATTR_ENTRY_SIZE bytes: la cabecera, el nombre sin el prefijo y sin '\0' y el valor.
+ * Una cabecera con name_len == 0 (o el final de la zona) marca el final.
+ */
+struct assoofs_xattr_entry {
+    uint8_t name_index;          /* prefijo: ASSOOFS_XATTR_USER, ... */
+    uint8_t name_len;
+    uint16_t value_len;
+    char name[];
+} __attribute__((packed));
+
+#define ASSOOFS_XATTR_USER 1
+#define ASSOOFS_XATTR_TRUSTED 2
+#define ASSOOFS_XATTR_SECURITY 3
+
+#define ASSOOFS_XATTR_ENTRY_SIZE(e) (sizeof(struct assoofs_xattr_entry) + (e)->name_len + (e)->value_len)
+#define ASSOOFS_XATTR_VALUE(e) ((e)->name + (e)->name_len)
+
+/*
+ * Bloque de atributos: los que no caben en el registro. Ficheros con los mismos atributos de mas
+ * comparten el bloque, que se libera cuando refs llega a 0.
+ */
+struct assoofs_xattr_header {
+    uint32_t magic;
+    uint32_t refs;
+    uint32_t hash;               /* de las entradas (used bytes), para encontrar bloques iguales */
+    uint32_t used;
+};
+
+#define ASSOOFS_XATTR_MAGIC 0x58415454
+#define ASSOOFS_XATTR_BLOCK_SPACE (ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(struct assoofs_xattr_header))
+#define ASSOOFS_XATTR_MAX_REFS 1024  /* un bloque corrupto no afecta a mas ficheros que estos */
+
+/*
+ * Entrada de un directorio en linea. Se guardan seguidas en inline_data y cada una
+ * ocupa sizeof(struct assoofs_inline_dirent) + name_len bytes (el nombre sin '\0').
+ * Cuando no caben se pasan a un bloque con entradas assoofs_dir_record_entry.
+ */
+struct assoofs_inline_dirent {
+    uint64_t inode_no;
+    uint8_t name_len;
+    char name[];
+} __attribute__((packed));
+
+#define ASSOOFS_INODES_PER_BLOCK (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_inode_info))
+
+/*
+ * Cabecera de un bloque compartido por ficheros pequenyos. El contenido de cada fichero se coloca
+ * detras del anterior a partir de used; el bloque se libera cuando refs llega a 0. El sitio que deja
+ * un fichero que sale del bloque no se reutiliza.
+ */
+struct assoofs_tail_header {
+    uint32_t refs;
+    uint32_t used;
 };
+
+#define ASSOOFS_TAIL_MAX_SIZE 2048 /* ficheros hasta este tamanyo se empaquetan en bloques compartidos */
+
+/*
+ * Ficheros comprimidos: el contenido se parte en clusters de ASSOOFS_CLUSTER_SIZE bytes y cada uno se
+ * guarda comprimido con LZ4 en bloques seguidos, o tal cual si comprimido no ahorra ningun bloque.
+ * No usan tramos: las entradas de los primeros ASSOOFS_INLINE_CLUSTERS clusters van en inline_data
+ * del propio registro; para el resto, el bloque cluster_index tiene los numeros de los bloques del
+ * indice y cada bloque del indice una entrada por cluster. Un cluster sin bloques (start == 0) se
+ * lee como ceros.
+ */
+#define ASSOOFS_CLUSTER_BLOCKS 32
+#define ASSOOFS_CLUSTER_SIZE (ASSOOFS_CLUSTER_BLOCKS * ASSOOFS_DEFAULT_BLOCK_SIZE)
+
+struct assoofs_cluster_entry {
+    uint32_t start;              /* primer bloque del cluster */
+    uint32_t size;               /* bytes guardados; con ASSOOFS_CLUSTER_RAW estan sin comprimir */
+};
+
+#define ASSOOFS_CLUSTER_RAW 0x80000000U
+#define ASSOOFS_CLUSTERS_PER_BLOCK (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_cluster_entry))
+#define ASSOOFS_CLUSTER_INDEX_BLOCKS (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(uint32_t))
+#define ASSOOFS_INLINE_CLUSTERS (ASSOOFS_INLINE_DATA_SIZE / sizeof(struct assoofs_cluster_entry))
+
+/*
+ * ASSOOFS_IOC_GETUSAGE sobre un directorio abierto: los contadores recursivos de su registro (rbytes, rinodes),
+ * con los cambios pendientes ya subidos, asi que `du` de un arbol entero es leer un solo inodo
+ */
+struct assoofs_usage {
+    uint64_t bytes;
+    uint64_t inodes;
+};
+#define ASSOOFS_IOC_GETUSAGE _IOR('A', 1, struct assoofs_usage)
+
+#ifdef __KERNEL__
+/*
+ * Tramo de bloques libres contiguos [start, start + len), indexado a la vez
+ * por posicion (para fusionar vecinos) y por longitud (para el best-fit)
+ */
+struct assoofs_free_extent {
+    struct rb_node by_offset;
+    struct rb_node by_len;
+    uint64_t start;
+    uint64_t len;
+};
+
+/*
+ * Estado en memoria de un grupo de asignacion. Cada grupo tiene su propio cerrojo, asi dos
+ * directorios en grupos distintos reservan bloques e inodos sin molestarse.
+ */
+struct assoofs_group_info {
+    struct mutex lock;                       /* protege el mapa de bits, el descriptor y los arboles */
+    struct buffer_head *bitmap_bh;           /* NULL hasta que se usa el grupo por primera vez */
+    struct rb_root free_by_offset;           /* tramos libres construidos a partir del mapa de bits */
+    struct rb_root free_by_len;
+    uint64_t tail_block;                     /* bloque compartido donde se empaquetan ahora los ficheros del grupo, 0 si no hay */
+    struct buffer_head *inode_bitmap_bh;     /* NULL hasta que se crea o se borra el primer inodo del grupo */
+    uint32_t inode_hint;                     /* por debajo no hay posiciones libres en la tabla de inodos */
+    bool extents_loaded;                     /* los arboles estan construidos; el shrinker puede tirarlos y se rehacen del mapa de bits */
+    unsigned long nr_extents;                /* nodos en los arboles */
+    struct list_head lru;                    /* en sbi->group_lru mientras tiene los arboles cargados */
+};
+
+#define ASSOOFS_RECLAIM_BATCH 4096  /* bloques que se liberan de una vez al borrar, antes de dejar paso a otros */
+
+/*
+ * Inodo sin entradas en ningun directorio cuyos bloques aun no se han liberado: sigue abierto o
+ * espera a reclaim_work. sbi->orphans repite en memoria, en el mismo orden, la lista que empieza
+ * en orphan_head, asi se encuentra el anterior de cada uno sin recorrerla en disco.
+ */
+struct assoofs_orphan {
+    struct list_head list;                   /* en sbi->orphans */
+    struct list_head reclaim;                /* en sbi->reclaim_inodes cuando ya se puede liberar */
+    uint64_t ino;
+    bool released;                           /* el inodo ha salido de memoria */
+};
+
+/*
+ * Bloques que un fichero ya no apunta (truncate) pendientes de devolver al asignador
+ */
+struct assoofs_reclaim_range {
+    struct list_head list;
+    uint64_t start;
+    uint64_t len;
+    bool shared;                             /* tramo clonado: se quita una referencia */
+};
+
+#define ASSOOFS_USAGE_DELAY (5 * HZ) /* los cambios de uso se acumulan este tiempo antes de subirlos por el arbol */
+
+/*
+ * Estadisticas del montaje, por cpu, en /sys/fs/assoofs/<dispositivo>/. Los contadores solo suben;
+ * los histogramas de latencia tienen un cubo por potencia de 2 en nanosegundos: el cubo b cuenta
+ * las operaciones de [2^b, 2^(b+1)) ns y el ultimo todas las que tardan mas.
+ */
+enum assoofs_stat_item {
+    ASSOOFS_STAT_LOOKUP,
+    ASSOOFS_STAT_CREATE,
+    ASSOOFS_STAT_MKDIR,
+    ASSOOFS_STAT_UNLINK,
+    ASSOOFS_STAT_READ,
+    ASSOOFS_STAT_WRITE,
+    ASSOOFS_STAT_FSYNC,
+    ASSOOFS_STAT_READ_BYTES,
+    ASSOOFS_STAT_WRITE_BYTES,
+    ASSOOFS_STAT_BUFFER_HITS,                /* bloques pedidos que ya estaban en la cache de buffers */
+    ASSOOFS_STAT_BUFFER_READS,               /* los que hubo que leer del dispositivo */
+    ASSOOFS_STAT_BUFFER_WRITES,              /* escrituras sincronas de bloques sucios */
+    ASSOOFS_STAT_ITABLE_HITS,                /* registros de inodos encontrados en memoria (preload o cache de buffers) */
+    ASSOOFS_STAT_ITABLE_MISSES,
+    ASSOOFS_STAT_EXTENT_HITS,                /* reservas y liberaciones con los arboles de tramos libres ya construidos */
+    ASSOOFS_STAT_EXTENT_MISSES,              /* las que tuvieron que construirlos */
+    ASSOOFS_STAT_NR
+};
+
+enum assoofs_lat_item {
+    ASSOOFS_LAT_LOOKUP,
+    ASSOOFS_LAT_CREATE,
+    ASSOOFS_LAT_READ,
+    ASSOOFS_LAT_WRITE,
+    ASSOOFS_LAT_FSYNC,
+    ASSOOFS_LAT_NR
+};
+
+#define ASSOOFS_LAT_BUCKETS 32  /* el ultimo cubo empieza en 2^31 ns, unos 2 segundos */
+
+struct assoofs_stats {
+    uint64_t count[ASSOOFS_STAT_NR];
+    uint64_t lat[ASSOOFS_LAT_NR][ASSOOFS_LAT_BUCKETS];
+};
+
+/*
+ * Informacion del superbloque en memoria (sb->s_fs_info)
+ */
+struct assoofs_sb_info {
+    struct super_block *sb;                  /* para los trabajos en segundo plano */
+    struct buffer_head *sbh;                 /* bloque 0, retenido mientras este montado */
+    struct assoofs_super_block_info *asb;    /* apunta a sbh->b_data */
+    struct mutex lock;                       /* protege inodes_count */
+    struct percpu_counter free_blocks_counter;
+    struct percpu_counter free_inodes_counter;
+    struct percpu_counter delalloc_blocks_counter; /* bloques prometidos a escrituras diferidas, aun sin asignar */
+    uint64_t groups_count;
+    uint64_t blocks_per_group;
+    uint64_t inodes_per_group;
+    uint64_t group_desc_blocks;
+    struct mutex desc_lock;                  /* protege la carga de group_desc_bh */
+    struct buffer_head **group_desc_bh;      /* tabla de descriptores, cada bloque se lee al usarlo y se retiene */
+    struct assoofs_group_info *groups;
+    struct mutex refcount_lock;              /* protege las tablas de referencias de los grupos */
+    struct mutex tail_lock;                  /* protege tail_block de los grupos y las cabeceras de los bloques compartidos */
+    bool compress;                           /* opcion compress: los ficheros nuevos se crean comprimidos */
+    bool image_ro;                           /* ASSOOFS_SB_READONLY: nada cambia, las lecturas no cogen el cerrojo del inodo */
+    bool preload;                            /* opcion preload: la tabla de inodos entera se lee al montar y se queda en memoria */
+    uint64_t itable_blocks;                  /* bloques de la tabla de inodos de cada grupo */
+    struct buffer_head **itable_bh;          /* con preload, groups_count * itable_blocks bloques retenidos */
+    spinlock_t lru_lock;                     /* protege group_lru */
+    struct list_head group_lru;              /* grupos con arboles de tramos libres, el usado hace mas tiempo primero */
+    atomic_long_t extent_nodes;              /* nodos de los arboles de todos los grupos */
+    unsigned long xattr_cache_count;         /* entradas en xattr_cache */
+    struct kobject kobj;                     /* /sys/fs/assoofs/<dispositivo> */
+    struct completion kobj_unregister;
+    bool sysfs;                              /* kobj esta registrado */
+    struct assoofs_stats __percpu *stats;    /* se suman todas las cpus al leer sysfs */
+    struct mutex compress_lock;              /* protege la memoria de trabajo del compresor, compartida por todo el montaje */
+    void *compress_wrkmem;                   /* se reservan la primera vez que se comprime algo */
+    char *compress_buf;
+    char * __percpu *decompress_buf;         /* un cluster comprimido por cpu, para descomprimir sin cerrojos */
+    atomic64_t compress_raw_bytes;           /* bytes de clusters guardados y lo que han ocupado en disco */
+    atomic64_t compress_stored_bytes;
+    struct mutex xattr_lock;                 /* protege refs de los bloques de atributos y xattr_cache */
+    DECLARE_HASHTABLE(xattr_cache, 6);       /* bloques de atributos vistos, por hash, para compartirlos */
+    spinlock_t usage_lock;                   /* protege usage_dirty y los cambios pendientes de cada directorio */
+    struct list_head usage_dirty;            /* directorios con cambios de uso que aun no se han subido a su padre */
+    struct mutex usage_mutex;                /* una sola subida a la vez */
+    struct delayed_work usage_work;          /* sube los cambios pendientes ASSOOFS_USAGE_DELAY despues del primero */
+    struct mutex orphan_lock;                /* protege orphans, orphan_head y los next_orphan en disco */
+    struct list_head orphans;
+    spinlock_t reclaim_lock;                 /* protege reclaim_inodes y reclaim_ranges */
+    struct list_head reclaim_inodes;         /* huerfanos listos para liberar */
+    struct list_head reclaim_ranges;         /* struct assoofs_reclaim_range */
+    struct work_struct reclaim_work;         /* libera en segundo plano lo de las dos listas */
+};
+
+/*
+ * Bloque de atributos en xattr_cache
+ */
+struct assoofs_xattr_cache_entry {
+    struct hlist_node node;
+    uint32_t hash;
+    uint64_t block;
+};
+
+static inline struct assoofs_sb_info *ASSOOFS_SB(struct super_block *sb) {
+    return sb->s_fs_info;
+}
+
+/*
+ * Inodo en memoria: la info persistente (inode->i_private apunta a info) y los bloques escritos
+ * al final del fichero que aun no tienen sitio en disco. Esos bloques se asignan todos juntos
+ * en write_inode, cuando ya se sabe cuanto ocupan.
+ */
+struct assoofs_inode_mem {
+    struct assoofs_inode_info info;
+    uint64_t delalloc_first;                 /* bloque logico de delalloc_blocks[0] */
+    uint64_t delalloc_count;
+    char **delalloc_blocks;                  /* ASSOOFS_DELALLOC_MAX_BLOCKS huecos, se reserva al primer uso */
+    uint32_t delalloc_meta;                  /* bloques del indice de tramos prometidos para poder volcarlos */
+    uint64_t parent_ino;                     /* directorio donde se creo, mientras su entrada no este en disco */
+    uint64_t dirent_block;                   /* bloque de ese directorio con la entrada nueva, 0 si ya se escribio */
+    bool meta_dirty;                         /* registro del inodo cambiado desde el ultimo fsync */
+    bool datasync_dirty;                     /* el cambio afecta al tamanyo o a los tramos: fdatasync tambien lo escribe */
+    struct mutex cluster_lock;               /* ficheros comprimidos: protege el cluster en memoria */
+    char *cluster_buf;                       /* ultimo cluster leido o escrito, descomprimido */
+    uint64_t cluster_no;
+    bool cluster_valid;
+    bool cluster_dirty;                      /* cambiado en memoria, hay que volver a comprimirlo y guardarlo */
+    struct rw_semaphore xattr_sem;           /* protege xattr_data y xattr_block */
+    struct inode *vfs_inode;                 /* inodo del VFS; de aqui salen las fechas al guardar el registro */
+    struct assoofs_orphan *orphan;           /* en la lista de huerfanos desde que se borro su ultima entrada */
+    struct list_head usage_list;             /* directorios: en usage_dirty mientras tenga cambios pendientes */
+    struct dentry *usage_dentry;             /* referencia que lo mantiene en memoria hasta aplicarlos */
+    int64_t usage_bytes;                     /* cambios pendientes en rbytes y rinodes */
+    int64_t usage_inodes;
+    struct assoofs_extent *extents;          /* con extent_block, copia en memoria de sus hojas; NULL si se usa info.extents */
+    uint32_t extents_max;                    /* sitio en extents: hojas del indice por ASSOOFS_EXTENTS_PER_BLOCK */
+    bool extents_dirty;                      /* la tabla ha cambiado desde la ultima vez que se copio a las hojas */
+    uint32_t extents_dirty_from;             /* primera posicion cambiada */
+    struct buffer_head *extent_bh;           /* bloque indice, retenido mientras el inodo este en memoria */
+};
+
+static inline struct assoofs_inode_mem *ASSOOFS_I(struct inode *inode) {
+    return container_of((struct assoofs_inode_info *)inode->i_private, struct assoofs_inode_mem, info);
+}
+#endif
@@ -0,0 +1,431 @@
+/*
+ * Tracepoints de assoofs (perf, bpftrace, /sys/kernel/tracing/events/assoofs).
+ * Desactivados no cuestan nada mas que una rama. La latencia, en nanosegundos,
+ * es la misma que se suma a los histogramas de /sys/fs/assoofs/<dispositivo>/.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM assoofs
+
+#if !defined(_ASSOOFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ASSOOFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * read y write: posicion y tamanyo pedidos, lo que devuelven y lo que han tardado
+ */
+DECLARE_EVENT_CLASS(assoofs_rw_class,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret, u64 latency),
+	TP_ARGS(inode, pos, count, ret, latency),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(loff_t, pos)
+		__field(size_t, count)
+		__field(ssize_t, ret)
+		__field(u64, latency)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->pos = pos;
+		__entry->count = count;
+		__entry->ret = ret;
+		__entry->latency = latency;
+	),
+	TP_printk("dev %d,%d ino %llu pos %lld count %zu ret %zd latency %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->pos,
+		__entry->count, __entry->ret, __entry->latency)
+);
+
+DEFINE_EVENT(assoofs_rw_class, assoofs_read,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret, u64 latency),
+	TP_ARGS(inode, pos, count, ret, latency)
+);
+
+DEFINE_EVENT(assoofs_rw_class, assoofs_write,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret, u64 latency),
+	TP_ARGS(inode, pos, count, ret, latency)
+);
+
+/*
+ * lookup y create: el inodo encontrado o creado (0 si no hay), el error y lo que han tardado
+ */
+DECLARE_EVENT_CLASS(assoofs_namei_class,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, u64 ino, int ret, u64 latency),
+	TP_ARGS(dir, dentry, ino, ret, latency),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, dir)
+		__field(u64, ino)
+		__field(int, ret)
+		__field(u64, latency)
+		__string(name, dentry->d_name.name)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		__entry->ret = ret;
+		__entry->latency = latency;
+		__assign_str(name, dentry->d_name.name);
+	),
+	TP_printk("dev %d,%d dir %llu name %s ino %llu ret %d latency %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir, __get_str(name),
+		__entry->ino, __entry->ret, __entry->latency)
+);
+
+DEFINE_EVENT(assoofs_namei_class, assoofs_lookup,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, u64 ino, int ret, u64 latency),
+	TP_ARGS(dir, dentry, ino, ret, latency)
+);
+
+DEFINE_EVENT(assoofs_namei_class, assoofs_create,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, u64 ino, int ret, u64 latency),
+	TP_ARGS(dir, dentry, ino, ret, latency)
+);
+
+/*
+ * mkdir, symlink y unlink: la entrada que se ha anyadido o quitado del directorio
+ */
+DECLARE_EVENT_CLASS(assoofs_dirop_class,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, u64 ino),
+	TP_ARGS(dir, dentry, ino),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, dir)
+		__field(u64, ino)
+		__string(name, dentry->d_name.name)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		__assign_str(name, dentry->d_name.name);
+	),
+	TP_printk("dev %d,%d dir %llu name %s ino %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir, __get_str(name), __entry->ino)
+);
+
+DEFINE_EVENT(assoofs_dirop_class, assoofs_mkdir,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, u64 ino),
+	TP_ARGS(dir, dentry, ino)
+);
+
+DEFINE_EVENT(assoofs_dirop_class, assoofs_symlink,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, u64 ino),
+	TP_ARGS(dir, dentry, ino)
+);
+
+DEFINE_EVENT(assoofs_dirop_class, assoofs_unlink,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, u64 ino),
+	TP_ARGS(dir, dentry, ino)
+);
+
+TRACE_EVENT(assoofs_iterate,
+	TP_PROTO(struct inode *dir, int ret),
+	TP_ARGS(dir, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, dir)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d,%d dir %llu ret %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir, __entry->ret)
+);
+
+/*
+ * Inodo del VFS construido a partir de su registro
+ */
+TRACE_EVENT(assoofs_get_inode,
+	TP_PROTO(struct super_block *sb, u64 ino, umode_t mode),
+	TP_ARGS(sb, ino, mode),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(umode_t, mode)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->mode = mode;
+	),
+	TP_printk("dev %d,%d ino %llu mode 0%o",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->mode)
+);
+
+/*
+ * Tabla de inodos: el registro leido, guardado o estrenado y el bloque de la tabla donde esta
+ */
+DECLARE_EVENT_CLASS(assoofs_inode_store_class,
+	TP_PROTO(struct super_block *sb, u64 ino, u64 block),
+	TP_ARGS(sb, ino, block),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(u64, block)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->block = block;
+	),
+	TP_printk("dev %d,%d ino %llu block %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->block)
+);
+
+DEFINE_EVENT(assoofs_inode_store_class, assoofs_get_inode_info,
+	TP_PROTO(struct super_block *sb, u64 ino, u64 block),
+	TP_ARGS(sb, ino, block)
+);
+
+DEFINE_EVENT(assoofs_inode_store_class, assoofs_save_inode_info,
+	TP_PROTO(struct super_block *sb, u64 ino, u64 block),
+	TP_ARGS(sb, ino, block)
+);
+
+DEFINE_EVENT(assoofs_inode_store_class, assoofs_add_inode_info,
+	TP_PROTO(struct super_block *sb, u64 ino, u64 block),
+	TP_ARGS(sb, ino, block)
+);
+
+/*
+ * Asignador: lo pedido (count bloques cerca de goal) y lo obtenido (got bloques desde block)
+ */
+TRACE_EVENT(assoofs_new_blocks,
+	TP_PROTO(struct super_block *sb, u64 goal, u64 count, u64 block, u64 got, int ret),
+	TP_ARGS(sb, goal, count, block, got, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, goal)
+		__field(u64, count)
+		__field(u64, block)
+		__field(u64, got)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->goal = goal;
+		__entry->count = count;
+		__entry->block = block;
+		__entry->got = got;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d,%d goal %llu count %llu block %llu got %llu ret %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->goal, __entry->count,
+		__entry->block, __entry->got, __entry->ret)
+);
+
+TRACE_EVENT(assoofs_fsync,
+	TP_PROTO(struct inode *inode, loff_t start, loff_t end, int datasync, int ret, u64 latency),
+	TP_ARGS(inode, start, end, datasync, ret, latency),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(loff_t, start)
+		__field(loff_t, end)
+		__field(int, datasync)
+		__field(int, ret)
+		__field(u64, latency)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->start = start;
+		__entry->end = end;
+		__entry->datasync = datasync;
+		__entry->ret = ret;
+		__entry->latency = latency;
+	),
+	TP_printk("dev %d,%d ino %llu range %lld-%lld datasync %d ret %d latency %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->start,
+		__entry->end, __entry->datasync, __entry->ret, __entry->latency)
+);
+
+TRACE_EVENT(assoofs_fallocate,
+	TP_PROTO(struct inode *inode, int mode, loff_t offset, loff_t len, int ret),
+	TP_ARGS(inode, mode, offset, len, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(int, mode)
+		__field(loff_t, offset)
+		__field(loff_t, len)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->mode = mode;
+		__entry->offset = offset;
+		__entry->len = len;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d,%d ino %llu mode 0x%x offset %lld len %lld ret %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->mode,
+		__entry->offset, __entry->len, __entry->ret)
+);
+
+TRACE_EVENT(assoofs_truncate,
+	TP_PROTO(struct inode *inode, u64 old_size, u64 new_size),
+	TP_ARGS(inode, old_size, new_size),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(u64, old_size)
+		__field(u64, new_size)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->old_size = old_size;
+		__entry->new_size = new_size;
+	),
+	TP_printk("dev %d,%d ino %llu size %llu -> %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->old_size, __entry->new_size)
+);
+
+TRACE_EVENT(assoofs_clone,
+	TP_PROTO(struct inode *src, loff_t pos_in, struct inode *dst, loff_t pos_out, u64 len, int ret),
+	TP_ARGS(src, pos_in, dst, pos_out, len, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, src)
+		__field(loff_t, pos_in)
+		__field(u64, dst)
+		__field(loff_t, pos_out)
+		__field(u64, len)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = src->i_sb->s_dev;
+		__entry->src = src->i_ino;
+		__entry->pos_in = pos_in;
+		__entry->dst = dst->i_ino;
+		__entry->pos_out = pos_out;
+		__entry->len = len;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d,%d ino %llu pos %lld -> ino %llu pos %lld len %llu ret %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->src, __entry->pos_in,
+		__entry->dst, __entry->pos_out, __entry->len, __entry->ret)
+);
+
+/*
+ * Bloques de datos: volcado de la asignacion diferida, copia al escribir en un bloque compartido,
+ * empaquetado de una cola y paso de un directorio en linea a su bloque
+ */
+TRACE_EVENT(assoofs_flush_delalloc,
+	TP_PROTO(struct inode *inode, u64 count),
+	TP_ARGS(inode, count),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(u64, count)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->count = count;
+	),
+	TP_printk("dev %d,%d ino %llu count %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->count)
+);
+
+TRACE_EVENT(assoofs_cow,
+	TP_PROTO(struct super_block *sb, u64 ino, u64 first, u64 last, u64 block),
+	TP_ARGS(sb, ino, first, last, block),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(u64, first)
+		__field(u64, last)
+		__field(u64, block)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->first = first;
+		__entry->last = last;
+		__entry->block = block;
+	),
+	TP_printk("dev %d,%d ino %llu iblocks %llu-%llu block %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->first,
+		__entry->last, __entry->block)
+);
+
+/*
+ * La tabla de tramos de un fichero crece: used tramos en uso, leaves hojas del indice tras crecer
+ */
+TRACE_EVENT(assoofs_extent_room,
+	TP_PROTO(struct super_block *sb, u64 ino, u32 used, u32 leaves),
+	TP_ARGS(sb, ino, used, leaves),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(u32, used)
+		__field(u32, leaves)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->used = used;
+		__entry->leaves = leaves;
+	),
+	TP_printk("dev %d,%d ino %llu used %u leaves %u",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->used,
+		__entry->leaves)
+);
+
+TRACE_EVENT(assoofs_pack_tail,
+	TP_PROTO(struct super_block *sb, u64 ino, u64 size, u64 block, u32 offset),
+	TP_ARGS(sb, ino, size, block, offset),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(u64, size)
+		__field(u64, block)
+		__field(u32, offset)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->size = size;
+		__entry->block = block;
+		__entry->offset = offset;
+	),
+	TP_printk("dev %d,%d ino %llu size %llu block %llu+%u",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->size,
+		__entry->block, __entry->offset)
+);
+
+TRACE_EVENT(assoofs_uninline_dir,
+	TP_PROTO(struct super_block *sb, u64 ino, u64 block),
+	TP_ARGS(sb, ino, block),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(u64, block)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->block = block;
+	),
+	TP_printk("dev %d,%d ino %llu block %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->block)
+);
+
+#endif /* _ASSOOFS_TRACE_H */
+
+/* fuera del guard: define_trace.h vuelve a incluir este fichero */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE assoofs_trace
+#include <trace/define_trace.h>
@@ -2,132 +2,1009 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <time.h>
+#include <linux/fs.h>
 #include "assoofs.h"
 
-#define WELCOMEFILE_DATABLOCK_NUMBER (ASSOOFS_LAST_RESERVED_BLOCK + 1)
-#define WELCOMEFILE_INODE_NUMBER (ASSOOFS_LAST_RESERVED_INODE + 1)
+#define WELCOMEFILE_INODE_NUMBER (ASSOOFS_ROOTDIR_INODE_NUMBER + 1)
 
-static int write_superblock(int fd) {
+/*
+ * Geometria del sistema de ficheros calculada a partir del tamanyo del dispositivo
+ */
+struct layout {
+    uint64_t blocks_count;
+    uint64_t groups_count;
+    uint64_t blocks_per_group;
+    uint64_t inodes_per_group;
+    uint64_t inode_table_blocks;
+    uint64_t group_desc_blocks;
+};
+
+static uint64_t group_first_block(const struct layout *l, uint64_t g) {
+    return g * l->blocks_per_group;
+}
+
+static uint64_t group_end_block(const struct layout *l, uint64_t g) {
+    uint64_t end = (g + 1) * l->blocks_per_group;
+    return end < l->blocks_count ? end : l->blocks_count;
+}
+
+/* el grupo 0 empieza despues del superbloque y de los descriptores */
+static uint64_t group_bitmap_block(const struct layout *l, uint64_t g) {
+    return g ? group_first_block(l, g) : ASSOOFS_GROUP_DESC_BLOCK_NUMBER + l->group_desc_blocks;
+}
+
+/* detras del mapa de bits de bloques van el de inodos y la tabla de inodos */
+static uint64_t group_inode_table_block(const struct layout *l, uint64_t g) {
+    return group_bitmap_block(l, g) + 2;
+}
+
+static uint64_t group_data_block(const struct layout *l, uint64_t g) {
+    return group_inode_table_block(l, g) + l->inode_table_blocks;
+}
+
+/*
+ * Lo que se usa de cada grupo al crear el sistema de ficheros: los bloques de datos ocupados
+ * van todos seguidos al principio de su zona de datos
+ */
+struct group_usage {
+    uint64_t used_blocks;
+    uint64_t used_inodes;
+    uint64_t dirs;
+};
+
+static int write_at(int fd, uint64_t block, const void *buf, size_t len, const char *what) {
+    ssize_t ret;
+
+    ret = pwrite(fd, buf, len, (off_t)(block * ASSOOFS_DEFAULT_BLOCK_SIZE));
+    if (ret != (ssize_t)len) {
+        printf("Writing %s has failed.\n", what);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Fechas del registro: la hora del formateo, o las del original al copiar un arbol con -r
+ */
+static void set_times(struct assoofs_inode_info *i, const struct timespec *atime,
+                      const struct timespec *mtime, const struct timespec *ctime) {
+    i->atime = atime->tv_sec;
+    i->atime_nsec = atime->tv_nsec;
+    i->mtime = mtime->tv_sec;
+    i->mtime_nsec = mtime->tv_nsec;
+    i->ctime = ctime->tv_sec;
+    i->ctime_nsec = ctime->tv_nsec;
+}
+
+static void set_times_now(struct assoofs_inode_info *i) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    set_times(i, &now, &now, &now);
+}
+
+static int compute_layout(struct layout *l, uint64_t device_blocks, uint64_t blocks_per_group) {
+    uint64_t last_group_blocks;
+
+    l->blocks_per_group = blocks_per_group;
+    /* en dispositivos mas pequenyos que un grupo la tabla de inodos se ajusta al dispositivo */
+    l->inodes_per_group = (device_blocks < blocks_per_group ? device_blocks : blocks_per_group) / ASSOOFS_BLOCKS_PER_INODE;
+    l->inodes_per_group = (l->inodes_per_group + ASSOOFS_INODES_PER_BLOCK - 1) / ASSOOFS_INODES_PER_BLOCK * ASSOOFS_INODES_PER_BLOCK;
+    l->inode_table_blocks = l->inodes_per_group / ASSOOFS_INODES_PER_BLOCK;
+    l->blocks_count = device_blocks;
+    l->groups_count = (device_blocks + blocks_per_group - 1) / blocks_per_group;
+    l->group_desc_blocks = (l->groups_count + ASSOOFS_DESCS_PER_BLOCK - 1) / ASSOOFS_DESCS_PER_BLOCK;
+
+    /* si el ultimo grupo no tiene sitio para sus metadatos y algun bloque de datos se descarta */
+    last_group_blocks = device_blocks - group_first_block(l, l->groups_count - 1);
+    if (l->groups_count > 1 && last_group_blocks < 3 + l->inode_table_blocks) {
+        l->groups_count--;
+        l->blocks_count = group_first_block(l, l->groups_count);
+    }
+
+    if (group_data_block(l, 0) >= group_end_block(l, 0)) {
+        printf("The device is too small for the first group.\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int write_superblock(int fd, const struct layout *l, uint64_t free_blocks, uint64_t inodes_count, uint64_t flags) {
     struct assoofs_super_block_info sb = {
-        .version = 1,
+        .version = ASSOOFS_VERSION,
         .magic = ASSOOFS_MAGIC,
         .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,
-        .inodes_count = WELCOMEFILE_INODE_NUMBER,
-        .free_blocks = (~0) & ~(7),
+        .inodes_count = inodes_count,
+        .blocks_count = l->blocks_count,
+        .groups_count = l->groups_count,
+        .blocks_per_group = l->blocks_per_group,
+        .inodes_per_group = l->inodes_per_group,
+        .free_blocks_count = free_blocks,
+        .free_inodes_count = l->groups_count * l->inodes_per_group - inodes_count,
+        .flags = flags,
     };
-    ssize_t ret;
 
-    ret = write(fd, &sb, sizeof(sb));
-    if (ret != ASSOOFS_DEFAULT_BLOCK_SIZE) {
-        printf("Bytes written [%d] are not equal to the default block size.\n", (int)ret);
+    if (write_at(fd, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER, &sb, sizeof(sb), "the superblock"))
         return -1;
-    }
 
     printf("Super block written succesfully.\n");
     return 0;
 }
 
-static int write_root_inode(int fd) {
-    ssize_t ret;
+/*
+ * Escribe los mapas de bits de bloques y de inodos y una tabla de inodos vacia para cada grupo, y la
+ * tabla de descriptores. Los inodos usados son siempre los primeros de su grupo.
+ * Devuelve el numero de bloques libres del sistema de ficheros o -1 si hay error.
+ */
+static int64_t write_groups(int fd, const struct layout *l, const struct group_usage *usage) {
+    unsigned char *bitmap, *zero;
+    struct assoofs_group_desc *descs;
+    uint64_t g, b, first, end, data, free_blocks = 0, i;
+    int64_t ret = -1;
+
+    bitmap = malloc(ASSOOFS_DEFAULT_BLOCK_SIZE);
+    zero = calloc(1, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    descs = calloc(l->group_desc_blocks, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    if (!bitmap || !zero || !descs) {
+        printf("Not enough memory for the group metadata.\n");
+        goto out;
+    }
+
+    for (g = 0; g < l->groups_count; g++) {
+        first = group_first_block(l, g);
+        end = group_end_block(l, g);
+        data = group_data_block(l, g);
+
+        memset(bitmap, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+        for (b = data + usage[g].used_blocks; b < end; b++)
+            bitmap[(b - first) / 8] |= 1 << ((b - first) % 8);
+
+        descs[g].block_bitmap = group_bitmap_block(l, g);
+        descs[g].inode_bitmap = descs[g].block_bitmap + 1;
+        descs[g].inode_table = group_inode_table_block(l, g);
+        descs[g].free_blocks_count = end - data - usage[g].used_blocks;
+        descs[g].free_inodes_count = l->inodes_per_group - usage[g].used_inodes;
+        descs[g].used_inodes = usage[g].used_inodes;
+        descs[g].dirs_count = usage[g].dirs;
+        free_blocks += descs[g].free_blocks_count;
+
+        if (write_at(fd, descs[g].block_bitmap, bitmap, ASSOOFS_DEFAULT_BLOCK_SIZE, "a block bitmap"))
+            goto out;
+
+        memset(bitmap, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+        for (i = usage[g].used_inodes; i < l->inodes_per_group; i++)
+            bitmap[i / 8] |= 1 << (i % 8);
+        if (write_at(fd, descs[g].inode_bitmap, bitmap, ASSOOFS_DEFAULT_BLOCK_SIZE, "an inode bitmap"))
+            goto out;
+        for (i = 0; i < l->inode_table_blocks; i++)
+            if (write_at(fd, descs[g].inode_table + i, zero, ASSOOFS_DEFAULT_BLOCK_SIZE, "an inode table block"))
+                goto out;
+    }
+    printf("%llu bitmaps and inode tables written succesfully.\n", (unsigned long long)l->groups_count);
+
+    if (write_at(fd, ASSOOFS_GROUP_DESC_BLOCK_NUMBER, descs, l->group_desc_blocks * ASSOOFS_DEFAULT_BLOCK_SIZE, "the group descriptors"))
+        goto out;
+    printf("Group descriptors written succesfully.\n");
+    ret = free_blocks;
+
+out:
+    free(bitmap);
+    free(zero);
+    free(descs);
+    return ret;
+}
 
+/*
+ * El directorio raiz se crea en linea con una sola entrada, la del README
+ */
+static int write_root_inode(int fd, const struct layout *l, const char *name, uint64_t inode_no, uint64_t size) {
     struct assoofs_inode_info root_inode;
+    struct assoofs_inline_dirent *dirent;
 
+    memset(&root_inode, 0, sizeof(root_inode));
     root_inode.mode = S_IFDIR;
     root_inode.inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
-    root_inode.data_block_number = ASSOOFS_ROOTDIR_DATABLOCK_NUMBER;
+    root_inode.data_block_number = group_data_block(l, 0); /* objetivo si algun dia necesita un bloque */
+    root_inode.flags = ASSOOFS_INODE_INLINE;
     root_inode.dir_children_count = 1;
+    root_inode.rbytes = size;
+    root_inode.rinodes = 1;
+    set_times_now(&root_inode);
 
-    ret = write(fd, &root_inode, sizeof(root_inode));
+    dirent = (struct assoofs_inline_dirent *)root_inode.inline_data;
+    dirent->inode_no = inode_no;
+    dirent->name_len = strlen(name);
+    memcpy(dirent->name, name, dirent->name_len);
 
-    if (ret != sizeof(root_inode)) {
-        printf("The inode store was not written properly.\n");
+    /* primera posicion de la tabla de inodos del grupo 0 */
+    if (write_at(fd, group_inode_table_block(l, 0), &root_inode, sizeof(root_inode), "the root directory inode"))
         return -1;
-    }
 
     printf("root directory inode written succesfully.\n");
     return 0;
 }
 
-static int write_welcome_inode(int fd, const struct assoofs_inode_info *i) {
-    off_t nbytes;
+static int write_welcome_inode(int fd, const struct layout *l, const struct assoofs_inode_info *i) {
     ssize_t ret;
+    off_t pos;
 
-    ret = write(fd, i, sizeof(*i));
+    /* el inodo 2 va justo detras de la raiz en el mismo bloque de la tabla */
+    pos = (off_t)(group_inode_table_block(l, 0) * ASSOOFS_DEFAULT_BLOCK_SIZE + sizeof(*i));
+    ret = pwrite(fd, i, sizeof(*i), pos);
     if (ret != sizeof(*i)) {
         printf("The welcomefile inode was not written properly.\n");
         return -1;
     }
     printf("welcomefile inode written succesfully.\n");
+    return 0;
+}
+
+static int device_blocks(int fd, uint64_t *blocks) {
+    struct stat st;
+    uint64_t bytes;
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - (sizeof(*i) * 2);
-    ret = lseek(fd, nbytes, SEEK_CUR);
-    if (ret == (off_t)-1) {
-        printf("The padding bytes are not written properly.\n");
+    if (fstat(fd, &st) == -1) {
+        perror("Error reading the device size");
         return -1;
     }
-
-    printf("inode store padding bytes (after two inodes) written sucessfully.\n");
+    bytes = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &bytes) == -1) {
+        perror("Error reading the device size");
+        return -1;
+    }
+    *blocks = bytes / ASSOOFS_DEFAULT_BLOCK_SIZE;
     return 0;
 }
 
-int write_dirent(int fd, const struct assoofs_dir_record_entry *record) {
-    ssize_t nbytes = sizeof(*record), ret;
+/*
+ * Compresor LZ4 (formato de bloque) para las imagenes de solo lectura. El modulo descomprime con
+ * LZ4_decompress_safe; aqui no hace falta liblz4. Busca la coincidencia mas larga entre las
+ * RO_LZ4_DEPTH ultimas posiciones con el mismo hash, que comprime mas que el compresor rapido del modulo.
+ */
+#define RO_LZ4_HASH_BITS 16
+#define RO_LZ4_DEPTH 64
+#define RO_LZ4_MIN_MATCH 4
+#define RO_LZ4_MAX_OFFSET 65535
+
+static uint32_t lz4_hash(const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - RO_LZ4_HASH_BITS);
+}
+
+static uint8_t *lz4_put_len(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+/* una secuencia: literales y, si mlen != 0, la coincidencia que los sigue. NULL si no cabe */
+static uint8_t *lz4_emit(uint8_t *op, const uint8_t *oend, const uint8_t *lit, size_t nlit, size_t offset, size_t mlen) {
+    uint8_t *token = op++;
+
+    if (op + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1 > oend)
+        return NULL;
+    *token = (nlit < 15 ? nlit : 15) << 4;
+    if (nlit >= 15)
+        op = lz4_put_len(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen)
+        return op;
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    mlen -= RO_LZ4_MIN_MATCH;
+    *token |= mlen < 15 ? mlen : 15;
+    if (mlen >= 15)
+        op = lz4_put_len(op, mlen - 15);
+    return op;
+}
+
+/* comprime src[0, n) en dst; devuelve los bytes escritos o 0 si no caben en cap */
+static size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    static int32_t head[1 << RO_LZ4_HASH_BITS];
+    static int32_t chain[ASSOOFS_CLUSTER_SIZE];
+    /* la ultima coincidencia empieza 12 bytes antes del final y los 5 ultimos son siempre literales */
+    size_t mflimit = n > 12 ? n - 12 : 0, matchlimit = n > 5 ? n - 5 : 0;
+    size_t ip = 0, anchor = 0, p, len, best_len, best_off = 0;
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + cap;
+    int32_t cand;
+    uint32_t h;
+    int depth;
+
+    memset(head, 0xff, sizeof(head));
+    while (ip < mflimit) {
+        h = lz4_hash(src + ip);
+        best_len = 0;
+        for (cand = head[h], depth = 0; cand >= 0 && ip - cand <= RO_LZ4_MAX_OFFSET && depth < RO_LZ4_DEPTH;
+             cand = chain[cand], depth++) {
+            for (len = 0; ip + len < matchlimit && src[cand + len] == src[ip + len]; len++)
+                ;
+            if (len > best_len) {
+                best_len = len;
+                best_off = ip - cand;
+            }
+        }
+        chain[ip] = head[h];
+        head[h] = ip;
+        if (best_len < RO_LZ4_MIN_MATCH) {
+            ip++;
+            continue;
+        }
+
+        op = lz4_emit(op, oend, src + anchor, ip - anchor, best_off, best_len);
+        if (!op)
+            return 0;
+        for (p = ip + 1; p < ip + best_len && p < mflimit; p++) {
+            h = lz4_hash(src + p);
+            chain[p] = head[h];
+            head[h] = p;
+        }
+        ip += best_len;
+        anchor = ip;
+    }
+
+    op = lz4_emit(op, oend, src + anchor, n - anchor, 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+/*
+ * Imagen de solo lectura (mkassoofs -r): el arbol de un directorio se copia en una imagen justa,
+ * marcada ASSOOFS_SB_READONLY. Los inodos se numeran recorriendo el arbol por niveles, asi los hijos
+ * de un directorio quedan seguidos en la tabla de inodos, y los datos se colocan en ese mismo orden:
+ *   - directorios en linea si caben, si no en un bloque de entradas;
+ *   - enlaces simbolicos en linea si caben, si no en un bloque;
+ *   - ficheros de hasta ASSOOFS_INLINE_DATA_SIZE bytes en linea;
+ *   - hasta ASSOOFS_TAIL_MAX_SIZE empaquetados en bloques compartidos;
+ *   - el resto en clusters LZ4 (sin comprimir si comprimido no ahorra ningun bloque).
+ */
+struct ro_node {
+    char *path;
+    char name[ASSOOFS_FILENAME_MAXLEN + 1];
+    struct stat st;
+    uint64_t first_child;        /* los hijos de un directorio son nodes[first_child, first_child + nchildren) */
+    uint64_t nchildren;
+    uint64_t block;              /* bloque del directorio, bloque compartido o primer cluster */
+    uint32_t tail_offset;
+    uint64_t nclusters;
+    uint32_t *csize;             /* bytes guardados de cada cluster, con ASSOOFS_CLUSTER_RAW */
+    uint32_t *cluster_block;
+    uint64_t index_root;
+    uint64_t *leaves;
+    uint64_t rbytes;             /* directorios: contadores recursivos de uso */
+    uint64_t rinodes;
+};
 
-    ret = write(fd, record, nbytes);
-    if (ret != nbytes) {
-        printf("Writing the rootdirectory datablock (name+inode_no pair for welcomefile) has failed.\n");
+struct ro_image {
+    struct ro_node *nodes;
+    uint64_t count;
+    uint64_t size;
+    uint8_t *cluster;            /* un cluster leido y su version comprimida */
+    uint8_t *packed;
+};
+
+static int ro_inline_dir(const struct ro_image *img, const struct ro_node *dir) {
+    uint64_t i, size = 0;
+
+    for (i = 0; i < dir->nchildren; i++)
+        size += sizeof(struct assoofs_inline_dirent) + strlen(img->nodes[dir->first_child + i].name);
+    return size <= ASSOOFS_INLINE_DATA_SIZE;
+}
+
+static int ro_skip_dots(const struct dirent *d) {
+    return strcmp(d->d_name, ".") && strcmp(d->d_name, "..");
+}
+
+static struct ro_node *ro_add_node(struct ro_image *img, const char *path, const char *name) {
+    struct ro_node *node;
+
+    if (img->count == img->size) {
+        img->size = img->size ? 2 * img->size : 64;
+        node = realloc(img->nodes, img->size * sizeof(*node));
+        if (!node) {
+            printf("Not enough memory for the file tree.\n");
+            return NULL;
+        }
+        img->nodes = node;
+    }
+    node = &img->nodes[img->count];
+    memset(node, 0, sizeof(*node));
+    node->path = strdup(path);
+    strcpy(node->name, name);
+    if (!node->path || lstat(path, &node->st) == -1) {
+        perror(path);
+        free(node->path);
+        return NULL;
+    }
+    img->count++;
+    return node;
+}
+
+/* recorre el arbol por niveles; se copian ficheros regulares, directorios y enlaces simbolicos */
+static int ro_scan(struct ro_image *img, const char *root) {
+    struct dirent **list;
+    struct ro_node *node;
+    uint64_t i, first;
+    char *path;
+    int n, k, ret = 0;
+
+    node = ro_add_node(img, root, "");
+    if (!node)
         return -1;
+    if (!S_ISDIR(node->st.st_mode)) {
+        printf("%s is not a directory.\n", root);
+        return -1;
+    }
+
+    for (i = 0; i < img->count && !ret; i++) {
+        if (!S_ISDIR(img->nodes[i].st.st_mode))
+            continue;
+        n = scandir(img->nodes[i].path, &list, ro_skip_dots, alphasort);
+        if (n < 0) {
+            perror(img->nodes[i].path);
+            return -1;
+        }
+        first = img->count;
+        for (k = 0; k < n; k++) {
+            if (!ret && strlen(list[k]->d_name) > ASSOOFS_FILENAME_MAXLEN) {
+                printf("The name %s is too long.\n", list[k]->d_name);
+                ret = -1;
+            }
+            if (!ret) {
+                path = malloc(strlen(img->nodes[i].path) + strlen(list[k]->d_name) + 2);
+                if (!path) {
+                    printf("Not enough memory for the file tree.\n");
+                    ret = -1;
+                }
+            }
+            if (!ret) {
+                sprintf(path, "%s/%s", img->nodes[i].path, list[k]->d_name);
+                node = ro_add_node(img, path, list[k]->d_name);
+                free(path);
+                if (!node)
+                    ret = -1;
+                else if (!S_ISREG(node->st.st_mode) && !S_ISDIR(node->st.st_mode) && !S_ISLNK(node->st.st_mode)) {
+                    printf("Skipping %s: only regular files, directories and symlinks are copied.\n", node->path);
+                    free(node->path);
+                    img->count--;
+                }
+            }
+            free(list[k]);
+        }
+        free(list);
+        img->nodes[i].first_child = first;
+        img->nodes[i].nchildren = img->count - first;
+
+        if (!ret && !ro_inline_dir(img, &img->nodes[i]) && img->nodes[i].nchildren > ASSOOFS_DIR_ENTRIES_PER_BLOCK) {
+            printf("%s has more than %d entries.\n", img->nodes[i].path, (int)ASSOOFS_DIR_ENTRIES_PER_BLOCK);
+            ret = -1;
+        }
     }
-    printf("root directory datablocks (name+inode_no pair for welcomefile) written succesfully.\n");
+    return ret;
+}
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(*record);
-    ret = lseek(fd, nbytes, SEEK_CUR);
-    if (ret == (off_t)-1) {
-        printf("Writing the padding for rootdirectory children datablock has failed.\n");
+/* lee el cluster c del fichero y lo comprime. Devuelve los bytes guardados, con ASSOOFS_CLUSTER_RAW si van tal cual */
+static int64_t ro_pack_cluster(struct ro_image *img, int fd, const struct ro_node *node, uint64_t c) {
+    uint64_t usize, blocks;
+    size_t csize;
+
+    usize = node->st.st_size - c * ASSOOFS_CLUSTER_SIZE;
+    if (usize > ASSOOFS_CLUSTER_SIZE)
+        usize = ASSOOFS_CLUSTER_SIZE;
+    if (pread(fd, img->cluster, usize, (off_t)(c * ASSOOFS_CLUSTER_SIZE)) != (ssize_t)usize) {
+        printf("Reading %s has failed.\n", node->path);
         return -1;
     }
-    printf("Padding after the rootdirectory children written succesfully.\n");
+
+    /* igual que el modulo: comprimido tiene que ocupar al menos un bloque menos */
+    blocks = (usize + ASSOOFS_DEFAULT_BLOCK_SIZE - 1) / ASSOOFS_DEFAULT_BLOCK_SIZE;
+    csize = lz4_compress(img->cluster, usize, img->packed, (blocks - 1) * ASSOOFS_DEFAULT_BLOCK_SIZE);
+    if (!csize) {
+        memcpy(img->packed, img->cluster, usize);
+        return usize | ASSOOFS_CLUSTER_RAW;
+    }
+    return csize;
+}
+
+static uint64_t ro_cluster_blocks(uint32_t csize) {
+    return ((csize & ~ASSOOFS_CLUSTER_RAW) + ASSOOFS_DEFAULT_BLOCK_SIZE - 1) / ASSOOFS_DEFAULT_BLOCK_SIZE;
+}
+
+/* contadores recursivos de cada directorio; los hijos siempre van detras de su padre */
+static void ro_usage(struct ro_image *img) {
+    struct ro_node *node, *child;
+    uint64_t i, k;
+
+    for (i = img->count; i-- > 0; ) {
+        node = &img->nodes[i];
+        if (!S_ISDIR(node->st.st_mode))
+            continue;
+        for (k = 0; k < node->nchildren; k++) {
+            child = &img->nodes[node->first_child + k];
+            node->rinodes += 1 + child->rinodes;
+            node->rbytes += S_ISDIR(child->st.st_mode) ? child->rbytes : (uint64_t)child->st.st_size;
+        }
+    }
+}
+
+/* primera pasada: cuanto ocupa cada cluster comprimido */
+static int ro_measure(struct ro_image *img) {
+    struct ro_node *node;
+    uint64_t i, c;
+    int64_t csize;
+    int fd;
+
+    for (i = 0; i < img->count; i++) {
+        node = &img->nodes[i];
+        if (!S_ISREG(node->st.st_mode) || node->st.st_size <= ASSOOFS_TAIL_MAX_SIZE)
+            continue;
+
+        node->nclusters = (node->st.st_size + ASSOOFS_CLUSTER_SIZE - 1) / ASSOOFS_CLUSTER_SIZE;
+        if (node->nclusters > ASSOOFS_INLINE_CLUSTERS + ASSOOFS_CLUSTER_INDEX_BLOCKS * ASSOOFS_CLUSTERS_PER_BLOCK) {
+            printf("%s is too big.\n", node->path);
+            return -1;
+        }
+        node->csize = calloc(node->nclusters, sizeof(*node->csize));
+        node->cluster_block = calloc(node->nclusters, sizeof(*node->cluster_block));
+        if (!node->csize || !node->cluster_block) {
+            printf("Not enough memory for the cluster sizes.\n");
+            return -1;
+        }
+
+        fd = open(node->path, O_RDONLY);
+        if (fd == -1) {
+            perror(node->path);
+            return -1;
+        }
+        for (c = 0; c < node->nclusters; c++) {
+            csize = ro_pack_cluster(img, fd, node, c);
+            if (csize < 0)
+                break;
+            node->csize[c] = csize;
+        }
+        close(fd);
+        if (c < node->nclusters)
+            return -1;
+    }
     return 0;
 }
 
-int write_block(int fd, char *block, size_t len) {
-    ssize_t ret;
+/* reserva n bloques seguidos a partir del grupo *g; los datos de la imagen van uno detras de otro */
+static int ro_alloc(const struct layout *l, struct group_usage *usage, uint64_t *g, uint64_t n, uint64_t *block) {
+    uint64_t data, room;
 
-    ret = write(fd, block, len);
-    if (ret != len) {
-        printf("Writing file body has failed.\n");
+    for (; *g < l->groups_count; (*g)++) {
+        data = group_data_block(l, *g);
+        room = group_end_block(l, *g) > data ? group_end_block(l, *g) - data : 0;
+        if (usage[*g].used_blocks + n <= room) {
+            *block = data + usage[*g].used_blocks;
+            usage[*g].used_blocks += n;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Coloca la imagen en groups_count grupos. Devuelve -1 si no cabe y hay que probar con mas grupos.
+ */
+static int ro_place(struct ro_image *img, struct layout *l, struct group_usage *usage) {
+    struct ro_node *node;
+    uint64_t i, c, g = 0, n, tail_block = 0, tail_used = ASSOOFS_DEFAULT_BLOCK_SIZE;
+
+    memset(usage, 0, l->groups_count * sizeof(*usage));
+    for (i = 0; i < img->count; i++) {
+        g = i / l->inodes_per_group;
+        usage[g].used_inodes++;
+        if (S_ISDIR(img->nodes[i].st.st_mode))
+            usage[g].dirs++;
+    }
+
+    g = 0;
+    for (i = 0; i < img->count; i++) {
+        node = &img->nodes[i];
+        if (S_ISDIR(node->st.st_mode)) {
+            if (!ro_inline_dir(img, node) && ro_alloc(l, usage, &g, 1, &node->block))
+                return -1;
+        } else if (S_ISLNK(node->st.st_mode)) {
+            if (node->st.st_size >= ASSOOFS_INLINE_DATA_SIZE && ro_alloc(l, usage, &g, 1, &node->block))
+                return -1;
+        } else if (node->st.st_size > ASSOOFS_TAIL_MAX_SIZE) {
+            for (c = 0; c < node->nclusters; c++) {
+                if (ro_alloc(l, usage, &g, ro_cluster_blocks(node->csize[c]), &node->block))
+                    return -1;
+                node->cluster_block[c] = node->block;
+            }
+            node->block = node->cluster_block[0];
+            if (node->nclusters > ASSOOFS_INLINE_CLUSTERS) {
+                n = (node->nclusters - ASSOOFS_INLINE_CLUSTERS + ASSOOFS_CLUSTERS_PER_BLOCK - 1) / ASSOOFS_CLUSTERS_PER_BLOCK;
+                free(node->leaves);
+                node->leaves = calloc(n, sizeof(*node->leaves));
+                if (!node->leaves || ro_alloc(l, usage, &g, 1, &node->index_root))
+                    return -1;
+                for (c = 0; c < n; c++)
+                    if (ro_alloc(l, usage, &g, 1, &node->leaves[c]))
+                        return -1;
+            }
+        } else if (node->st.st_size > ASSOOFS_INLINE_DATA_SIZE) {
+            if (tail_used + node->st.st_size > ASSOOFS_DEFAULT_BLOCK_SIZE) {
+                if (ro_alloc(l, usage, &g, 1, &tail_block))
+                    return -1;
+                tail_used = sizeof(struct assoofs_tail_header);
+            }
+            node->block = tail_block;
+            node->tail_offset = tail_used;
+            tail_used += node->st.st_size;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Geometria justa: inodos solo para el arbol y el ultimo grupo acaba en el ultimo bloque usado.
+ * Se empieza con un grupo y se anyaden hasta que todo cabe.
+ */
+static int ro_layout(struct ro_image *img, struct layout *l, struct group_usage **usage, uint64_t blocks_per_group) {
+    struct group_usage *u;
+    uint64_t g, k, c, data = 0;
+
+    /* cota de los bloques de datos: con menos grupos seguro que no cabe, con mas de un grupo por bloque sobran */
+    for (k = 0; k < img->count; k++) {
+        data++;
+        for (c = 0; c < img->nodes[k].nclusters; c++)
+            data += ro_cluster_blocks(img->nodes[k].csize[c]) + 1;
+    }
+
+    l->blocks_per_group = blocks_per_group;
+    for (g = data / blocks_per_group + 1; g <= data + 1; g++) {
+        l->groups_count = g;
+        l->group_desc_blocks = (g + ASSOOFS_DESCS_PER_BLOCK - 1) / ASSOOFS_DESCS_PER_BLOCK;
+        l->inodes_per_group = (img->count + g - 1) / g;
+        l->inodes_per_group = (l->inodes_per_group + ASSOOFS_INODES_PER_BLOCK - 1) / ASSOOFS_INODES_PER_BLOCK * ASSOOFS_INODES_PER_BLOCK;
+        l->inode_table_blocks = l->inodes_per_group / ASSOOFS_INODES_PER_BLOCK;
+        l->blocks_count = g * blocks_per_group;
+
+        u = realloc(*usage, g * sizeof(*u));
+        if (!u) {
+            printf("Not enough memory for the group usage.\n");
+            return -1;
+        }
+        *usage = u;
+
+        if (group_data_block(l, g - 1) > group_end_block(l, g - 1) || group_data_block(l, 0) > group_end_block(l, 0))
+            continue;
+        if (!ro_place(img, l, u)) {
+            l->blocks_count = group_data_block(l, g - 1) + u[g - 1].used_blocks;
+            return 0;
+        }
+    }
+    printf("The tree does not fit in any layout.\n");
+    return -1;
+}
+
+static int ro_write_inode(int fd, const struct layout *l, const struct assoofs_inode_info *i) {
+    uint64_t slot = (i->inode_no - 1) % l->inodes_per_group;
+    off_t pos;
+
+    pos = (off_t)((group_inode_table_block(l, (i->inode_no - 1) / l->inodes_per_group) + slot / ASSOOFS_INODES_PER_BLOCK)
+                  * ASSOOFS_DEFAULT_BLOCK_SIZE + slot % ASSOOFS_INODES_PER_BLOCK * sizeof(*i));
+    if (pwrite(fd, i, sizeof(*i), pos) != sizeof(*i)) {
+        printf("Writing the inode %llu has failed.\n", (unsigned long long)i->inode_no);
         return -1;
     }
-    printf("block has been written succesfully.\n");
     return 0;
 }
 
+static int ro_write_dir(int fd, const struct ro_image *img, const struct ro_node *dir, struct assoofs_inode_info *i) {
+    struct assoofs_dir_record_entry records[ASSOOFS_DIR_ENTRIES_PER_BLOCK];
+    struct assoofs_inline_dirent *dirent;
+    const struct ro_node *child;
+    uint64_t k;
+    size_t pos = 0;
+
+    i->dir_children_count = dir->nchildren;
+    i->rbytes = dir->rbytes;
+    i->rinodes = dir->rinodes;
+    for (k = 0; k < dir->nchildren; k++)
+        if (S_ISDIR(img->nodes[dir->first_child + k].st.st_mode))
+            i->subdirs++;
+    if (ro_inline_dir(img, dir)) {
+        i->flags = ASSOOFS_INODE_INLINE;
+        for (k = 0; k < dir->nchildren; k++) {
+            child = &img->nodes[dir->first_child + k];
+            dirent = (struct assoofs_inline_dirent *)(i->inline_data + pos);
+            dirent->inode_no = dir->first_child + k + 1;
+            dirent->name_len = strlen(child->name);
+            memcpy(dirent->name, child->name, dirent->name_len);
+            pos += sizeof(*dirent) + dirent->name_len;
+        }
+        return 0;
+    }
+
+    memset(records, 0, sizeof(records));
+    for (k = 0; k < dir->nchildren; k++) {
+        child = &img->nodes[dir->first_child + k];
+        memcpy(records[k].filename, child->name, strlen(child->name));
+        records[k].inode_no = dir->first_child + k + 1;
+    }
+    i->data_block_number = dir->block;
+    i->extents[0].start = dir->block;
+    i->extents[0].len = 1;
+    return write_at(fd, dir->block, records, sizeof(records), "a directory block");
+}
+
+/* el destino de un enlace, terminado en '\0', en el registro o en su bloque */
+static int ro_write_symlink(int fd, const struct ro_node *node, struct assoofs_inode_info *i) {
+    char target[ASSOOFS_DEFAULT_BLOCK_SIZE];
+    ssize_t len;
+
+    memset(target, 0, sizeof(target));
+    len = readlink(node->path, target, sizeof(target));
+    if (len < 0 || len != node->st.st_size || len >= ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        printf("Reading the symlink %s has failed.\n", node->path);
+        return -1;
+    }
+
+    i->file_size = len;
+    if (len < ASSOOFS_INLINE_DATA_SIZE) {
+        i->flags = ASSOOFS_INODE_INLINE;
+        memcpy(i->inline_data, target, len);
+        return 0;
+    }
+    i->data_block_number = node->block;
+    i->extents[0].start = node->block;
+    i->extents[0].len = 1;
+    return write_at(fd, node->block, target, sizeof(target), "a symlink block");
+}
+
+static int ro_write_clusters(int fd, struct ro_image *img, const struct ro_node *node, struct assoofs_inode_info *i) {
+    struct assoofs_cluster_entry *entries = (struct assoofs_cluster_entry *)i->inline_data, *leaf = NULL;
+    uint32_t *root = NULL;
+    uint64_t c, n;
+    int64_t csize;
+    int in, ret = -1;
+
+    in = open(node->path, O_RDONLY);
+    if (in == -1) {
+        perror(node->path);
+        return -1;
+    }
+    n = node->nclusters > ASSOOFS_INLINE_CLUSTERS ? node->nclusters - ASSOOFS_INLINE_CLUSTERS : 0;
+    n = (n + ASSOOFS_CLUSTERS_PER_BLOCK - 1) / ASSOOFS_CLUSTERS_PER_BLOCK;
+    root = calloc(1, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    leaf = calloc(n ? n : 1, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    if (!root || !leaf) {
+        printf("Not enough memory for the cluster index.\n");
+        goto out;
+    }
+
+    for (c = 0; c < node->nclusters; c++) {
+        csize = ro_pack_cluster(img, in, node, c);
+        if (csize < 0)
+            goto out;
+        if (csize != node->csize[c]) {
+            printf("%s has changed while building the image.\n", node->path);
+            goto out;
+        }
+        memset(img->packed + (csize & ~ASSOOFS_CLUSTER_RAW), 0,
+               ro_cluster_blocks(csize) * ASSOOFS_DEFAULT_BLOCK_SIZE - (csize & ~ASSOOFS_CLUSTER_RAW));
+        if (write_at(fd, node->cluster_block[c], img->packed, ro_cluster_blocks(csize) * ASSOOFS_DEFAULT_BLOCK_SIZE, "a cluster"))
+            goto out;
+
+        if (c < ASSOOFS_INLINE_CLUSTERS) {
+            entries[c].start = node->cluster_block[c];
+            entries[c].size = csize;
+        } else {
+            leaf[c - ASSOOFS_INLINE_CLUSTERS].start = node->cluster_block[c];
+            leaf[c - ASSOOFS_INLINE_CLUSTERS].size = csize;
+        }
+    }
+
+    for (c = 0; c < n; c++) {
+        root[c] = node->leaves[c];
+        if (write_at(fd, node->leaves[c], leaf + c * ASSOOFS_CLUSTERS_PER_BLOCK, ASSOOFS_DEFAULT_BLOCK_SIZE, "a cluster index block"))
+            goto out;
+    }
+    if (n && write_at(fd, node->index_root, root, ASSOOFS_DEFAULT_BLOCK_SIZE, "a cluster index root"))
+        goto out;
+
+    i->flags = ASSOOFS_INODE_COMPRESSED;
+    i->data_block_number = node->block;
+    i->cluster_index = node->index_root;
+    ret = 0;
+out:
+    free(root);
+    free(leaf);
+    close(in);
+    return ret;
+}
+
+/*
+ * Segunda pasada: registros de los inodos y datos. Los bloques compartidos se llenan en el mismo
+ * orden en que ro_place les dio sitio y se escriben cuando se pasa al siguiente.
+ */
+static int ro_write_tree(int fd, struct ro_image *img, const struct layout *l) {
+    struct assoofs_inode_info i;
+    struct assoofs_tail_header *hdr;
+    struct ro_node *node;
+    uint8_t *tail;
+    uint64_t k, tail_block = 0;
+    int in, ret = -1;
+
+    tail = calloc(1, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    if (!tail) {
+        printf("Not enough memory for the shared blocks.\n");
+        return -1;
+    }
+    hdr = (struct assoofs_tail_header *)tail;
+
+    for (k = 0; k < img->count; k++) {
+        node = &img->nodes[k];
+        memset(&i, 0, sizeof(i));
+        i.mode = node->st.st_mode & (S_IFMT | 07777);
+        i.inode_no = k + 1;
+        i.data_block_number = group_data_block(l, 0); /* objetivo, no se usa en una imagen de solo lectura */
+        set_times(&i, &node->st.st_atim, &node->st.st_mtim, &node->st.st_ctim);
+
+        if (S_ISDIR(node->st.st_mode)) {
+            if (ro_write_dir(fd, img, node, &i))
+                goto out;
+        } else if (S_ISLNK(node->st.st_mode)) {
+            if (ro_write_symlink(fd, node, &i))
+                goto out;
+        } else if (node->st.st_size > ASSOOFS_TAIL_MAX_SIZE) {
+            i.file_size = node->st.st_size;
+            if (ro_write_clusters(fd, img, node, &i))
+                goto out;
+        } else {
+            i.file_size = node->st.st_size;
+            if (node->st.st_size > ASSOOFS_INLINE_DATA_SIZE) {
+                if (node->block != tail_block) {
+                    if (tail_block && write_at(fd, tail_block, tail, ASSOOFS_DEFAULT_BLOCK_SIZE, "a shared block"))
+                        goto out;
+                    memset(tail, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+                    hdr->used = sizeof(*hdr);
+                    tail_block = node->block;
+                }
+                i.flags = ASSOOFS_INODE_TAIL;
+                i.tail_block = node->block;
+                i.tail_offset = node->tail_offset;
+                i.tail_len = node->st.st_size;
+                hdr->refs++;
+                hdr->used += node->st.st_size;
+            } else {
+                i.flags = ASSOOFS_INODE_INLINE;
+            }
+
+            in = open(node->path, O_RDONLY);
+            if (in == -1) {
+                perror(node->path);
+                goto out;
+            }
+            if (read(in, i.flags & ASSOOFS_INODE_TAIL ? tail + node->tail_offset : i.inline_data, node->st.st_size)
+                != node->st.st_size) {
+                printf("Reading %s has failed.\n", node->path);
+                close(in);
+                goto out;
+            }
+            close(in);
+        }
+
+        if (ro_write_inode(fd, l, &i))
+            goto out;
+    }
+    if (tail_block && write_at(fd, tail_block, tail, ASSOOFS_DEFAULT_BLOCK_SIZE, "a shared block"))
+        goto out;
+    ret = 0;
+out:
+    free(tail);
+    return ret;
+}
+
+static int build_ro_image(int fd, const char *root, uint64_t blocks_per_group) {
+    struct ro_image img = { 0 };
+    struct group_usage *usage = NULL;
+    struct layout l;
+    struct stat st;
+    uint64_t blocks, k;
+    int64_t free_blocks;
+    int ret = -1;
+
+    img.cluster = malloc(ASSOOFS_CLUSTER_SIZE);
+    img.packed = malloc(ASSOOFS_CLUSTER_SIZE);
+    if (!img.cluster || !img.packed) {
+        printf("Not enough memory for the cluster buffers.\n");
+        goto out;
+    }
+
+    if (ro_scan(&img, root))
+        goto out;
+    ro_usage(&img);
+    if (ro_measure(&img) || ro_layout(&img, &l, &usage, blocks_per_group))
+        goto out;
+
+    if (fstat(fd, &st) == -1) {
+        perror("Error reading the device size");
+        goto out;
+    }
+    if (S_ISREG(st.st_mode)) {
+        if (ftruncate(fd, (off_t)(l.blocks_count * ASSOOFS_DEFAULT_BLOCK_SIZE)) == -1) {
+            perror("Error resizing the image");
+            goto out;
+        }
+    } else if (device_blocks(fd, &blocks) || blocks < l.blocks_count) {
+        printf("The image needs %llu blocks.\n", (unsigned long long)l.blocks_count);
+        goto out;
+    }
+
+    free_blocks = write_groups(fd, &l, usage);
+    if (free_blocks < 0 || ro_write_tree(fd, &img, &l))
+        goto out;
+    if (write_superblock(fd, &l, free_blocks, img.count, ASSOOFS_SB_READONLY))
+        goto out;
+
+    printf("Read-only image: %llu inodes in %llu blocks, %llu groups.\n", (unsigned long long)img.count,
+           (unsigned long long)l.blocks_count, (unsigned long long)l.groups_count);
+    ret = 0;
+out:
+    for (k = 0; k < img.count; k++) {
+        free(img.nodes[k].path);
+        free(img.nodes[k].csize);
+        free(img.nodes[k].cluster_block);
+        free(img.nodes[k].leaves);
+    }
+    free(img.nodes);
+    free(img.cluster);
+    free(img.packed);
+    free(usage);
+    return ret;
+}
+
 int main(int argc, char *argv[])
 {
     int fd;
     ssize_t ret;
+    int64_t free_blocks;
+    uint64_t blocks, blocks_per_group = ASSOOFS_DEFAULT_BLOCKS_PER_GROUP;
+    struct layout l;
+    struct group_usage *usage;
+    const char *image_root = NULL;
     char welcomefile_body[] = "Hola mundo, os saludo desde un sistema de ficheros ASSOOFS.\n";
-    
+
     struct assoofs_inode_info welcome = {
         .mode = S_IFREG,
         .inode_no = WELCOMEFILE_INODE_NUMBER,
-        .data_block_number = WELCOMEFILE_DATABLOCK_NUMBER,
         .file_size = sizeof(welcomefile_body),
-    };
-    
-    struct assoofs_dir_record_entry record = {
-        .filename = "README.txt",
-        .inode_no = WELCOMEFILE_INODE_NUMBER,
+        .flags = ASSOOFS_INODE_INLINE,
     };
 
-    if (argc != 2) {
-        printf("Usage: mkassoofs <device>\n");
+    if (argc > 2 && !strcmp(argv[1], "-r")) {
+        image_root = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc != 2 && argc != 3) {
+        printf("Usage: mkassoofs [-r <dir>] <device> [blocks_per_group]\n");
         return -1;
     }
+    if (argc == 3) {
+        blocks_per_group = strtoull(argv[2], NULL, 0);
+        if (blocks_per_group < 8 || blocks_per_group > ASSOOFS_DEFAULT_BLOCKS_PER_GROUP) {
+            printf("blocks_per_group must be between 8 and %d.\n", ASSOOFS_DEFAULT_BLOCKS_PER_GROUP);
+            return -1;
+        }
+    }
 
     fd = open(argv[1], O_RDWR);
     if (fd == -1) {
@@ -135,23 +1012,50 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    if (image_root) {
+        ret = build_ro_image(fd, image_root, blocks_per_group) ? 1 : 0;
+        close(fd);
+        return ret;
+    }
+
     ret = 1;
     do {
-        if (write_superblock(fd))
+        if (device_blocks(fd, &blocks))
             break;
 
-        if (write_root_inode(fd))
+        if (compute_layout(&l, blocks, blocks_per_group))
             break;
-        
-        if (write_welcome_inode(fd, &welcome))
+
+        /* el README cabe en el registro del inodo */
+        welcome.data_block_number = group_data_block(&l, 0);
+        memcpy(welcome.inline_data, welcomefile_body, sizeof(welcomefile_body));
+
+        usage = calloc(l.groups_count, sizeof(*usage));
+        if (!usage) {
+            printf("Not enough memory for the group usage.\n");
+            break;
+        }
+        /* directorio raiz y README, los dos en linea: no usan bloques de datos */
+        usage[0].used_inodes = WELCOMEFILE_INODE_NUMBER;
+        usage[0].dirs = 1;
+        free_blocks = write_groups(fd, &l, usage);
+        free(usage);
+        if (free_blocks < 0)
             break;
 
-        if (write_dirent(fd, &record))
+        if (write_superblock(fd, &l, free_blocks, WELCOMEFILE_INODE_NUMBER, 0))
             break;
-        
-        if (write_block(fd, welcomefile_body, welcome.file_size))
+
+        if (write_root_inode(fd, &l, "README.txt", WELCOMEFILE_INODE_NUMBER, welcome.file_size))
+            break;
+
+        set_times_now(&welcome);
+        if (write_welcome_inode(fd, &l, &welcome))
             break;
 
+        printf("%llu blocks in %llu groups of %llu blocks, %llu inodes per group.\n",
+               (unsigned long long)l.blocks_count, (unsigned long long)l.groups_count,
+               (unsigned long long)l.blocks_per_group, (unsigned long long)l.inodes_per_group);
         ret = 0;
     } while (0);
 